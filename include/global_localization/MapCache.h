@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pcl/point_cloud.h>
+
+/**
+ * 地图目录中预计算结构(bnb网格、GICP协方差等)的缓存文件。
+ * 文件头记录生成它的地图点云的校验和以及数据段的长度和校验和，地图改变、参数改变或文件损坏(包括写到一半退出)时加载失败，
+ * 调用者重新计算后覆盖。加载时mmap整个文件，数据段直接从映射的内存中拷贝。
+ */
+namespace MapCache
+{
+    struct FileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t map_checksum;
+        uint64_t payload_bytes;
+        uint64_t payload_checksum;
+    };
+
+    inline uint64_t mix(uint64_t hash, uint64_t word)
+    {
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        return hash ^ (hash >> 32);
+    }
+
+    inline uint64_t checksum(const void *data, size_t bytes, uint64_t seed = 0)
+    {
+        const char *ptr = static_cast<const char *>(data);
+        uint64_t hash = mix(seed, bytes);
+        for (; bytes >= sizeof(uint64_t); ptr += sizeof(uint64_t), bytes -= sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, ptr, sizeof(word));
+            hash = mix(hash, word);
+        }
+        if (bytes > 0)
+        {
+            uint64_t word = 0;
+            std::memcpy(&word, ptr, bytes);
+            hash = mix(hash, word);
+        }
+        return hash;
+    }
+
+    // 只用点坐标，点的其他字段(强度等)不影响预计算结构
+    template <typename PointT>
+    uint64_t pointCloudChecksum(const pcl::PointCloud<PointT> &cloud)
+    {
+        uint64_t hash = mix(0, cloud.points.size());
+        for (const auto &point : cloud.points)
+        {
+            uint32_t xyz[3];
+            std::memcpy(&xyz[0], &point.x, sizeof(float));
+            std::memcpy(&xyz[1], &point.y, sizeof(float));
+            std::memcpy(&xyz[2], &point.z, sizeof(float));
+            hash = mix(mix(hash, xyz[0] | (uint64_t(xyz[1]) << 32)), xyz[2]);
+        }
+        return hash;
+    }
+
+    // 数据段在内存中拼好，计算校验和后先写临时文件再改名，读者不会看到写了一半的文件
+    class Writer
+    {
+    public:
+        void write(const void *data, size_t bytes)
+        {
+            const char *ptr = static_cast<const char *>(data);
+            payload_.insert(payload_.end(), ptr, ptr + bytes);
+        }
+
+        template <typename T>
+        void write(const T &value)
+        {
+            write(&value, sizeof(T));
+        }
+
+        bool save(const std::string &file, const char (&magic)[8], uint32_t version, uint64_t map_checksum) const
+        {
+            FileHeader header;
+            std::memcpy(header.magic, magic, sizeof(header.magic));
+            header.version = version;
+            header.reserved = 0;
+            header.map_checksum = map_checksum;
+            header.payload_bytes = payload_.size();
+            header.payload_checksum = checksum(payload_.data(), payload_.size());
+
+            const std::string tmp_file = file + ".tmp";
+            {
+                std::ofstream out(tmp_file, std::ios::binary | std::ios::trunc);
+                if (!out.is_open())
+                    return false;
+                out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+                out.write(payload_.data(), payload_.size());
+                if (!out.good())
+                {
+                    out.close();
+                    std::remove(tmp_file.c_str());
+                    return false;
+                }
+            }
+            return std::rename(tmp_file.c_str(), file.c_str()) == 0;
+        }
+
+    private:
+        std::vector<char> payload_;
+    };
+
+    class Reader
+    {
+    public:
+        Reader() = default;
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+
+        ~Reader()
+        {
+            if (addr_ != nullptr)
+                munmap(addr_, file_size_);
+        }
+
+        // 文件不存在，或magic、版本、地图校验和、数据段校验和任一不符时返回false
+        bool open(const std::string &file, const char (&magic)[8], uint32_t version, uint64_t map_checksum)
+        {
+            int fd = ::open(file.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(FileHeader))
+            {
+                close(fd);
+                return false;
+            }
+
+            file_size_ = st.st_size;
+            void *addr = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED)
+                return false;
+            addr_ = addr;
+            madvise(addr_, file_size_, MADV_SEQUENTIAL);
+
+            FileHeader header;
+            std::memcpy(&header, addr_, sizeof(header));
+            if (std::memcmp(header.magic, magic, sizeof(header.magic)) != 0 || header.version != version || header.map_checksum != map_checksum ||
+                header.payload_bytes != file_size_ - sizeof(header))
+                return false;
+
+            cursor_ = static_cast<const char *>(addr_) + sizeof(header);
+            end_ = cursor_ + header.payload_bytes;
+            return checksum(cursor_, header.payload_bytes) == header.payload_checksum;
+        }
+
+        bool read(void *data, size_t bytes)
+        {
+            if (size_t(end_ - cursor_) < bytes)
+                return false;
+            std::memcpy(data, cursor_, bytes);
+            cursor_ += bytes;
+            return true;
+        }
+
+        template <typename T>
+        bool read(T &value)
+        {
+            return read(&value, sizeof(T));
+        }
+
+        size_t remaining() const { return end_ - cursor_; }
+
+    private:
+        void *addr_ = nullptr;
+        size_t file_size_ = 0;
+        const char *cursor_ = nullptr;
+        const char *end_ = nullptr;
+    };
+} // namespace MapCache
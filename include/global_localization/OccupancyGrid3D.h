@@ -0,0 +1,323 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <pcl/point_cloud.h>
+
+/**
+ * 分块哈希的三维占据栅格：每8x8x8个体素为一块，块内占据状态用512 bit(一条cache line)存储，块坐标用开放寻址哈希表索引。
+ * 查询一个点只需一次哈希探测和一次位运算，替代八叉树逐层指针跳转的查找；相邻的点大概率落在同一块中，缓存友好。
+ * 只存储有占据的块，稀疏的室外地图也不需要按包围盒分配稠密内存。
+ */
+class OccupancyGrid3D
+{
+public:
+    static constexpr int BLOCK_BITS = 3; // 块边长 = 2^3 个体素
+    static constexpr int BLOCK_WORDS = (1 << (3 * BLOCK_BITS)) / 64;
+    static constexpr int KEY_BITS = 21; // 每个轴的块坐标
+    static constexpr int64_t MAX_VOXEL_INDEX = int64_t(1) << (KEY_BITS - 1 + BLOCK_BITS); // 超出范围的点视为未占据
+
+    explicit OccupancyGrid3D(double resolution = 1.0)
+        : resolution_(resolution), inv_resolution_(1.0 / resolution)
+    {
+    }
+
+    template <typename PointT>
+    void build(const pcl::PointCloud<PointT> &cloud)
+    {
+        clear();
+        if (cloud.points.empty())
+            return;
+
+        // 和pcl八叉树一样，体素边界以第一个点为中心对齐，占据判断与原先逐体素一致
+        const auto &first = cloud.points.front();
+        origin_[0] = first.x - resolution_ / 2;
+        origin_[1] = first.y - resolution_ / 2;
+        origin_[2] = first.z - resolution_ / 2;
+
+        for (const auto &point : cloud.points)
+            insert(point.x, point.y, point.z);
+    }
+
+    void clear()
+    {
+        keys_.clear();
+        blocks_.clear();
+        num_blocks_ = 0;
+        shift_ = 64;
+        std::fill_n(min_index_, 3, MAX_VOXEL_INDEX);
+        std::fill_n(max_index_, 3, -MAX_VOXEL_INDEX);
+    }
+
+    inline bool occupied(float x, float y, float z) const
+    {
+        int64_t index[3];
+        return voxelIndex(x, y, z, index) && occupiedVoxel(index[0], index[1], index[2]);
+    }
+
+    // 按整数体素坐标查询，体素i覆盖[origin + i * resolution, origin + (i + 1) * resolution)
+    inline bool occupiedVoxel(int64_t x, int64_t y, int64_t z) const
+    {
+        // 包围盒外(包括空栅格)不需要查哈希表
+        if (x < min_index_[0] || x > max_index_[0] || y < min_index_[1] || y > max_index_[1] || z < min_index_[2] || z > max_index_[2])
+            return false;
+        const int64_t index[3] = {x, y, z};
+        const uint64_t *block = findBlock(blockKey(index));
+        if (block == nullptr)
+            return false;
+        const uint32_t bit = bitIndex(index);
+        return (block[bit >> 6] >> (bit & 63)) & 1;
+    }
+
+    /**
+     * @brief 最大值池化：返回的栅格中体素u被占据，当且仅当本栅格中u + (i, j, k)被占据，0 <= i, j <= dxy，0 <= k <= dz。
+     * 即点沿各轴正方向平移不超过(dxy, dxy, dz)个体素的任一位置被占据，该点在返回的栅格中就被占据。
+     * 逐轴膨胀，复杂度与占据体素数 * 膨胀半径成正比。
+     */
+    OccupancyGrid3D dilated(int dxy, int dz) const
+    {
+        OccupancyGrid3D result = *this;
+        const int radius[3] = {dxy, dxy, dz};
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (radius[axis] <= 0)
+                continue;
+            OccupancyGrid3D next = result;
+            result.forEachOccupied([&](const int64_t *index) {
+                int64_t shifted[3] = {index[0], index[1], index[2]};
+                for (int k = 1; k <= radius[axis]; ++k)
+                {
+                    --shifted[axis];
+                    next.insertIndex(shifted);
+                }
+            });
+            result = std::move(next);
+        }
+        return result;
+    }
+
+    // 遍历所有被占据体素的整数坐标
+    template <typename Func>
+    void forEachOccupied(Func &&func) const
+    {
+        constexpr uint64_t mask = (uint64_t(1) << KEY_BITS) - 1;
+        constexpr int64_t sign = int64_t(1) << (KEY_BITS - 1);
+        for (size_t slot = 0; slot < keys_.size(); ++slot)
+        {
+            if (keys_[slot] == EMPTY_KEY)
+                continue;
+            int64_t block_index[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                block_index[i] = int64_t((keys_[slot] >> (i * KEY_BITS)) & mask);
+                block_index[i] = ((block_index[i] ^ sign) - sign) << BLOCK_BITS; // 符号扩展
+            }
+            for (int word = 0; word < BLOCK_WORDS; ++word)
+            {
+                for (uint64_t bits = blocks_[slot * BLOCK_WORDS + word]; bits != 0; bits &= bits - 1)
+                {
+                    const uint32_t bit = word * 64 + __builtin_ctzll(bits);
+                    constexpr uint32_t local = (1 << BLOCK_BITS) - 1;
+                    const int64_t index[3] = {block_index[0] + (bit & local), block_index[1] + ((bit >> BLOCK_BITS) & local),
+                                              block_index[2] + (bit >> (2 * BLOCK_BITS))};
+                    func(index);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief 序列化。哈希表按槽原样保存，读回后不需要重新插入
+     *
+     * @param[in] writer  提供write(const void *, size_t)，如MapCache::Writer
+     */
+    template <typename Writer>
+    void save(Writer &writer) const
+    {
+        const uint64_t sizes[3] = {num_blocks_, uint64_t(shift_), keys_.size()};
+        writer.write(&resolution_, sizeof(resolution_));
+        writer.write(origin_, sizeof(origin_));
+        writer.write(min_index_, sizeof(min_index_));
+        writer.write(max_index_, sizeof(max_index_));
+        writer.write(sizes, sizeof(sizes));
+        writer.write(keys_.data(), keys_.size() * sizeof(uint64_t));
+        writer.write(blocks_.data(), blocks_.size() * sizeof(uint64_t));
+    }
+
+    // reader提供read(void *, size_t)，数据不完整或不自洽时返回false，栅格不变
+    template <typename Reader>
+    bool load(Reader &reader)
+    {
+        double resolution, origin[3];
+        int64_t min_index[3], max_index[3];
+        uint64_t sizes[3]; // num_blocks, shift, capacity
+        if (!reader.read(&resolution, sizeof(resolution)) || !reader.read(origin, sizeof(origin)) || !reader.read(min_index, sizeof(min_index)) ||
+            !reader.read(max_index, sizeof(max_index)) || !reader.read(sizes, sizeof(sizes)))
+            return false;
+
+        // 容量是2的幂且与shift对应，装载率不超过1/2
+        const uint64_t capacity = sizes[2];
+        const bool valid_capacity = capacity == 0 ? sizes[1] == 64 && sizes[0] == 0
+                                                  : sizes[1] < 64 && capacity == (uint64_t(1) << (64 - sizes[1])) && sizes[0] * 2 <= capacity;
+        if (!(resolution > 0) || !valid_capacity)
+            return false;
+        std::vector<uint64_t> keys(capacity), blocks(capacity * BLOCK_WORDS);
+        if (!reader.read(keys.data(), keys.size() * sizeof(uint64_t)) || !reader.read(blocks.data(), blocks.size() * sizeof(uint64_t)))
+            return false;
+
+        resolution_ = resolution;
+        inv_resolution_ = 1.0 / resolution;
+        std::copy_n(origin, 3, origin_);
+        std::copy_n(min_index, 3, min_index_);
+        std::copy_n(max_index, 3, max_index_);
+        num_blocks_ = sizes[0];
+        shift_ = int(sizes[1]);
+        keys_.swap(keys);
+        blocks_.swap(blocks);
+        return true;
+    }
+
+    double resolution() const { return resolution_; }
+    const double *origin() const { return origin_; }
+    // 被占据体素坐标的包围盒[min_index, max_index]
+    const int64_t *minIndex() const { return min_index_; }
+    const int64_t *maxIndex() const { return max_index_; }
+    size_t numBlocks() const { return num_blocks_; }
+    size_t memoryBytes() const { return keys_.size() * sizeof(uint64_t) + blocks_.size() * sizeof(uint64_t); }
+
+private:
+    static constexpr uint64_t EMPTY_KEY = std::numeric_limits<uint64_t>::max();
+
+    inline bool voxelIndex(float x, float y, float z, int64_t *index) const
+    {
+        const double coord[3] = {(x - origin_[0]) * inv_resolution_, (y - origin_[1]) * inv_resolution_, (z - origin_[2]) * inv_resolution_};
+        for (int i = 0; i < 3; ++i)
+        {
+            if (!(coord[i] > -MAX_VOXEL_INDEX && coord[i] < MAX_VOXEL_INDEX)) // NaN也返回false
+                return false;
+            index[i] = int64_t(coord[i]);
+            index[i] -= coord[i] < index[i]; // floor
+        }
+        return true;
+    }
+
+    static inline bool inRange(const int64_t *index)
+    {
+        return index[0] > -MAX_VOXEL_INDEX && index[0] < MAX_VOXEL_INDEX && index[1] > -MAX_VOXEL_INDEX && index[1] < MAX_VOXEL_INDEX &&
+               index[2] > -MAX_VOXEL_INDEX && index[2] < MAX_VOXEL_INDEX;
+    }
+
+    static inline uint64_t blockKey(const int64_t *index)
+    {
+        constexpr uint64_t mask = (uint64_t(1) << KEY_BITS) - 1;
+        return (uint64_t(index[0] >> BLOCK_BITS) & mask) |
+               ((uint64_t(index[1] >> BLOCK_BITS) & mask) << KEY_BITS) |
+               ((uint64_t(index[2] >> BLOCK_BITS) & mask) << (2 * KEY_BITS));
+    }
+
+    static inline uint32_t bitIndex(const int64_t *index)
+    {
+        constexpr int64_t mask = (1 << BLOCK_BITS) - 1;
+        return uint32_t((index[0] & mask) | ((index[1] & mask) << BLOCK_BITS) | ((index[2] & mask) << (2 * BLOCK_BITS)));
+    }
+
+    inline size_t slotOf(uint64_t key) const
+    {
+        return (key * 0x9E3779B97F4A7C15ULL) >> shift_;
+    }
+
+    inline const uint64_t *findBlock(uint64_t key) const
+    {
+        const size_t mask = keys_.size() - 1;
+        for (size_t slot = slotOf(key);; slot = (slot + 1) & mask)
+        {
+            if (keys_[slot] == key)
+                return &blocks_[slot * BLOCK_WORDS];
+            if (keys_[slot] == EMPTY_KEY)
+                return nullptr;
+        }
+    }
+
+    uint64_t *findOrInsertBlock(uint64_t key)
+    {
+        // 装载率不超过1/2，保证线性探测链足够短
+        if ((num_blocks_ + 1) * 2 > keys_.size())
+            rehash(num_blocks_ + 1);
+
+        const size_t mask = keys_.size() - 1;
+        size_t slot = slotOf(key);
+        while (keys_[slot] != key && keys_[slot] != EMPTY_KEY)
+            slot = (slot + 1) & mask;
+        if (keys_[slot] == EMPTY_KEY)
+        {
+            keys_[slot] = key;
+            ++num_blocks_;
+        }
+        return &blocks_[slot * BLOCK_WORDS];
+    }
+
+    void insert(float x, float y, float z)
+    {
+        int64_t index[3];
+        if (voxelIndex(x, y, z, index))
+            insertIndex(index);
+    }
+
+    void insertIndex(const int64_t *index)
+    {
+        if (!inRange(index))
+            return;
+        for (int i = 0; i < 3; ++i)
+        {
+            min_index_[i] = std::min(min_index_[i], index[i]);
+            max_index_[i] = std::max(max_index_[i], index[i]);
+        }
+        uint64_t *block = findOrInsertBlock(blockKey(index));
+        const uint32_t bit = bitIndex(index);
+        block[bit >> 6] |= uint64_t(1) << (bit & 63);
+    }
+
+    // 容量扩到能以1/2装载率容纳num_blocks个块的2的幂
+    void rehash(size_t num_blocks)
+    {
+        size_t capacity = 16;
+        int shift = 60;
+        while (capacity < num_blocks * 2)
+        {
+            capacity <<= 1;
+            --shift;
+        }
+        if (capacity <= keys_.size())
+            return;
+
+        std::vector<uint64_t> old_keys(capacity, EMPTY_KEY), old_blocks(capacity * BLOCK_WORDS, 0);
+        old_keys.swap(keys_);
+        old_blocks.swap(blocks_);
+        shift_ = shift;
+
+        const size_t mask = capacity - 1;
+        for (size_t i = 0; i < old_keys.size(); ++i)
+        {
+            if (old_keys[i] == EMPTY_KEY)
+                continue;
+            size_t slot = slotOf(old_keys[i]);
+            while (keys_[slot] != EMPTY_KEY)
+                slot = (slot + 1) & mask;
+            keys_[slot] = old_keys[i];
+            std::copy_n(&old_blocks[i * BLOCK_WORDS], BLOCK_WORDS, &blocks_[slot * BLOCK_WORDS]);
+        }
+    }
+
+    double resolution_;
+    double inv_resolution_;
+    double origin_[3] = {0, 0, 0};
+    int64_t min_index_[3] = {MAX_VOXEL_INDEX, MAX_VOXEL_INDEX, MAX_VOXEL_INDEX};
+    int64_t max_index_[3] = {-MAX_VOXEL_INDEX, -MAX_VOXEL_INDEX, -MAX_VOXEL_INDEX};
+
+    std::vector<uint64_t> keys_;   // capacity, 块坐标, EMPTY_KEY表示空槽
+    std::vector<uint64_t> blocks_; // capacity * BLOCK_WORDS, 与keys_一一对应的占据位
+    size_t num_blocks_ = 0;
+    int shift_ = 64;
+};
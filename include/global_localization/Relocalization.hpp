@@ -1,9 +1,13 @@
 #pragma once
+#include <future>
+#include <thread>
+#include <mutex>
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/io/pcd_io.h>
 #include <pcl/registration/ndt.h>
 #include <pcl/registration/gicp.h>
+#include <pcl/search/kdtree.h>
 #include <pcl/filters/extract_indices.h>
 #include <pcl/segmentation/sac_segmentation.h>
 #include <pcl/segmentation/extract_clusters.h>
@@ -16,6 +20,55 @@
 #include "scancontext/Scancontext.h"
 #define gnss_with_direction
 
+/**
+ * 一次重定位各阶段的耗时，以及时间预算在哪个阶段用完
+ */
+struct RelocalizationReport
+{
+    struct Stage
+    {
+        std::string name;
+        double time_ms;
+        bool deadline_reached; // 该阶段因为截止时间提前结束，结果是目前为止最好的
+    };
+
+    void clear()
+    {
+        stages.clear();
+        exhausted_stage.clear();
+        cancelled = false;
+        bnb_score = 0;
+        fitness_score = -1;
+        total_ms = 0;
+    }
+
+    void add(const std::string &name, const double &time_ms, bool deadline_reached)
+    {
+        stages.push_back({name, time_ms, deadline_reached});
+        if (deadline_reached && exhausted_stage.empty())
+            exhausted_stage = name;
+    }
+
+    bool deadline_reached() const { return !exhausted_stage.empty(); }
+
+    std::string summary() const
+    {
+        std::stringstream ss;
+        ss.precision(1);
+        ss << std::fixed << "total " << total_ms << " ms";
+        for (const auto &stage : stages)
+            ss << ", " << stage.name << " " << stage.time_ms << " ms" << (stage.deadline_reached ? " (deadline)" : "");
+        return ss.str();
+    }
+
+    std::vector<Stage> stages;
+    std::string exhausted_stage; // 第一个到达截止时间的阶段，空表示没有超时
+    bool cancelled = false;      // 提前结束是因为被取消，而不是时间预算用完
+    double bnb_score = 0;        // 进入精配准时的bnb分数，0表示bnb没有找到位姿
+    double fitness_score = -1;   // 最后一次精配准的fitness，没有做精配准时 < 0
+    double total_ms = 0;
+};
+
 class Relocalization
 {
 public:
@@ -37,23 +90,33 @@ public:
         extrinsic_imu2gnss.topRightCorner(3, 1) = transl;
     }
 
-    bool load_prior_map(const PointCloudType::Ptr &global_map)
+    /**
+     * @brief 加载地图。bnb网格在返回前建好；NDT target和GICP协方差在后台线程构建，精配准第一次用到时才等待
+     *
+     * @param[in] cache_path  地图目录，非空时bnb网格和GICP协方差优先从其中的缓存加载，缓存不可用时现场计算并写回
+     */
+    bool load_prior_map(const PointCloudType::Ptr &global_map, const std::string &cache_path = "")
     {
-        bnb3d = std::make_shared<BranchAndBoundMatcher3D>(global_map, bnb_option);
-        ndt.setInputTarget(global_map);
-        ndt.setMaximumIterations(150);
-        ndt.setTransformationEpsilon(teps);
-        ndt.setStepSize(step_size);
-        ndt.setResolution(resolution);
+        // 等上一张地图的后台构建结束
+        hypothesis_bnb.clear();
+        gicp_tuners.clear();
+        ndt_tuner.reset();
+        if (gicp_covariances_ready_.valid())
+            gicp_covariances_ready_.wait();
 
+        global_map_ = global_map;
+        bnb3d = std::make_shared<BranchAndBoundMatcher3D>(global_map, bnb_option, cache_path.empty() ? "" : cache_path + "/" + BNB_CACHE_FILENAME);
+        gicp_target_covariances_.reset();
+        gicp_target_kdtree_.reset();
+        gicp_covariances_ready_ = std::shared_future<void>();
         if (use_gicp)
         {
-            gicp.setInputTarget(global_map);
-            gicp.setMaximumIterations(150);
-            gicp.setMaxCorrespondenceDistance(search_radius);
-            gicp.setTransformationEpsilon(teps);
-            gicp.setEuclideanFitnessEpsilon(feps);
+            const std::string cache_file = cache_path.empty() ? "" : cache_path + "/" + GICP_CACHE_FILENAME;
+            gicp_covariances_ready_ = std::async(std::launch::async, [this, cache_file]() { load_gicp_covariances(cache_file); }).share();
         }
+        ndt_tuner.reset(new NdtTuner);
+        init_ndt_tuner(*ndt_tuner);
+        prepare_hypothesis_state(algorithm_type.compare("scan_context") == 0 ? std::max(1, sc_top_k) : 1);
         return true;
     }
 
@@ -65,63 +128,89 @@ public:
             return false;
         }
 
-        int scd_file_count = 0, num_digits = 0;
-        scd_file_count = FileOperation::getFilesNumByExtension(path, ".scd");
-
-        if (scd_file_count != trajectory_poses->size())
+        // 优先加载二进制数据库，keys已预先算好，mmap后直接拷贝
+        if (!sc_manager->loadDatabase(path + "/" + ScanContext::SCManager::DATABASE_FILENAME, trajectory_poses->size()))
         {
-            LOG_WARN("scd_file_count != trajectory_poses! %d, %ld", scd_file_count, trajectory_poses->size());
-            return false;
+            int scd_file_count = 0, num_digits = 0;
+            scd_file_count = FileOperation::getFilesNumByExtension(path, ".scd");
+
+            if (scd_file_count != trajectory_poses->size())
+            {
+                LOG_WARN("scd_file_count != trajectory_poses! %d, %ld", scd_file_count, trajectory_poses->size());
+                return false;
+            }
+
+            num_digits = FileOperation::getOneFilenameByExtension(path, ".scd").length() - std::string(".scd").length();
+
+            sc_manager->loadPriorSCD(path, num_digits, trajectory_poses->size());
         }
 
-        num_digits = FileOperation::getOneFilenameByExtension(path, ".scd").length() - std::string(".scd").length();
+        // 关键帧位置用于位置先验约束检索范围
+        for (const auto &pose : trajectory_poses->points)
+            sc_manager->addKeyframePosition(pose.x, pose.y);
 
-        sc_manager->loadPriorSCD(path, num_digits, trajectory_poses->size());
+        if (sc_manager->ANN_SEARCH_EN)
+            load_embedding_index(path);
         return true;
     }
 
-    bool run(const PointCloudType::Ptr &scan, Eigen::Matrix4d &result, const double &lidar_beg_time)
+    /**
+     * 加载地图目录中离线建好的ANN索引，没有或者与描述子数量不一致时现场建立，并写回地图目录
+     */
+    void load_embedding_index(const std::string &path)
     {
-        Eigen::Matrix4d lidar_ext = lidar_extrinsic.toMatrix4d();
-        bool success_flag = true;
-        double score = 0;
+        const std::string index_file = path + "/" + ScanContext::SCManager::EMBEDDING_INDEX_FILENAME;
+        if (sc_manager->loadEmbeddingIndex(index_file))
+            return;
 
-        if (run_gnss_relocalization(scan, result, lidar_beg_time, lidar_ext, score) && fine_tune_pose(scan, result, lidar_ext, score))
-        {
-            LOG_WARN("relocalization successfully!!!!!!");
-            return true;
-        }
+        Timer timer;
+        sc_manager->buildEmbeddingIndex();
+        LOG_WARN("build scan context embedding index for %lu keyframes, time = %.1f ms.", sc_manager->polarcontexts_.size(), timer.elapsedLast());
+        if (!sc_manager->saveEmbeddingIndex(index_file))
+            LOG_WARN("failed to save scan context embedding index, path = %s!", index_file.c_str());
+    }
 
-        if (algorithm_type.compare("scan_context") == 0)
-        {
-            if (!run_scan_context(scan, result, lidar_ext, score) || !fine_tune_pose(scan, result, lidar_ext, score))
-            {
-#ifdef DEDUB_MODE
-                result = EigenMath::CreateAffineMatrix(V3D(rough_pose.x, rough_pose.y, rough_pose.z), V3D(rough_pose.roll, rough_pose.pitch, rough_pose.yaw));
-#endif
-                success_flag = false;
-            }
-        }
-        if (algorithm_type.compare("manually_set") == 0 || !success_flag)
-        {
-            success_flag = true;
-            if (!run_manually_set(scan, result, lidar_ext, score) || !fine_tune_pose(scan, result, lidar_ext, score))
-            {
-#ifdef DEDUB_MODE
-                result = EigenMath::CreateAffineMatrix(V3D(manual_pose.x, manual_pose.y, manual_pose.z), V3D(manual_pose.roll, manual_pose.pitch, manual_pose.yaw));
-#endif
-                success_flag = false;
-            }
-        }
+    // 使用time_budget_ms作为时间预算
+    bool run(const PointCloudType::Ptr &scan, Eigen::Matrix4d &result, const double &lidar_beg_time, const std::atomic<bool> *cancel = nullptr)
+    {
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (time_budget_ms > 0)
+            deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(int64_t(time_budget_ms * 1000));
+        return run(scan, result, lidar_beg_time, deadline, cancel);
+    }
 
-        if (!success_flag)
+    /**
+     * @brief 重定位，到达截止时间时bnb和精配准返回目前为止最好的结果，各阶段耗时见report
+     *
+     * @param[in] cancel  非空时由其他线程置位来取消本次重定位，各阶段按到达截止时间处理。
+     *                    没有截止时间时精配准不分段，取消在精配准结束后才生效
+     */
+    bool run(const PointCloudType::Ptr &scan, Eigen::Matrix4d &result, const double &lidar_beg_time,
+             const std::chrono::steady_clock::time_point &deadline, const std::atomic<bool> *cancel = nullptr)
+    {
+        Timer timer;
+        deadline_ = deadline;
+        cancel_ = cancel;
+        stopped_by_cancel_ = false;
+        for (auto &matcher : hypothesis_bnb)
         {
-            LOG_ERROR("relocalization failed!");
-            return false;
+            matcher->cancel_flag = cancel;
+            matcher->cancelled = false;
         }
-
-        LOG_WARN("relocalization successfully!!!!!!");
-        return true;
+        report.clear();
+        const bool success = run_stages(scan, result, lidar_beg_time);
+        report.total_ms = timer.elapsedStart();
+        // 在停下来的那一刻记录原因，之后才置位的取消标志不会把预算超时算成取消
+        report.cancelled = report.deadline_reached() &&
+                           (stopped_by_cancel_ || std::any_of(hypothesis_bnb.begin(), hypothesis_bnb.end(), [](const auto &matcher)
+                                                              { return bool(matcher->cancelled); }));
+        if (report.cancelled)
+            LOG_WARN("relocalization cancelled in stage %s, %s.", report.exhausted_stage.c_str(), report.summary().c_str());
+        else if (report.deadline_reached())
+            LOG_WARN("relocalization deadline reached in stage %s, %s.", report.exhausted_stage.c_str(), report.summary().c_str());
+        else
+            LOG_INFO("relocalization %s.", report.summary().c_str());
+        return success;
     }
 
     void set_init_pose(const Pose &_manual_pose)
@@ -189,6 +278,15 @@ public:
         LOG_WARN("debug_mode: %d", bnb_option.debug_mode);
         LOG_WARN("*******************************************");
 
+        // 每个yaw都是bnb的一个根节点(各自旋转一次scan)，太细的角度分辨率按上限放粗
+        const int root_yaws = std::ceil(2 * bnb_option.angular_search_window / bnb_option.min_angular_resolution);
+        if (bnb_option.min_angular_resolution > 0 && root_yaws > BNB_MAX_ROOT_YAWS)
+        {
+            bnb_option.min_angular_resolution = 2 * bnb_option.angular_search_window / BNB_MAX_ROOT_YAWS;
+            LOG_WARN("min_angular_resolution gives %d root yaws, more than %d, coarsened to %lf degree!", root_yaws, BNB_MAX_ROOT_YAWS,
+                     bnb_option.min_angular_resolution);
+        }
+
         bnb_option.angular_search_window = DEG2RAD(bnb_option.angular_search_window);
         bnb_option.min_angular_resolution = DEG2RAD(bnb_option.min_angular_resolution);
 
@@ -222,23 +320,18 @@ public:
     void add_keyframe_descriptor(const PointCloudType::Ptr thiskeyframe, const std::string &path)
     {
         PointCloudType::Ptr thiskeyframeDS(new PointCloudType());
-        pcl::PointCloud<SCPointType>::Ptr sc_input(new pcl::PointCloud<SCPointType>());
         voxel_filter.setLeafSize(0.5, 0.5, 0.5);
         voxel_filter.setInputCloud(thiskeyframe);
         voxel_filter.filter(*thiskeyframeDS);
 
-        pcl::PointXYZI tmp;
-        for (auto &point : thiskeyframeDS->points)
-        {
-            tmp.x = point.x;
-            tmp.y = point.y;
-            tmp.z = point.z;
-            sc_input->push_back(tmp);
-        }
-        sc_manager->makeAndSaveScancontextAndKeys(*sc_input);
+        sc_manager->makeAndSaveScancontextAndKeys(*thiskeyframeDS);
 
         if (path.compare("") != 0)
+        {
             sc_manager->saveCurrentSCD(path);
+            if (!sc_manager->appendCurrentToDatabase(path + "/" + ScanContext::SCManager::DATABASE_FILENAME))
+                LOG_WARN("failed to append scan context database, path = %s!", path.c_str());
+        }
     }
 
     std::string algorithm_type = "UNKNOW";
@@ -248,20 +341,133 @@ public:
 
     pcl::PointCloud<PointXYZIRPYT>::Ptr trajectory_poses;
     std::shared_ptr<ScanContext::SCManager> sc_manager; // scan context
+    int sc_top_k = 3; // scan context candidates verified in parallel, bnb threads are split among them, each keeps its own gicp state
+    double sc_prior_radius = 200; // m, scan context only searches keyframes this close to the gnss/manual position, <= 0 searches the whole map
+    double sc_prior_gnss_timeout = 10; // s, older gnss fixes are not used as a position prior
 
     GnssPose gnss_pose;
     Eigen::Matrix4d extrinsic_imu2gnss;
 
+    double time_budget_ms = 0; // run()的时间预算，<= 0 不限时
+    RelocalizationReport report; // 上一次run()的各阶段耗时
+
 private:
-    bool fine_tune_pose(PointCloudType::Ptr scan, Eigen::Matrix4d &result, const Eigen::Matrix4d &lidar_ext, const double &score)
+    using GICP = pcl::GeneralizedIterativeClosestPoint<PointType, PointType>;
+
+    /**
+     * NDT精配准状态，只有一套：NDT的体素化target与地图同量级，不随假设数量复制。
+     * NDT在align时会修改内部状态，并行验证的假设通过mtx轮流配准(只锁NDT，几十ms，远小于bnb)
+     */
+    struct NdtTuner
+    {
+        pcl::NormalDistributionsTransform<PointType, PointType> ndt;
+        std::mutex mtx;
+        std::shared_future<void> ready; // 后台构建NDT target，放在最后，析构时先等构建结束
+    };
+
+    /**
+     * GICP精配准状态，每个假设一套，可以并行配准。target点云、搜索树和协方差都是共用的，每套只多出配准时的source状态
+     */
+    struct GicpTuner
+    {
+        GICP gicp;
+        bool target_shared = false; // 已设置共用的target协方差和搜索树
+    };
+
+    // 由一个scan context候选得到的位姿假设
+    struct Hypothesis
+    {
+        Pose rough_pose;     // bnb后的粗略位姿，bnb失败时为scan context给出的位姿
+        double score = 0;    // bnb分数，0表示bnb失败
+        bool verified = false; // 精配准通过
+        Eigen::Matrix4d result = Eigen::Matrix4d::Identity();
+        RelocalizationReport report;
+    };
+
+    bool run_stages(const PointCloudType::Ptr &scan, Eigen::Matrix4d &result, const double &lidar_beg_time)
+    {
+        Eigen::Matrix4d lidar_ext = lidar_extrinsic.toMatrix4d();
+        bool success_flag = true;
+        double score = 0;
+
+        if (run_gnss_relocalization(scan, result, lidar_beg_time, lidar_ext, score) && fine_tune_pose(*gicp_tuners.front(), rough_pose, scan, result, lidar_ext, score, report))
+        {
+            LOG_WARN("relocalization successfully!!!!!!");
+            return true;
+        }
+
+        if (algorithm_type.compare("scan_context") == 0)
+        {
+            if (deadline_reached())
+                report.add("scan_context", 0, true);
+            if (report.deadline_reached() || !run_scan_context(scan, result, lidar_beg_time, lidar_ext))
+            {
+#ifdef DEDUB_MODE
+                result = EigenMath::CreateAffineMatrix(V3D(rough_pose.x, rough_pose.y, rough_pose.z), V3D(rough_pose.roll, rough_pose.pitch, rough_pose.yaw));
+#endif
+                success_flag = false;
+            }
+        }
+        if (algorithm_type.compare("manually_set") == 0 || !success_flag)
+        {
+            // 时间预算用完时不再尝试后面的阶段
+            if (deadline_reached())
+            {
+                report.add("manual_bnb", 0, true);
+                LOG_ERROR("relocalization failed, deadline reached!");
+                return false;
+            }
+            success_flag = true;
+            if (!run_manually_set(scan, result, lidar_ext, score) || !fine_tune_pose(*gicp_tuners.front(), rough_pose, scan, result, lidar_ext, score, report))
+            {
+#ifdef DEDUB_MODE
+                result = EigenMath::CreateAffineMatrix(V3D(manual_pose.x, manual_pose.y, manual_pose.z), V3D(manual_pose.roll, manual_pose.pitch, manual_pose.yaw));
+#endif
+                success_flag = false;
+            }
+        }
+
+        if (!success_flag)
+        {
+            LOG_ERROR("relocalization failed!");
+            return false;
+        }
+
+        LOG_WARN("relocalization successfully!!!!!!");
+        return true;
+    }
+
+    /**
+     * @brief 从粗略位姿rough出发用NDT(和GICP)精配准，结果写入result(imu pose)
+     *
+     * @param[in] tuner  本次使用的GICP状态，并行的假设各用一套；NDT状态共用，配准时加锁
+     * @param[in] score  rough的bnb分数，0表示bnb没有找到位姿
+     * @param[out] stage_report  记录各阶段耗时
+     */
+    bool fine_tune_pose(GicpTuner &tuner, const Pose &rough, PointCloudType::Ptr scan, Eigen::Matrix4d &result, const Eigen::Matrix4d &lidar_ext,
+                        const double &score, RelocalizationReport &stage_report)
     {
         Timer timer;
-        result = EigenMath::CreateAffineMatrix(V3D(rough_pose.x, rough_pose.y, rough_pose.z), V3D(rough_pose.roll, rough_pose.pitch, rough_pose.yaw));
+        result = EigenMath::CreateAffineMatrix(V3D(rough.x, rough.y, rough.z), V3D(rough.roll, rough.pitch, rough.yaw));
+        stage_report.bnb_score = score;
         if (score >= bnb_option.enough_score)
         {
             LOG_WARN("bnb score enough!");
             return true;
         }
+        if (deadline_reached())
+        {
+            // 没有时间精配准，bnb找到了位姿时直接使用它
+            stage_report.add("ndt", 0, true);
+            LOG_WARN("relocalization deadline reached before fine tuning, use bnb pose, bnb score = %.3f.", score);
+            return score > 0;
+        }
+        if (!wait_target(ndt_tuner->ready, "ndt_target", stage_report))
+        {
+            LOG_WARN("relocalization deadline reached while building ndt target, use bnb pose, bnb score = %.3f.", score);
+            return score > 0;
+        }
+        timer.record();
 
         result *= lidar_ext; // imu pose -> lidar pose
 
@@ -270,75 +476,172 @@ private:
             if (pointDistanceSquare(point) < filter_range * filter_range)
                 filter->push_back(point);
 
-        voxel_filter.setLeafSize(gicp_downsample, gicp_downsample, gicp_downsample);
-        voxel_filter.setInputCloud(filter);
-        voxel_filter.filter(*filter);
+        pcl::VoxelGrid<PointType> downsample_filter;
+        downsample_filter.setLeafSize(gicp_downsample, gicp_downsample, gicp_downsample);
+        downsample_filter.setInputCloud(filter);
+        downsample_filter.filter(*filter);
 
         PointCloudType::Ptr aligned(new PointCloudType());
+        std::unique_lock<std::mutex> ndt_lock(ndt_tuner->mtx);
+        timer.record(); // 不计等待其他假设NDT配准的时间
+        auto &ndt = ndt_tuner->ndt;
         ndt.setInputSource(filter);
-        ndt.align(*aligned, result.cast<float>());
+        const bool ndt_timeout = align_before_deadline(ndt, result.cast<float>(), *aligned);
+        const double ndt_time = timer.elapsedLast();
+        const bool ndt_converged = ndt.hasConverged();
+        const double ndt_fitness_score = ndt.getFitnessScore();
+        const Eigen::Matrix4f ndt_pose = ndt.getFinalTransformation();
+        const int ndt_iters = ndt.getFinalNumIteration();
+        ndt_lock.unlock();
+        stage_report.add("ndt", ndt_time, ndt_timeout);
+        stage_report.fitness_score = ndt_fitness_score;
 
-        if (!ndt.hasConverged())
+        if (!ndt_converged)
         {
             LOG_ERROR("NDT not converge!");
             return false;
         }
-        else if (ndt.getFitnessScore() > fitness_score)
+        else if (ndt_fitness_score > fitness_score)
         {
-            LOG_ERROR("failed! NDT fitness_score = %f.", ndt.getFitnessScore());
+            LOG_ERROR("failed! NDT fitness_score = %f.", ndt_fitness_score);
             return false;
         }
-        if (ndt.getFitnessScore() < 0.1)
+        if (ndt_fitness_score < 0.1)
         {
-            LOG_WARN("NDT fitness_score = %f.", ndt.getFitnessScore());
+            LOG_WARN("NDT fitness_score = %f.", ndt_fitness_score);
         }
         else
         {
-            LOG_ERROR("NDT fitness_score = %f.", ndt.getFitnessScore());
+            LOG_ERROR("NDT fitness_score = %f.", ndt_fitness_score);
         }
 
-        result = ndt.getFinalTransformation().cast<double>();
+        result = ndt_pose.cast<double>();
         result *= lidar_ext.inverse();
 
         Eigen::Vector3d pos, euler;
         EigenMath::DecomposeAffineMatrix(result, pos, euler);
         LOG_WARN("ndt pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), ndt_time = %.2lf ms, ndt_iters = %d",
-                 pos(0), pos(1), pos(2), RAD2DEG(euler(0)), RAD2DEG(euler(1)), RAD2DEG(euler(2)), timer.elapsedLast(), ndt.getFinalNumIteration());
+                 pos(0), pos(1), pos(2), RAD2DEG(euler(0)), RAD2DEG(euler(1)), RAD2DEG(euler(2)), ndt_time, ndt_iters);
 
-        if (use_gicp)
+        if (use_gicp && deadline_reached())
+        {
+            stage_report.add("gicp", 0, true);
+            LOG_WARN("relocalization deadline reached before gicp, use ndt pose.");
+        }
+        else if (use_gicp && !wait_target(gicp_covariances_ready_, "gicp_target", stage_report))
         {
-            gicp.setInputSource(filter);
-            gicp.align(*aligned, ndt.getFinalTransformation());
+            LOG_WARN("relocalization deadline reached while building gicp target, use ndt pose.");
+        }
+        else if (use_gicp)
+        {
+            timer.record();
+            if (!tuner.target_shared && gicp_target_covariances_)
+            {
+                tuner.gicp.setTargetCovariances(gicp_target_covariances_); // 在setInputTarget之后，否则会被清空
+                tuner.gicp.setSearchMethodTarget(gicp_target_kdtree_, true); // 共用搜索树，align时不再重建
+                tuner.target_shared = true;
+            }
+            tuner.gicp.setInputSource(filter);
+            const bool gicp_timeout = align_before_deadline(tuner.gicp, ndt_pose, *aligned);
+            const double gicp_time = timer.elapsedLast();
+            stage_report.add("gicp", gicp_time, gicp_timeout);
+            stage_report.fitness_score = tuner.gicp.getFitnessScore();
 
-            if (!gicp.hasConverged())
+            if (!tuner.gicp.hasConverged())
             {
                 LOG_ERROR("GICP not converge!");
                 return false;
             }
-            else if (gicp.getFitnessScore() > fitness_score)
+            else if (tuner.gicp.getFitnessScore() > fitness_score)
             {
-                LOG_ERROR("failed! GICP fitness_score = %f.", gicp.getFitnessScore());
+                LOG_ERROR("failed! GICP fitness_score = %f.", tuner.gicp.getFitnessScore());
                 return false;
             }
-            if (gicp.getFitnessScore() < 0.1)
+            if (tuner.gicp.getFitnessScore() < 0.1)
             {
-                LOG_WARN("GICP fitness_score = %f.", gicp.getFitnessScore());
+                LOG_WARN("GICP fitness_score = %f.", tuner.gicp.getFitnessScore());
             }
             else
             {
-                LOG_ERROR("GICP fitness_score = %f.", gicp.getFitnessScore());
+                LOG_ERROR("GICP fitness_score = %f.", tuner.gicp.getFitnessScore());
             }
 
-            result = gicp.getFinalTransformation().cast<double>();
+            result = tuner.gicp.getFinalTransformation().cast<double>();
             result *= lidar_ext.inverse();
 
             EigenMath::DecomposeAffineMatrix(result, pos, euler);
             LOG_WARN("gicp pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), gicp_time = %.2lf ms",
-                     pos(0), pos(1), pos(2), RAD2DEG(euler(0)), RAD2DEG(euler(1)), RAD2DEG(euler(2)), timer.elapsedLast());
+                     pos(0), pos(1), pos(2), RAD2DEG(euler(0)), RAD2DEG(euler(1)), RAD2DEG(euler(2)), gicp_time);
         }
         return true;
     }
 
+    /**
+     * @brief 等待后台构建的配准target，已经建好时不记录阶段
+     *
+     * @return 到达截止时间或被取消时返回false
+     */
+    bool wait_target(const std::shared_future<void> &ready, const std::string &stage, RelocalizationReport &stage_report) const
+    {
+        if (!ready.valid() || ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            return true;
+        Timer timer;
+        while (ready.wait_for(std::chrono::milliseconds(5)) != std::future_status::ready)
+        {
+            if (deadline_reached())
+            {
+                stage_report.add(stage, timer.elapsedStart(), true);
+                return false;
+            }
+        }
+        stage_report.add(stage, timer.elapsedStart(), false);
+        return true;
+    }
+
+    bool deadline_reached() const
+    {
+        if (std::chrono::steady_clock::now() >= deadline_)
+            return true;
+        if (!(cancel_ && *cancel_))
+            return false;
+        stopped_by_cancel_ = true;
+        return true;
+    }
+
+    /**
+     * @brief 配准。有截止时间时分段迭代，每段最多registration_chunk_iterations次，以上一段的结果作为初值，
+     * 两段之间检查截止时间，超时或被取消就停在目前的结果上。一段内的位姿变化小于teps时认为已经收敛。
+     * 没有截止时间时一次配准完成，结果与不限时完全一致，取消只在阶段之间检查。
+     *
+     * @return 是否因为截止时间提前结束
+     */
+    template <typename Registration>
+    bool align_before_deadline(Registration &registration, const Eigen::Matrix4f &guess, PointCloudType &aligned)
+    {
+        if (deadline_ == std::chrono::steady_clock::time_point::max())
+        {
+            registration.setMaximumIterations(registration_max_iterations);
+            registration.align(aligned, guess);
+            return false;
+        }
+
+        Eigen::Matrix4f current = guess;
+        for (int iterations = 0; iterations < registration_max_iterations; iterations += registration_chunk_iterations)
+        {
+            registration.setMaximumIterations(std::min(registration_chunk_iterations, registration_max_iterations - iterations));
+            registration.align(aligned, current);
+            if (!registration.hasConverged())
+                break;
+            const Eigen::Matrix4f delta = current.inverse() * registration.getFinalTransformation();
+            current = registration.getFinalTransformation();
+            if (delta.topRightCorner<3, 1>().norm() < teps && Eigen::AngleAxisf(delta.topLeftCorner<3, 3>()).angle() < teps)
+                break;
+            if (deadline_reached())
+                return true;
+        }
+        return false;
+    }
+
     bool run_gnss_relocalization(PointCloudType::Ptr scan, Eigen::Matrix4d &rough_mat, const double &lidar_beg_time, const Eigen::Matrix4d &lidar_ext, double &score)
     {
         Timer timer;
@@ -371,79 +674,297 @@ private:
         bnb_opt_tmp.angular_search_window = DEG2RAD(180);
         bnb_opt_tmp.min_angular_resolution = DEG2RAD(5);
 #endif
-        if (!bnb3d->MatchWithMatchOptions(rough_pose, rough_pose, scan, bnb_opt_tmp, lidar_ext, score))
+        if (!bnb3d->MatchWithMatchOptions(rough_pose, rough_pose, scan, bnb_opt_tmp, lidar_ext, score, deadline_))
         {
             bnb_success = false;
+            score = 0;
             LOG_ERROR("bnb_failed, when bnb min_score = %.2f!", bnb_opt_tmp.min_score);
         }
+        const double bnb_time = timer.elapsedLast();
+        report.add("gnss_bnb", bnb_time, bnb3d->timed_out);
         if (bnb_success)
         {
             LOG_INFO("bnb_success!");
             LOG_WARN("bnb_pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), score_cnt = %d, time = %.2lf ms",
                      rough_pose.x, rough_pose.y, rough_pose.z, RAD2DEG(rough_pose.roll), RAD2DEG(rough_pose.pitch), RAD2DEG(rough_pose.yaw),
-                     bnb3d->sort_cnt, timer.elapsedLast());
+                     bnb3d->sort_cnt, bnb_time);
         }
         return true;
     }
 
-    bool run_scan_context(PointCloudType::Ptr scan, Eigen::Matrix4d &rough_mat, const Eigen::Matrix4d &lidar_ext, double &score)
+    /**
+     * 位置先验：优先使用较新的gnss位置(精度不足以直接bnb时仍可限定范围)，其次使用人工设置的初始位置
+     */
+    bool get_position_prior(const double &lidar_beg_time, ScanContext::SCSpatialPrior &prior)
+    {
+        if (sc_prior_radius <= 0)
+            return false;
+
+        prior.radius = sc_prior_radius;
+        if (std::abs(lidar_beg_time - gnss_pose.timestamp) <= sc_prior_gnss_timeout)
+        {
+            Eigen::Matrix4d gnss_mat = Eigen::Matrix4d::Identity();
+            gnss_mat.topLeftCorner(3, 3) = gnss_pose.gnss_quat.toRotationMatrix();
+            gnss_mat.topRightCorner(3, 1) = gnss_pose.gnss_position;
+            gnss_mat *= extrinsic_imu2gnss;
+            prior.x = gnss_mat(0, 3);
+            prior.y = gnss_mat(1, 3);
+            return true;
+        }
+        if (prior_pose_inited)
+        {
+            prior.x = manual_pose.x;
+            prior.y = manual_pose.y;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief scan context的top-k候选作为多个假设，每个假设各自bnb + 精配准，并行验证，取最好的通过验证的假设
+     *
+     * @param[out] result  精配准后的imu pose
+     */
+    bool run_scan_context(PointCloudType::Ptr scan, Eigen::Matrix4d &result, const double &lidar_beg_time, const Eigen::Matrix4d &lidar_ext)
     {
         Timer timer;
         PointCloudType::Ptr scanDS(new PointCloudType());
-        pcl::PointCloud<SCPointType>::Ptr sc_input(new pcl::PointCloud<SCPointType>());
         voxel_filter.setLeafSize(0.5, 0.5, 0.5);
         voxel_filter.setInputCloud(scan);
         voxel_filter.filter(*scanDS);
 
-        pcl::PointXYZI tmp;
-        for (auto &point : scanDS->points)
+        // 有位置先验时只检索附近的关键帧，区域内找不到候选(先验有误或地图未覆盖)时再全局检索
+        std::vector<ScanContext::SCCandidate> candidates;
+        ScanContext::SCSpatialPrior prior;
+        if (get_position_prior(lidar_beg_time, prior))
+        {
+            candidates = sc_manager->relocalizeCandidates(*scanDS, sc_top_k, &prior);
+            if (candidates.empty())
+                LOG_WARN("scan context found no candidate within %.0f m of (%.2f,%.2f), search the whole map.", prior.radius, prior.x, prior.y);
+        }
+        if (candidates.empty())
+            candidates = sc_manager->relocalizeCandidates(*scanDS, sc_top_k);
+        report.add("scan_context", timer.elapsedLast(), false);
+        if (candidates.empty())
         {
-            tmp.x = point.x;
-            tmp.y = point.y;
-            tmp.z = point.z;
-            sc_input->push_back(tmp);
+            LOG_ERROR("scan context failed, no candidate found in %lu descriptors! Please move the vehicle to another position and try again.", trajectory_poses->size());
+            return false;
         }
-        auto sc_res = sc_manager->relocalize(*sc_input);
-        if (sc_res.first != -1 && sc_res.first < trajectory_poses->size())
+
+        auto bnb_opt_tmp = bnb_option;
+        bnb_opt_tmp.min_score = 0.1;
+        bnb_opt_tmp.linear_xy_window_size = 2;
+        bnb_opt_tmp.linear_z_window_size = 0.5;
+        bnb_opt_tmp.min_xy_resolution = 0.2;
+        bnb_opt_tmp.min_z_resolution = 0.1;
+        bnb_opt_tmp.angular_search_window = DEG2RAD(6);
+        bnb_opt_tmp.min_angular_resolution = DEG2RAD(1);
+
+        // 每个候选是一个假设，各自bnb + 精配准，并行验证
+        std::vector<Hypothesis> hypotheses;
+        for (const auto &candidate : candidates)
         {
-            const auto &pose_ref = trajectory_poses->points[sc_res.first];
+            if (candidate.index >= trajectory_poses->size())
+                continue;
+
+            const auto &pose_ref = trajectory_poses->points[candidate.index];
             // lidar pose -> imu pose
-            rough_mat = EigenMath::CreateAffineMatrix(V3D(pose_ref.x, pose_ref.y, pose_ref.z), V3D(pose_ref.roll, pose_ref.pitch, pose_ref.yaw + sc_res.second));
+            Eigen::Matrix4d rough_mat = EigenMath::CreateAffineMatrix(V3D(pose_ref.x, pose_ref.y, pose_ref.z), V3D(pose_ref.roll, pose_ref.pitch, pose_ref.yaw + candidate.yaw_rad));
             rough_mat *= lidar_ext.inverse();
-            EigenMath::DecomposeAffineMatrix(rough_mat, rough_pose.x, rough_pose.y, rough_pose.z, rough_pose.roll, rough_pose.pitch, rough_pose.yaw);
-            LOG_WARN("scan context success! res index = %d, pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf)!", sc_res.first,
-                     rough_pose.x, rough_pose.y, rough_pose.z, RAD2DEG(rough_pose.roll), RAD2DEG(rough_pose.pitch), RAD2DEG(rough_pose.yaw));
+            Hypothesis hypothesis;
+            EigenMath::DecomposeAffineMatrix(rough_mat, hypothesis.rough_pose.x, hypothesis.rough_pose.y, hypothesis.rough_pose.z,
+                                             hypothesis.rough_pose.roll, hypothesis.rough_pose.pitch, hypothesis.rough_pose.yaw);
+            LOG_WARN("scan context success! res index = %d, sc_dist = %.3f, pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf)!", candidate.index, candidate.distance,
+                     hypothesis.rough_pose.x, hypothesis.rough_pose.y, hypothesis.rough_pose.z,
+                     RAD2DEG(hypothesis.rough_pose.roll), RAD2DEG(hypothesis.rough_pose.pitch), RAD2DEG(hypothesis.rough_pose.yaw));
+            hypotheses.push_back(hypothesis);
+        }
 
-            bool bnb_success = true;
-            auto bnb_opt_tmp = bnb_option;
-            bnb_opt_tmp.min_score = 0.1;
-            bnb_opt_tmp.linear_xy_window_size = 2;
-            bnb_opt_tmp.linear_z_window_size = 0.5;
-            bnb_opt_tmp.min_xy_resolution = 0.2;
-            bnb_opt_tmp.min_z_resolution = 0.1;
-            bnb_opt_tmp.angular_search_window = DEG2RAD(6);
-            bnb_opt_tmp.min_angular_resolution = DEG2RAD(1);
-            if (!bnb3d->MatchWithMatchOptions(rough_pose, rough_pose, scan, bnb_opt_tmp, lidar_ext, score))
-            {
-                bnb_success = false;
-                LOG_ERROR("bnb_failed, when bnb min_score = %.2f!", bnb_opt_tmp.min_score);
-            }
-            if (bnb_success)
-            {
-                LOG_INFO("bnb_success!");
-                LOG_WARN("bnb_pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), score_cnt = %d, time = %.2lf ms",
-                         rough_pose.x, rough_pose.y, rough_pose.z, RAD2DEG(rough_pose.roll), RAD2DEG(rough_pose.pitch), RAD2DEG(rough_pose.yaw),
-                         bnb3d->sort_cnt, timer.elapsedLast());
-            }
+        if (hypotheses.empty())
+        {
+            LOG_ERROR("scan context failed, res index out of range, total descriptors = %lu! Please move the vehicle to another position and try again.", trajectory_poses->size());
+            return false;
         }
-        else
+
+        prepare_hypothesis_state(hypotheses.size());
+        // 各假设的bnb分摊BNB_PROC_NUM个openmp线程，总线程数不随假设数量增加
+        const int num_hypotheses = hypotheses.size();
+        for (auto i = 0; i < num_hypotheses; ++i)
+            hypothesis_bnb[i]->proc_num = std::max(1, BNB_PROC_NUM / num_hypotheses + (i < BNB_PROC_NUM % num_hypotheses ? 1 : 0));
+        std::vector<std::thread> workers;
+        for (auto i = 0; i < num_hypotheses; ++i)
+        {
+            workers.emplace_back([&, i]() {
+                verify_hypothesis(*hypothesis_bnb[i], *gicp_tuners[i], scan, lidar_ext, bnb_opt_tmp, hypotheses[i]);
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+        bnb3d->proc_num = BNB_PROC_NUM; // gnss/手动重定位单独使用bnb3d
+
+        // 通过精配准的假设中取bnb分数最高的(同一scan、同一网格上的占据比例，假设之间可以直接比较)，同分时取scan context排名靠前的
+        int best = -1;
+        for (auto i = 0; i < hypotheses.size(); ++i)
+        {
+            for (const auto &stage : hypotheses[i].report.stages)
+                report.add("h" + std::to_string(i) + "_" + stage.name, stage.time_ms, stage.deadline_reached);
+            if (hypotheses[i].verified && (best < 0 || hypotheses[i].score > hypotheses[best].score))
+                best = i;
+        }
+        if (best < 0)
         {
-            LOG_ERROR("scan context failed, res index = %d, total descriptors = %lu! Please move the vehicle to another position and try again.", sc_res.first, trajectory_poses->size());
+            // 和之前一样，失败时留下最相似候选的粗略位姿
+            rough_pose = hypotheses.front().rough_pose;
+            LOG_ERROR("scan context failed, none of %lu hypotheses verified!", hypotheses.size());
             return false;
         }
+
+        rough_pose = hypotheses[best].rough_pose;
+        result = hypotheses[best].result;
+        report.bnb_score = hypotheses[best].report.bnb_score;
+        report.fitness_score = hypotheses[best].report.fitness_score;
+        LOG_WARN("scan context hypothesis %d of %lu verified, bnb score = %.3f, fitness_score = %.3f.", best, hypotheses.size(),
+                 hypotheses[best].score, hypotheses[best].report.fitness_score);
         return true;
     }
 
+    // 单个假设：以scan context给出的位姿为中心bnb，成功与否都接着精配准，精配准通过即为验证成功
+    void verify_hypothesis(BranchAndBoundMatcher3D &matcher, GicpTuner &tuner, PointCloudType::Ptr scan, const Eigen::Matrix4d &lidar_ext,
+                           const BnbOptions &match_option, Hypothesis &hypothesis)
+    {
+        Timer timer;
+        const Pose sc_pose = hypothesis.rough_pose;
+        const bool bnb_success = matcher.MatchWithMatchOptions(sc_pose, hypothesis.rough_pose, scan, match_option, lidar_ext, hypothesis.score, deadline_);
+        const double bnb_time = timer.elapsedLast();
+        hypothesis.report.add("sc_bnb", bnb_time, matcher.timed_out);
+        if (bnb_success)
+        {
+            LOG_WARN("bnb_pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), score = %.3f, score_cnt = %d, time = %.2lf ms",
+                     hypothesis.rough_pose.x, hypothesis.rough_pose.y, hypothesis.rough_pose.z, RAD2DEG(hypothesis.rough_pose.roll),
+                     RAD2DEG(hypothesis.rough_pose.pitch), RAD2DEG(hypothesis.rough_pose.yaw), hypothesis.score, matcher.sort_cnt, bnb_time);
+        }
+        else
+        {
+            hypothesis.rough_pose = sc_pose;
+            hypothesis.score = 0;
+            LOG_ERROR("bnb_failed, when bnb min_score = %.2f!", match_option.min_score);
+        }
+        hypothesis.verified = fine_tune_pose(tuner, hypothesis.rough_pose, scan, hypothesis.result, lidar_ext, hypothesis.score, hypothesis.report);
+    }
+
+    // 并行验证num个假设所需的bnb和GICP状态，不够时补充，第0套与gnss/手动重定位共用；bnb共用预计算网格，GICP共用target
+    void prepare_hypothesis_state(size_t num)
+    {
+        while (hypothesis_bnb.size() < num)
+        {
+            hypothesis_bnb.push_back(hypothesis_bnb.empty() ? bnb3d : std::make_shared<BranchAndBoundMatcher3D>(bnb3d->gridStack()));
+            hypothesis_bnb.back()->cancel_flag = cancel_;
+        }
+        while (gicp_tuners.size() < num)
+        {
+            gicp_tuners.emplace_back(new GicpTuner);
+            init_gicp_tuner(*gicp_tuners.back());
+        }
+    }
+
+    /**
+     * GICP target(全局地图)的搜索树和每个点的协方差，GICP在第一次配准时不必再建。
+     * 协方差计算方式与pcl GICP内部一致：k近邻的协方差，特征值替换为(1, 1, epsilon)；搜索树不缓存，每次加载地图时重建
+     */
+    void load_gicp_covariances(const std::string &cache_file)
+    {
+        Timer timer;
+        const size_t num = global_map_->size();
+        if (num < (size_t)gicp_k_correspondences)
+            return; // 交给pcl报错
+
+        GICP::KdTreePtr kdtree(new pcl::search::KdTree<PointType>);
+        kdtree->setInputCloud(global_map_);
+        gicp_target_kdtree_ = kdtree;
+        LOG_INFO("gicp target kdtree built, time = %.1f ms.", timer.elapsedLast());
+
+        const uint64_t map_checksum = cache_file.empty() ? 0 : MapCache::pointCloudChecksum(*global_map_);
+        gicp_target_covariances_.reset(new GICP::MatricesVector(num));
+        auto &covariances = *gicp_target_covariances_;
+        if (!cache_file.empty())
+        {
+            MapCache::Reader reader;
+            int32_t k = 0;
+            double epsilon = 0;
+            uint64_t cached_num = 0;
+            if (reader.open(cache_file, GICP_CACHE_MAGIC, GICP_CACHE_VERSION, map_checksum) && reader.read(k) && reader.read(epsilon) && reader.read(cached_num) &&
+                k == gicp_k_correspondences && epsilon == gicp_epsilon && cached_num == num &&
+                reader.read(covariances.data(), num * sizeof(Eigen::Matrix3d)) && reader.remaining() == 0)
+            {
+                LOG_INFO("gicp target covariances loaded from %s, points = %lu, time = %.1f ms.", cache_file.c_str(), num, timer.elapsedLast());
+                return;
+            }
+        }
+
+#pragma omp parallel
+        {
+            std::vector<int> indices;
+            std::vector<float> distances;
+#pragma omp for schedule(static)
+            for (int64_t i = 0; i < int64_t(num); ++i)
+            {
+                kdtree->nearestKSearch(global_map_->points[i], gicp_k_correspondences, indices, distances);
+                Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+                Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+                for (const int index : indices)
+                {
+                    const auto &pt = global_map_->points[index];
+                    const Eigen::Vector3d point(pt.x, pt.y, pt.z);
+                    mean += point;
+                    cov += point * point.transpose();
+                }
+                mean /= gicp_k_correspondences;
+                cov = cov / gicp_k_correspondences - mean * mean.transpose();
+                Eigen::JacobiSVD<Eigen::Matrix3d> svd(cov, Eigen::ComputeFullU);
+                const Eigen::Matrix3d &U = svd.matrixU();
+                covariances[i] = U * Eigen::Vector3d(1, 1, gicp_epsilon).asDiagonal() * U.transpose();
+            }
+        }
+        LOG_INFO("gicp target covariances computed, points = %lu, time = %.1f ms.", num, timer.elapsedLast());
+
+        if (cache_file.empty())
+            return;
+        MapCache::Writer writer;
+        writer.write(int32_t(gicp_k_correspondences));
+        writer.write(gicp_epsilon);
+        writer.write(uint64_t(num));
+        writer.write(covariances.data(), num * sizeof(Eigen::Matrix3d));
+        if (!writer.save(cache_file, GICP_CACHE_MAGIC, GICP_CACHE_VERSION, map_checksum))
+            LOG_WARN("failed to save gicp target covariances, path = %s!", cache_file.c_str());
+    }
+
+    // NDT target的体素化在后台线程进行
+    void init_ndt_tuner(NdtTuner &tuner)
+    {
+        tuner.ready = std::async(std::launch::async, [this, &tuner]() {
+            Timer timer;
+            tuner.ndt.setInputTarget(global_map_);
+            tuner.ndt.setMaximumIterations(registration_max_iterations);
+            tuner.ndt.setTransformationEpsilon(teps);
+            tuner.ndt.setStepSize(step_size);
+            tuner.ndt.setResolution(resolution);
+            LOG_INFO("ndt target built, time = %.1f ms.", timer.elapsedStart());
+        }).share();
+    }
+
+    // GICP的搜索树和协方差由load_gicp_covariances在后台建好，第一次配准前设置
+    void init_gicp_tuner(GicpTuner &tuner)
+    {
+        if (!use_gicp)
+            return;
+        tuner.gicp.setInputTarget(global_map_);
+        tuner.gicp.setCorrespondenceRandomness(gicp_k_correspondences);
+        tuner.gicp.setMaximumIterations(registration_max_iterations);
+        tuner.gicp.setMaxCorrespondenceDistance(search_radius);
+        tuner.gicp.setTransformationEpsilon(teps);
+        tuner.gicp.setEuclideanFitnessEpsilon(feps);
+    }
+
     bool run_manually_set(PointCloudType::Ptr scan, Eigen::Matrix4d &rough_mat, const Eigen::Matrix4d &lidar_ext, double &score)
     {
         if (!prior_pose_inited)
@@ -454,24 +975,33 @@ private:
 
         Timer timer;
         bool bnb_success = true;
-        if (!bnb3d->MatchWithMatchOptions(manual_pose, rough_pose, scan, bnb_option, lidar_ext, score))
+        bool bnb_timeout = false;
+        if (!bnb3d->MatchWithMatchOptions(manual_pose, rough_pose, scan, bnb_option, lidar_ext, score, deadline_))
         {
+            // 超时时不再降低min_score重试
+            bnb_timeout = bnb3d->timed_out;
             auto bnb_opt_tmp = bnb_option;
-            bnb_opt_tmp.min_score = 0.1;
-            LOG_ERROR("bnb_failed, when bnb min_score = %.2f! min_score set to %.2f and try again.", bnb_option.min_score, bnb_opt_tmp.min_score);
-            if (!bnb3d->MatchWithMatchOptions(manual_pose, rough_pose, scan, bnb_opt_tmp, lidar_ext, score))
+            if (!bnb_timeout)
+            {
+                bnb_opt_tmp.min_score = 0.1;
+                LOG_ERROR("bnb_failed, when bnb min_score = %.2f! min_score set to %.2f and try again.", bnb_option.min_score, bnb_opt_tmp.min_score);
+            }
+            if (bnb_timeout || !bnb3d->MatchWithMatchOptions(manual_pose, rough_pose, scan, bnb_opt_tmp, lidar_ext, score, deadline_))
             {
                 bnb_success = false;
                 rough_pose = manual_pose;
+                score = 0;
                 LOG_ERROR("bnb_failed, when bnb min_score = %.2f!", bnb_opt_tmp.min_score);
             }
         }
+        const double bnb_time = timer.elapsedLast();
+        report.add("manual_bnb", bnb_time, bnb_timeout || bnb3d->timed_out);
         if (bnb_success)
         {
             LOG_INFO("bnb_success!");
             LOG_WARN("bnb_pose = (%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf), score_cnt = %d, time = %.2lf ms",
                      rough_pose.x, rough_pose.y, rough_pose.z, RAD2DEG(rough_pose.roll), RAD2DEG(rough_pose.pitch), RAD2DEG(rough_pose.yaw),
-                     bnb3d->sort_cnt, timer.elapsedLast());
+                     bnb3d->sort_cnt, bnb_time);
         }
         return true;
     }
@@ -491,7 +1021,28 @@ private:
     double feps = 0.001;
     double fitness_score = 0.3;
 
+    // 到达截止时间前分段迭代的配准
+    int registration_max_iterations = 150;
+    int registration_chunk_iterations = 10;
+    std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+    const std::atomic<bool> *cancel_ = nullptr;
+    mutable std::atomic<bool> stopped_by_cancel_{false}; // deadline_reached()因为取消返回过true，多个假设线程会同时检查
+
+    // 地图目录中的预计算结构缓存
+    static constexpr const char *BNB_CACHE_FILENAME = "relocalization_bnb.cache";
+    static constexpr int BNB_MAX_ROOT_YAWS = 360; // 整圈搜索时1度
+    static constexpr const char *GICP_CACHE_FILENAME = "relocalization_gicp.cache";
+    static constexpr char GICP_CACHE_MAGIC[8] = {'G', 'I', 'C', 'P', 'C', 'O', 'V', 0};
+    static constexpr uint32_t GICP_CACHE_VERSION = 1;
+    int gicp_k_correspondences = 20; // 与pcl GICP的默认值一致
+    double gicp_epsilon = 0.001;
+    GICP::MatricesVectorPtr gicp_target_covariances_;
+    GICP::KdTreePtr gicp_target_kdtree_;
+
     pcl::VoxelGrid<PointType> voxel_filter;
-    pcl::NormalDistributionsTransform<PointType, PointType> ndt;
-    pcl::GeneralizedIterativeClosestPoint<PointType, PointType> gicp;
+    PointCloudType::Ptr global_map_;
+    std::vector<std::shared_ptr<BranchAndBoundMatcher3D>> hypothesis_bnb; // [0]即bnb3d，其余共用它的预计算网格
+    std::vector<std::unique_ptr<GicpTuner>> gicp_tuners;                  // [0]同时用于gnss/手动重定位
+    std::unique_ptr<NdtTuner> ndt_tuner;                                  // 所有假设与gnss/手动重定位共用
+    std::shared_future<void> gicp_covariances_ready_; // 放在最后，析构时先等后台计算结束
 };
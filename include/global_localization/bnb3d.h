@@ -1,13 +1,21 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <Eigen/Core>
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
 #include <pcl/filters/voxel_grid.h>
-#include <pcl/octree/octree.h>
 #include <pcl/common/transforms.h>
 #include <omp.h>
 #include "../Header.h"
+#include "MapCache.h"
+#include "OccupancyGrid3D.h"
 
 
 struct BnbOptions
@@ -16,7 +24,7 @@ struct BnbOptions
     double linear_xy_window_size = 2;                     // meter
     double linear_z_window_size = 0.5;                    // meter
     double angular_search_window = DEG2RAD(180);          // radian
-    std::vector<double> pc_resolutions = {0.2, 0.3, 0.5}; // meter
+    std::vector<double> pc_resolutions = {0.2, 0.3, 0.5}; // meter, only the finest one is used, coarser levels are max-pooled from it
     int bnb_depth = 3;
     double min_score = 0.3; // for pruning, speed up
     double enough_score = 0.8;
@@ -37,33 +45,125 @@ struct BnbOptions
     // int full_resolution_depth = 3;
 };
 
+/**
+ * 分支定界的各层网格。第depth层的节点覆盖平移 offset + k * step (k = 0, ..., 2^depth - 1, 各轴独立)的所有叶子，
+ * 该层网格是最细网格沿各轴负方向膨胀 (2^depth - 1) * step 对应体素数的最大值池化结果，
+ * 节点分数因此是其所有叶子分数的上界，剪枝不会漏掉最优解。
+ */
 class PrecomputationGridStack3D
 {
 public:
-    PrecomputationGridStack3D(PointCloudType::Ptr map, const BnbOptions &match_option)
+    static constexpr uint32_t CACHE_VERSION = 1;
+
+    /**
+     * @param[in] cache_file  非空时优先从该文件加载(校验和与map一致才使用)，否则现场生成后写入该文件
+     */
+    PrecomputationGridStack3D(PointCloudType::Ptr map, const BnbOptions &match_option, const std::string &cache_file = "")
+        : base_grid_(match_option.pc_resolutions.front())
     {
         assert(match_option.bnb_depth > 0);
-        assert(match_option.pc_resolutions.size() >= match_option.bnb_depth);
-
-        precomputation_grids_.reserve(match_option.bnb_depth);
-        for (auto i = 0; i < match_option.bnb_depth; ++i)
+        assert(!match_option.pc_resolutions.empty());
+
+        const uint64_t map_checksum = cache_file.empty() ? 0 : MapCache::pointCloudChecksum(*map);
+        const bool loaded = !cache_file.empty() && load(cache_file, map_checksum);
+        if (loaded)
+            LOG_INFO("bnb precomputation grids loaded from %s, resolution = %.2f, pooled grids = %lu",
+                     cache_file.c_str(), base_grid_.resolution(), pooled_grids_.size());
+        else
         {
-            precomputation_grids_.emplace_back(match_option.pc_resolutions[i]);
-            auto& octree = precomputation_grids_.back();
-            octree.setInputCloud(map);
-            octree.addPointsFromInputCloud();
+            base_grid_.build(*map);
+            LOG_INFO("bnb precomputation grid resolution = %.2f, blocks = %lu, memory = %.1f MB",
+                     base_grid_.resolution(), base_grid_.numBlocks(), base_grid_.memoryBytes() / 1048576.0);
         }
+
+        // 默认参数用到的各层网格提前生成，其他搜索步长第一次用到时生成
+        const size_t cached_num = pooled_grids_.size();
+        for (auto depth = 1; depth < match_option.bnb_depth; ++depth)
+            Get(depth, match_option.min_xy_resolution, match_option.min_z_resolution);
+        if (!cache_file.empty() && (!loaded || pooled_grids_.size() != cached_num) && !save(cache_file, map_checksum))
+            LOG_WARN("failed to save bnb precomputation grids, path = %s!", cache_file.c_str());
     }
 
-    const pcl::octree::OctreePointCloudSearch<PointType> &Get(int depth) const
+    /**
+     * @brief 第depth层的网格
+     *
+     * @param[in] xy_step, z_step  叶子的平移步长上限，步长不大于它们的搜索都可以共用同一组网格
+     */
+    const OccupancyGrid3D &Get(int depth, double xy_step, double z_step)
     {
-        return precomputation_grids_.at(depth);
+        const int span = (1 << depth) - 1;
+        const int dilation_xy = dilation(span * xy_step), dilation_z = dilation(span * z_step);
+        if (dilation_xy == 0 && dilation_z == 0)
+            return base_grid_;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto &grid = pooled_grids_[{dilation_xy, dilation_z}];
+        if (!grid)
+        {
+            grid.reset(new OccupancyGrid3D(base_grid_.dilated(dilation_xy, dilation_z)));
+            LOG_INFO("bnb precomputation grid depth = %d, dilation = (%d, %d) voxels, blocks = %lu, memory = %.1f MB",
+                     depth, dilation_xy, dilation_z, grid->numBlocks(), grid->memoryBytes() / 1048576.0);
+        }
+        return *grid;
     }
 
-    int max_depth() const { return precomputation_grids_.size() - 1; }
+    double resolution() const { return base_grid_.resolution(); }
+
+    // 保存基础网格和目前已生成的各层网格
+    bool save(const std::string &file, uint64_t map_checksum)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        MapCache::Writer writer;
+        base_grid_.save(writer);
+        writer.write(uint64_t(pooled_grids_.size()));
+        for (const auto &pooled : pooled_grids_)
+        {
+            const int32_t dilation[2] = {pooled.first.first, pooled.first.second};
+            writer.write(dilation);
+            pooled.second->save(writer);
+        }
+        return writer.save(file, CACHE_MAGIC, CACHE_VERSION, map_checksum);
+    }
 
 private:
-    std::vector<pcl::octree::OctreePointCloudSearch<PointType>> precomputation_grids_;
+    static constexpr char CACHE_MAGIC[8] = {'B', 'N', 'B', 'G', 'R', 'I', 'D', 0};
+
+    // 文件不可用或基础网格分辨率不同时返回false，网格保持为空
+    bool load(const std::string &file, uint64_t map_checksum)
+    {
+        MapCache::Reader reader;
+        OccupancyGrid3D base_grid;
+        uint64_t pooled_num = 0;
+        if (!reader.open(file, CACHE_MAGIC, CACHE_VERSION, map_checksum) || !base_grid.load(reader) ||
+            base_grid.resolution() != base_grid_.resolution() || !reader.read(pooled_num))
+            return false;
+
+        std::map<std::pair<int, int>, std::unique_ptr<OccupancyGrid3D>> pooled_grids;
+        for (uint64_t i = 0; i < pooled_num; ++i)
+        {
+            int32_t dilation[2];
+            std::unique_ptr<OccupancyGrid3D> grid(new OccupancyGrid3D());
+            if (!reader.read(dilation) || !grid->load(reader))
+                return false;
+            pooled_grids[{dilation[0], dilation[1]}] = std::move(grid);
+        }
+        if (reader.remaining() != 0)
+            return false;
+
+        base_grid_ = std::move(base_grid);
+        pooled_grids_.swap(pooled_grids);
+        return true;
+    }
+
+    // 平移span米时查询点可能跨过的体素数
+    int dilation(double span) const
+    {
+        return std::max(0, (int)std::ceil(span / base_grid_.resolution() - 1e-6));
+    }
+
+    OccupancyGrid3D base_grid_;
+    std::mutex mutex_;
+    std::map<std::pair<int, int>, std::unique_ptr<OccupancyGrid3D>> pooled_grids_;
 };
 
 struct Pose
@@ -114,22 +214,29 @@ struct DiscretePose3D
         auto max_depth = 1 << (match_option.bnb_depth - 1);
         candidate_xy_part = (int)std::ceil(2. * match_option.linear_xy_window_size / max_depth / match_option.min_xy_resolution);
         candidate_z_part = (int)std::ceil(2. * match_option.linear_z_window_size / max_depth / match_option.min_z_resolution);
-        candidate_angular_part = (int)std::ceil(2. * match_option.angular_search_window / max_depth / match_option.min_angular_resolution);
+        // 只对平移分支定界，角度直接按最细分辨率枚举(同Cartographer 3D)，保证预计算网格给出的是上界
+        candidate_angular_part = (int)std::ceil(2. * match_option.angular_search_window / match_option.min_angular_resolution);
 
         discrete_xy_step = 2 * match_option.linear_xy_window_size / candidate_xy_part;
         discrete_z_step = 2 * match_option.linear_z_window_size / candidate_z_part;
         discrete_angular_step = 2 * match_option.angular_search_window / candidate_angular_part;
 
+        for (auto discrete_angular = init_discrete_angular; discrete_angular <= initial_pose.yaw + match_option.angular_search_window; discrete_angular += discrete_angular_step)
+        {
+            discrete_yaw.push_back(discrete_angular);
+        }
+
         for (auto discrete_x = init_discrete_x; discrete_x <= initial_pose.x + match_option.linear_xy_window_size; discrete_x += discrete_xy_step)
         {
             for (auto discrete_y = init_discrete_y; discrete_y <= initial_pose.y + match_option.linear_xy_window_size; discrete_y += discrete_xy_step)
             {
                 for (auto discrete_z = init_discrete_z; discrete_z <= initial_pose.z + match_option.linear_z_window_size; discrete_z += discrete_z_step)
                 {
-                    for (auto discrete_angular = init_discrete_angular; discrete_angular <= initial_pose.yaw + match_option.angular_search_window; discrete_angular += discrete_angular_step)
+                    for (auto yaw_index = 0; yaw_index < discrete_yaw.size(); ++yaw_index)
                     {
                         // discrete_pose.emplace_back(discrete_x, discrete_y, discrete_z, 0, 0, discrete_angular);
-                        discrete_pose.emplace_back(discrete_x, discrete_y, discrete_z, initial_pose.roll, initial_pose.pitch, discrete_angular);
+                        discrete_pose.emplace_back(discrete_x, discrete_y, discrete_z, initial_pose.roll, initial_pose.pitch, discrete_yaw[yaw_index]);
+                        discrete_yaw_index.push_back(yaw_index);
                     }
                 }
             }
@@ -145,6 +252,8 @@ struct DiscretePose3D
     double discrete_z_step;
     double discrete_angular_step;
     std::vector<Pose> discrete_pose;
+    std::vector<double> discrete_yaw;    // 所有离散的yaw
+    std::vector<int> discrete_yaw_index; // discrete_pose[i]的yaw = discrete_yaw[discrete_yaw_index[i]]
 };
 
 struct Candidate3D
@@ -171,14 +280,66 @@ struct Candidate3D
     bool operator>(const Candidate3D &other) const { return score > other.score; }
 };
 
+/**
+ * 参与打分的scan点，x/y/z分量各自连续存放(SoA)，变换时可以一次处理一组点
+ */
+struct ScanPoints
+{
+    ScanPoints() = default;
+
+    explicit ScanPoints(const PointCloudType &cloud)
+    {
+        x.reserve(cloud.points.size());
+        y.reserve(cloud.points.size());
+        z.reserve(cloud.points.size());
+        for (const auto &point : cloud.points)
+        {
+            x.push_back(point.x);
+            y.push_back(point.y);
+            z.push_back(point.z);
+        }
+    }
+
+    size_t size() const { return x.size(); }
+
+    // p' = transform * [p; 1]
+    ScanPoints transformed(const Eigen::Matrix<float, 3, 4> &transform) const
+    {
+        ScanPoints result;
+        result.x.resize(size());
+        result.y.resize(size());
+        result.z.resize(size());
+        const float r00 = transform(0, 0), r01 = transform(0, 1), r02 = transform(0, 2), t0 = transform(0, 3);
+        const float r10 = transform(1, 0), r11 = transform(1, 1), r12 = transform(1, 2), t1 = transform(1, 3);
+        const float r20 = transform(2, 0), r21 = transform(2, 1), r22 = transform(2, 2), t2 = transform(2, 3);
+        for (size_t i = 0; i < size(); ++i)
+        {
+            result.x[i] = r00 * x[i] + r01 * y[i] + r02 * z[i] + t0;
+            result.y[i] = r10 * x[i] + r11 * y[i] + r12 * z[i] + t1;
+            result.z[i] = r20 * x[i] + r21 * y[i] + r22 * z[i] + t2;
+        }
+        return result;
+    }
+
+    std::vector<float> x, y, z;
+};
+
 class BranchAndBoundMatcher3D
 {
 public:
-    BranchAndBoundMatcher3D(PointCloudType::Ptr map, const BnbOptions &match_option)
-        : precomputation_grid_stack_(map, match_option)
+    BranchAndBoundMatcher3D(PointCloudType::Ptr map, const BnbOptions &match_option, const std::string &cache_file = "")
+        : precomputation_grid_stack_(std::make_shared<PrecomputationGridStack3D>(map, match_option, cache_file))
+    {
+    }
+
+    // 共用已有的预计算网格，搜索状态各自独立，多个matcher可以同时搜索
+    explicit BranchAndBoundMatcher3D(const std::shared_ptr<PrecomputationGridStack3D> &precomputation_grid_stack)
+        : precomputation_grid_stack_(precomputation_grid_stack)
     {
     }
 
+    const std::shared_ptr<PrecomputationGridStack3D> &gridStack() const { return precomputation_grid_stack_; }
+
     PointCloudType::Ptr filterScan(const PointCloudType::Ptr &scan, const BnbOptions &match_option)
     {
         PointCloudType::Ptr filter_cloud(new PointCloudType);
@@ -189,142 +350,325 @@ public:
         return filter_cloud;
     }
 
-    std::vector<Candidate3D> ComputeLowestResolutionCandidates(const DiscretePose3D& discrete_candidate_pose)
+    // 按离初始位姿由近到远(以各维步长为单位)排列，截止时间到达时先打分的是最可能的候选
+    std::vector<Candidate3D> ComputeLowestResolutionCandidates(const DiscretePose3D &discrete_candidate_pose, const Pose &init_pose)
     {
         std::vector<Candidate3D> candidates;
+        std::vector<double> distances;
         candidates.reserve(discrete_candidate_pose.discrete_pose.size());
+        distances.reserve(discrete_candidate_pose.discrete_pose.size());
         for (int scan_index = 0; scan_index != discrete_candidate_pose.discrete_pose.size(); ++scan_index)
         {
+            const Pose &pose = discrete_candidate_pose.discrete_pose[scan_index];
+            // 根节点覆盖[pose, pose + discrete_step)，用中心计算距离
+            const double dx = (pose.x - init_pose.x) / discrete_candidate_pose.discrete_xy_step + 0.5;
+            const double dy = (pose.y - init_pose.y) / discrete_candidate_pose.discrete_xy_step + 0.5;
+            const double dz = (pose.z - init_pose.z) / discrete_candidate_pose.discrete_z_step + 0.5;
+            const double dyaw = (pose.yaw - init_pose.yaw) / discrete_candidate_pose.discrete_angular_step;
             candidates.emplace_back(scan_index, Eigen::Vector4d(0, 0, 0, 0));
+            distances.push_back(dx * dx + dy * dy + dz * dz + dyaw * dyaw);
         }
+        std::stable_sort(candidates.begin(), candidates.end(), [&](const Candidate3D &a, const Candidate3D &b) {
+            return distances[a.discrete_index] < distances[b.discrete_index];
+        });
         return candidates;
     }
 
-    // 计算当前位姿点云在地图中的占据分数
-    double calculateOccupancyScore(const int depth, const PointCloudType::Ptr &pointCloud)
+    /**
+     * @brief 每个离散yaw把scan旋转一次(roll/pitch取先验位姿)，并缩放到体素尺度：rotated = R * lidar_ext * p / resolution，
+     * 同一yaw下的候选只差平移，打分时每个点只剩加法、取整和查询(同Cartographer 3D的离散scan集合)
+     */
+    std::vector<ScanPoints> RotateScan(const ScanPoints &scan, const DiscretePose3D &discrete_candidate_pose, const Pose &init_pose)
     {
-        assert(depth <= precomputation_grid_stack_.max_depth());
-        double score = 0;
-        auto& octree = precomputation_grid_stack_.Get(depth);
+        const double inv_resolution = 1.0 / precomputation_grid_stack_->resolution();
+        std::vector<ScanPoints> rotated_scans(discrete_candidate_pose.discrete_yaw.size());
+#pragma omp parallel for num_threads(proc_num)
+        for (auto i = 0; i < rotated_scans.size(); ++i)
+        {
+            const Pose rotation(0, 0, 0, init_pose.roll, init_pose.pitch, discrete_candidate_pose.discrete_yaw[i]);
+            const Eigen::Matrix4d transform = rotation.toMatrix4d() * init_lidar_orientation_;
+            rotated_scans[i] = scan.transformed((transform.topRows<3>() * inv_resolution).cast<float>());
+        }
+        return rotated_scans;
+    }
 
-        // 查询给定点是否在八叉树网格中
-        for (const auto &point : pointCloud->points)
+    /**
+     * @brief 计算旋转后的scan平移translation时的占据分数(落在被占据体素中的点的比例)
+     * 平移和查询融合：每次把一组点平移、取整到栈上的小缓冲区(线程私有，不分配内存)再逐点查询，
+     * 平移取整循环是SoA上的纯加法和取整，可以向量化。
+     *
+     * @param[in] rotated_scan  RotateScan的结果，体素尺度
+     * @param[in] translation  候选位姿的平移，米
+     */
+    double calculateOccupancyScore(const int depth, const ScanPoints &rotated_scan, const Eigen::Vector3d &translation)
+    {
+        assert(depth < level_grids_.size());
+        const auto &grid = *level_grids_[depth];
+        const size_t num_points = rotated_scan.size();
+        if (num_points == 0)
+            return 0;
+
+        // voxel = rotated + (t - origin) / resolution，各层网格和RotateScan使用同一分辨率
+        const Eigen::Vector3d origin(grid.origin()[0], grid.origin()[1], grid.origin()[2]);
+        const Eigen::Vector3f offset = ((translation - origin) / grid.resolution()).cast<float>();
+        const float t0 = offset(0), t1 = offset(1), t2 = offset(2);
+        // 先截断到网格包围盒外一格以内，转换为整数不会溢出，截断后的点仍然落在包围盒外
+        float lower[3], upper[3];
+        for (int i = 0; i < 3; ++i)
         {
-            if (octree.isVoxelOccupiedAtPoint(point))
+            lower[i] = grid.minIndex()[i] - 1;
+            upper[i] = grid.maxIndex()[i] + 1;
+        }
+
+        constexpr int SCORE_CHUNK = 64;
+        alignas(32) int32_t voxel_x[SCORE_CHUNK], voxel_y[SCORE_CHUNK], voxel_z[SCORE_CHUNK];
+        const float *px = rotated_scan.x.data(), *py = rotated_scan.y.data(), *pz = rotated_scan.z.data();
+        int score = 0;
+        for (size_t begin = 0; begin < num_points; begin += SCORE_CHUNK)
+        {
+            const int count = std::min<size_t>(SCORE_CHUNK, num_points - begin);
+#pragma omp simd
+            for (int i = 0; i < count; ++i)
             {
-                ++score;
+                voxel_x[i] = floorToInt(px[begin + i] + t0, lower[0], upper[0]);
+                voxel_y[i] = floorToInt(py[begin + i] + t1, lower[1], upper[1]);
+                voxel_z[i] = floorToInt(pz[begin + i] + t2, lower[2], upper[2]);
             }
+            for (int i = 0; i < count; ++i)
+                score += grid.occupiedVoxel(voxel_x[i], voxel_y[i], voxel_z[i]);
         }
-        return score / pointCloud->points.size();
+        return double(score) / num_points;
+    }
+
+    void ScoreCandidate(const int depth, const std::vector<ScanPoints> &rotated_scans,
+                        const DiscretePose3D &discrete_candidate_pose, Candidate3D &candidate)
+    {
+        const auto &candidate_pose = discrete_candidate_pose.discrete_pose[candidate.discrete_index];
+        const Eigen::Vector3d translation = Eigen::Vector3d(candidate_pose.x, candidate_pose.y, candidate_pose.z) + candidate.offset.head<3>();
+        const auto &rotated_scan = rotated_scans[discrete_candidate_pose.discrete_yaw_index[candidate.discrete_index]];
+        candidate.score = calculateOccupancyScore(depth, rotated_scan, translation);
     }
 
-    void ScoreCandidates(const int depth, const PointCloudType::Ptr &pointCloud,
+    void ScoreCandidates(const int depth, const std::vector<ScanPoints> &rotated_scans,
                          const DiscretePose3D &discrete_candidate_pose, std::vector<Candidate3D> &candidates)
     {
-#pragma omp parallel for num_threads(BNB_PROC_NUM)
+        // 动态调度使截止时间到达时已打分的是candidates的一个前缀
+#pragma omp parallel for num_threads(proc_num) schedule(dynamic)
         // omp mustn't use '!=' / 'range for'
         for (auto i = 0; i < candidates.size(); ++i)
         {
-            PointCloudType::Ptr trans_pc(new PointCloudType(pointCloud->points.size(), 1));
-            auto candidate_pose = discrete_candidate_pose.discrete_pose[candidates[i].discrete_index];
-            candidate_pose += candidates[i].offset;
-            const Eigen::Matrix4d &candidate_lidar_pose = candidate_pose.toMatrix4d() * init_lidar_orientation_;
-            pcl::transformPointCloud(*pointCloud, *trans_pc, candidate_lidar_pose);
-            candidates[i].score = calculateOccupancyScore(depth, trans_pc);
+            // 超时后剩下的候选不再打分，保持-inf，分支定界时会被剪枝
+            if (DeadlineReached())
+                continue;
+            ScoreCandidate(depth, rotated_scans, discrete_candidate_pose, candidates[i]);
         }
         sort_cnt++;
+        scored_cnt += candidates.size();
         std::sort(candidates.begin(), candidates.end(), std::greater<Candidate3D>());
     }
 
-    Candidate3D BranchAndBound(const BnbOptions &match_option, const PointCloudType::Ptr &scan,
+    // candidate_depth层的节点分成下一层的(最多)8个子节点，平移各轴取 {0, step}
+    void Branch(const BnbOptions &match_option, const DiscretePose3D &discrete_candidate_pose, const Candidate3D &candidate,
+                const int candidate_depth, std::vector<Candidate3D> &higher_resolution_candidates)
+    {
+        higher_resolution_candidates.clear();
+        const int resolution = 1 << (match_option.bnb_depth - candidate_depth);
+        double xy_step = discrete_candidate_pose.discrete_xy_step / resolution;
+        double z_step = discrete_candidate_pose.discrete_z_step / resolution;
+        for (double z : {0., z_step})
+        {
+            if (candidate.offset(2) + z > match_option.linear_xy_window_size)
+            {
+                break;
+            }
+            for (double y : {0., xy_step})
+            {
+                if (candidate.offset(1) + y > match_option.linear_xy_window_size)
+                {
+                    break;
+                }
+                for (double x : {0., xy_step})
+                {
+                    if (candidate.offset(0) + x > match_option.linear_xy_window_size)
+                    {
+                        break;
+                    }
+                    higher_resolution_candidates.emplace_back(candidate.discrete_index, candidate.offset + Eigen::Vector4d(x, y, z, 0));
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief 最优优先的并行分支定界
+     * 所有待展开的节点放在一个按分数(上界)排序的共享优先队列里，proc_num个工作线程各自取出当前上界最高的节点，
+     * 串行地给它的子节点打分后放回队列，空闲的线程直接从队列取下一个节点，并行粒度是节点而不是每次展开里的几个子节点。
+     * 当前最优叶子的分数原子共享，上界低于它的节点不再展开；队列里最高的上界都低于它时搜索结束。
+     * 同分的叶子取(discrete_index, offset)最小的一个，结果与线程调度无关。
+     * 到达截止时间时停止展开，返回目前最好的叶子；还没有到达过叶子时，从上界最高的节点贪心地逐层取最高分的子节点下降到叶子。
+     *
+     * @param[in] candidates  candidate_depth层已打分的节点
+     * @param[in] min_score  只返回分数大于min_score的叶子，没有时返回分数为min_score的Unsuccessful()
+     */
+    Candidate3D BranchAndBound(const BnbOptions &match_option, const std::vector<ScanPoints> &rotated_scans,
                                DiscretePose3D &discrete_candidate_pose, const std::vector<Candidate3D> &candidates,
                                const int candidate_depth, float min_score)
     {
-        if (candidate_depth == 0)
-        {
-            if (match_option.debug_mode)
+        Candidate3D best_candidate = Candidate3D::Unsuccessful();
+        best_candidate.score = min_score;
+        std::atomic<bool> found(false);
+        std::mutex best_mutex;
+        std::atomic<float> best_score(min_score);
+        // 分数等于当前最优的节点仍然展开，以便同分时按索引取最小的叶子
+        auto pruned = [&](const Candidate3D &candidate) {
+            return candidate.score <= min_score || candidate.score < best_score.load(std::memory_order_relaxed);
+        };
+        auto update_best = [&](const Candidate3D &candidate) {
+            if (pruned(candidate))
+                return;
+            std::lock_guard<std::mutex> lock(best_mutex);
+            if (!found || candidate.score > best_candidate.score ||
+                (candidate.score == best_candidate.score && PoseIndexLess(candidate, best_candidate)))
             {
-                printf("bnb_depth = %d, score = %f\n", candidate_depth, candidates.begin()->score);
+                found = true;
+                best_candidate = candidate;
+                best_score.store(candidate.score, std::memory_order_relaxed);
+                if (match_option.debug_mode)
+                {
+                    printf("bnb best score = %f\n", candidate.score);
+                }
             }
-            // Return the best candidate.
-            return *candidates.begin();
+        };
+
+        if (candidate_depth == 0)
+        {
+            for (const Candidate3D &candidate : candidates)
+                update_best(candidate);
+            return best_candidate;
         }
 
-        Candidate3D best_high_resolution_candidate = Candidate3D::Unsuccessful();
-        best_high_resolution_candidate.score = min_score;
+        std::priority_queue<SearchNode> queue;
         for (const Candidate3D &candidate : candidates)
         {
-            if (candidate.score <= min_score)
-            {
-                break;
-            }
+            if (!pruned(candidate))
+                queue.push({candidate, candidate_depth});
+        }
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        int busy_workers = 0; // 正在展开节点的线程数，它们还可能往队列里放节点
+
+        int total_scored = 0, total_expanded = 0;
+#pragma omp parallel num_threads(proc_num) reduction(+ : total_scored, total_expanded)
+        {
             std::vector<Candidate3D> higher_resolution_candidates;
-            const int resolution = 1 << (match_option.bnb_depth - candidate_depth);
-            double xy_step = discrete_candidate_pose.discrete_xy_step / resolution;
-            double z_step = discrete_candidate_pose.discrete_z_step / resolution;
-            double angular_step = discrete_candidate_pose.discrete_angular_step / resolution;
-            for (double& yaw : std::vector<double>{0, angular_step})
+            higher_resolution_candidates.reserve(8);
+            while (true)
             {
-                if (candidate.offset(3) + yaw > match_option.linear_xy_window_size)
+                SearchNode node{Candidate3D::Unsuccessful(), 0};
                 {
-                    break;
-                }
-                for (double& z : std::vector<double>{0, z_step})
-                {
-                    if (candidate.offset(2) + z > match_option.linear_xy_window_size)
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    if (!queue.empty() && DeadlineReached())
                     {
-                        break;
+                        // 只留下上界最高的节点，有最优叶子时也不再展开它
+                        node = queue.top();
+                        queue = std::priority_queue<SearchNode>();
+                        if (found)
+                            continue;
+                        ++busy_workers;
+                        lock.unlock();
+                        total_expanded += node.depth;
+                        total_scored += Dive(match_option, rotated_scans, discrete_candidate_pose, node);
+                        update_best(node.candidate);
+                        lock.lock();
+                        --busy_workers;
+                        queue_cv.notify_all();
                     }
-                    for (double& y : std::vector<double>{0, xy_step})
+                    while (true)
                     {
-                        if (candidate.offset(1) + y > match_option.linear_xy_window_size)
-                        {
+                        // 队首的上界最高，它被剪枝时剩下的节点都会被剪枝
+                        if (!queue.empty() && pruned(queue.top().candidate))
+                            queue = std::priority_queue<SearchNode>();
+                        if (!queue.empty() || busy_workers == 0)
                             break;
-                        }
-                        for (double& x : std::vector<double>{0, xy_step})
+                        queue_cv.wait(lock);
+                    }
+                    if (queue.empty())
+                    {
+                        queue_cv.notify_all();
+                        break;
+                    }
+                    node = queue.top();
+                    queue.pop();
+                    ++busy_workers;
+                }
+
+                ++total_expanded;
+                Branch(match_option, discrete_candidate_pose, node.candidate, node.depth, higher_resolution_candidates);
+                for (Candidate3D &candidate : higher_resolution_candidates)
+                {
+                    ScoreCandidate(node.depth - 1, rotated_scans, discrete_candidate_pose, candidate);
+                    if (node.depth - 1 == 0)
+                        update_best(candidate);
+                }
+                total_scored += higher_resolution_candidates.size();
+
+                {
+                    std::lock_guard<std::mutex> lock(queue_mutex);
+                    --busy_workers;
+                    if (node.depth - 1 > 0)
+                    {
+                        for (const Candidate3D &candidate : higher_resolution_candidates)
                         {
-                            if (candidate.offset(0) + x > match_option.linear_xy_window_size)
-                            {
-                                break;
-                            }
-                            higher_resolution_candidates.emplace_back(candidate.discrete_index, candidate.offset + Eigen::Vector4d(x, y, z, yaw));
+                            if (!pruned(candidate))
+                                queue.push({candidate, node.depth - 1});
                         }
                     }
                 }
-            }
-            ScoreCandidates(candidate_depth - 1, scan, discrete_candidate_pose, higher_resolution_candidates);
-            best_high_resolution_candidate = std::max(
-                best_high_resolution_candidate,
-                BranchAndBound(match_option, scan, discrete_candidate_pose,
-                               higher_resolution_candidates, candidate_depth - 1,
-                               best_high_resolution_candidate.score));
-            if (match_option.debug_mode)
-            {
-                printf("bnb_depth = %d, score = %f\n", candidate_depth, best_high_resolution_candidate.score);
+                queue_cv.notify_all();
             }
         }
-        return best_high_resolution_candidate;
+        sort_cnt += total_expanded;
+        scored_cnt += total_scored;
+        expanded_cnt += total_expanded;
+        return best_candidate;
     }
 
+    /**
+     * @brief 在init_pose附近的窗口内搜索使scan占据分数最高的位姿
+     *
+     * @param[in] deadline  到达截止时间时返回目前为止最好的结果(分数仍需大于min_score)，timed_out标记本次搜索是否被截断
+     */
     bool MatchWithMatchOptions(const Pose &init_pose, Pose &res_pose,
                                const PointCloudType::Ptr &scan,
                                const BnbOptions &match_option,
                                const Eigen::Matrix4d &lidar_ext,
-                               double &score)
+                               double &score,
+                               const std::chrono::steady_clock::time_point &deadline = std::chrono::steady_clock::time_point::max())
     {
         sort_cnt = 0;
+        scored_cnt = 0;
+        expanded_cnt = 0;
+        timed_out = false;
+        cancelled = false;
+        deadline_ = deadline;
         init_lidar_orientation_ = lidar_ext;
-        auto filter_scan = filterScan(scan, match_option);
+        const int max_depth = match_option.bnb_depth - 1;
+        level_grids_.clear();
+        for (auto depth = 0; depth <= max_depth; ++depth)
+            level_grids_.push_back(&precomputation_grid_stack_->Get(depth, match_option.min_xy_resolution, match_option.min_z_resolution));
+
+        const ScanPoints filter_scan(*filterScan(scan, match_option));
         DiscretePose3D discrete_candidate_pose(init_pose, match_option);
-        std::vector<Candidate3D> lowest_resolution_candidates = ComputeLowestResolutionCandidates(discrete_candidate_pose);
-        ScoreCandidates(precomputation_grid_stack_.max_depth(), filter_scan, discrete_candidate_pose, lowest_resolution_candidates);
+        const std::vector<ScanPoints> rotated_scans = RotateScan(filter_scan, discrete_candidate_pose, init_pose);
+        std::vector<Candidate3D> lowest_resolution_candidates = ComputeLowestResolutionCandidates(discrete_candidate_pose, init_pose);
+        ScoreCandidates(max_depth, rotated_scans, discrete_candidate_pose, lowest_resolution_candidates);
 
-        const Candidate3D best_candidate = BranchAndBound(match_option, filter_scan, discrete_candidate_pose, lowest_resolution_candidates,
-                                                          precomputation_grid_stack_.max_depth(), match_option.min_score);
+        const Candidate3D best_candidate = BranchAndBound(match_option, rotated_scans, discrete_candidate_pose, lowest_resolution_candidates,
+                                                          max_depth, match_option.min_score);
 
-        printf("xy_step = %d, z_step = %d, angular_step = %d, init_candidates_num = %lu, best_score = %f\n",
+        printf("xy_step = %d, z_step = %d, angular_step = %d, init_candidates_num = %lu, scored_nodes = %d, expanded_nodes = %d, best_score = %f%s\n",
                discrete_candidate_pose.candidate_xy_part, discrete_candidate_pose.candidate_z_part, discrete_candidate_pose.candidate_angular_part,
-               lowest_resolution_candidates.size(), best_candidate.score);
+               lowest_resolution_candidates.size(), scored_cnt, expanded_cnt, best_candidate.score, timed_out ? ", timed out" : "");
         if (best_candidate.score > match_option.min_score + 1e-6)
         {
             res_pose = discrete_candidate_pose.discrete_pose[best_candidate.discrete_index];
@@ -336,9 +680,77 @@ public:
     }
 
     EIGEN_MAKE_ALIGNED_OPERATOR_NEW
-    int sort_cnt = 0;
+    int sort_cnt = 0;     // 打分的批次数(根节点一批，之后每展开一个节点一批)
+    int scored_cnt = 0;   // 打分的节点数
+    int expanded_cnt = 0; // 展开(没有被剪枝)的节点数
+    std::atomic<bool> timed_out{false}; // 上一次搜索到达了截止时间，结果不一定最优
+    std::atomic<bool> cancelled{false}; // 上一次搜索是被cancel_flag截断的(timed_out同时置位)，截止时间还没到
+    const std::atomic<bool> *cancel_flag = nullptr; // 非空且置位时和到达截止时间一样提前结束搜索
+    int proc_num = BNB_PROC_NUM; // openmp线程数，多个matcher同时搜索时由调用者分摊BNB_PROC_NUM
 private:
+    struct SearchNode
+    {
+        Candidate3D candidate;
+        int depth;
+
+        // 上界高的先展开，同分时先展开更深(更接近叶子)的节点，尽早得到可以剪枝的最优分数
+        bool operator<(const SearchNode &other) const
+        {
+            if (candidate.score != other.candidate.score)
+                return candidate.score < other.candidate.score;
+            return depth > other.depth;
+        }
+    };
+
+    bool DeadlineReached()
+    {
+        if (std::chrono::steady_clock::now() >= deadline_)
+        {
+            timed_out = true;
+            return true;
+        }
+        if (!(cancel_flag && *cancel_flag))
+            return false;
+        timed_out = true;
+        cancelled = true;
+        return true;
+    }
+
+    // 贪心下降：每层只保留分数最高的子节点直到叶子，返回打分的节点数
+    int Dive(const BnbOptions &match_option, const std::vector<ScanPoints> &rotated_scans,
+             const DiscretePose3D &discrete_candidate_pose, SearchNode &node)
+    {
+        int scored = 0;
+        std::vector<Candidate3D> higher_resolution_candidates;
+        for (; node.depth > 0; --node.depth)
+        {
+            Branch(match_option, discrete_candidate_pose, node.candidate, node.depth, higher_resolution_candidates);
+            for (Candidate3D &candidate : higher_resolution_candidates)
+                ScoreCandidate(node.depth - 1, rotated_scans, discrete_candidate_pose, candidate);
+            scored += higher_resolution_candidates.size();
+            node.candidate = *std::max_element(higher_resolution_candidates.begin(), higher_resolution_candidates.end());
+        }
+        return scored;
+    }
+
+    static bool PoseIndexLess(const Candidate3D &a, const Candidate3D &b)
+    {
+        if (a.discrete_index != b.discrete_index)
+            return a.discrete_index < b.discrete_index;
+        return std::lexicographical_compare(a.offset.data(), a.offset.data() + 4, b.offset.data(), b.offset.data() + 4);
+    }
+
+    // 截断到[lower, upper]后向下取整，写成可以向量化的形式
+    static inline int32_t floorToInt(float value, float lower, float upper)
+    {
+        value = std::min(std::max(value, lower), upper);
+        const int32_t truncated = int32_t(value);
+        return truncated - (value < truncated);
+    }
+
     Eigen::Matrix4d init_lidar_orientation_;
-    PrecomputationGridStack3D precomputation_grid_stack_;
+    std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+    std::shared_ptr<PrecomputationGridStack3D> precomputation_grid_stack_;
+    std::vector<const OccupancyGrid3D *> level_grids_; // 本次搜索各层使用的网格
 };
 
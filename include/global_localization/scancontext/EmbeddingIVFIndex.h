@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * IVF-Flat近似最近邻索引：k-means把向量分成nlist个簇，查询时只扫描离查询最近的nprobe个簇，
+ * nprobe越大召回越高，nprobe = nlist时退化为暴力搜索。
+ * 向量按簇重新排列后连续存放，扫描一个簇就是扫描一段连续内存。向量维度在build/load时确定。
+ */
+class EmbeddingIVFIndex
+{
+public:
+    static constexpr uint32_t FILE_VERSION = 1;
+
+    int dim() const { return dim_; }
+    size_t size() const { return ids_.size(); }
+    bool empty() const { return ids_.empty(); }
+    int nlist() const { return int(list_offsets_.size()) - 1; }
+
+    /**
+     * @brief 构建索引
+     *
+     * @param[in] data  num_points * dim, row-major
+     * @param[in] num_points
+     * @param[in] dim  向量维度
+     * @param[in] nlist  簇的数量，<= 0时取sqrt(num_points)
+     * @param[in] iterations  Lloyd迭代次数
+     */
+    void build(const float *data, size_t num_points, int dim, int nlist = 0, int iterations = 10)
+    {
+        clear();
+        if (num_points == 0 || dim <= 0)
+            return;
+        dim_ = dim;
+
+        if (nlist <= 0)
+            nlist = std::max(1, int(std::sqrt(double(num_points)) + 0.5));
+        nlist = std::min<int>(nlist, num_points);
+
+        // 均匀取样作为初始中心，结果可复现
+        centroids_.resize(size_t(nlist) * dim_);
+        for (int c = 0; c < nlist; ++c)
+            std::copy_n(data + (num_points * c / nlist) * dim_, dim_, centroids_.data() + size_t(c) * dim_);
+
+        std::vector<int> assignment(num_points, 0);
+        std::vector<double> sums(size_t(nlist) * dim_);
+        std::vector<int> counts(nlist);
+        for (int iter = 0; iter < iterations; ++iter)
+        {
+#pragma omp parallel for schedule(static)
+            for (int64_t i = 0; i < int64_t(num_points); ++i)
+                assignment[i] = nearestCentroid(data + i * dim_);
+
+            std::fill(sums.begin(), sums.end(), 0.0);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < num_points; ++i)
+            {
+                double *sum = sums.data() + size_t(assignment[i]) * dim_;
+                for (int d = 0; d < dim_; ++d)
+                    sum[d] += data[i * dim_ + d];
+                ++counts[assignment[i]];
+            }
+            for (int c = 0; c < nlist; ++c)
+            {
+                if (counts[c] == 0) // 空簇保留原来的中心
+                    continue;
+                for (int d = 0; d < dim_; ++d)
+                    centroids_[size_t(c) * dim_ + d] = sums[size_t(c) * dim_ + d] / counts[c];
+            }
+        }
+
+#pragma omp parallel for schedule(static)
+        for (int64_t i = 0; i < int64_t(num_points); ++i)
+            assignment[i] = nearestCentroid(data + i * dim_);
+
+        // 按簇排列
+        list_offsets_.assign(nlist + 1, 0);
+        for (size_t i = 0; i < num_points; ++i)
+            ++list_offsets_[assignment[i] + 1];
+        std::partial_sum(list_offsets_.begin(), list_offsets_.end(), list_offsets_.begin());
+
+        std::vector<uint32_t> cursor(list_offsets_.begin(), list_offsets_.end() - 1);
+        ids_.resize(num_points);
+        vectors_.resize(num_points * dim_);
+        for (size_t i = 0; i < num_points; ++i)
+        {
+            const uint32_t pos = cursor[assignment[i]]++;
+            ids_[pos] = i;
+            std::copy_n(data + i * dim_, dim_, vectors_.data() + size_t(pos) * dim_);
+        }
+    }
+
+    void clear()
+    {
+        dim_ = 0;
+        centroids_.clear();
+        list_offsets_.clear();
+        ids_.clear();
+        vectors_.clear();
+    }
+
+    /**
+     * @brief 近似k近邻
+     *
+     * @param[in] query  dim()
+     * @param[in] k
+     * @param[in] nprobe  扫描的簇数量
+     * @param[in] max_id  只返回id < max_id的点
+     * @return std::vector<std::pair<float, uint32_t>>  <squared L2, id>，从近到远
+     */
+    std::vector<std::pair<float, uint32_t>> search(const float *query, int k, int nprobe, size_t max_id = std::numeric_limits<size_t>::max()) const
+    {
+        std::vector<std::pair<float, uint32_t>> result;
+        if (empty() || k <= 0)
+            return result;
+
+        const int num_lists = nlist();
+        nprobe = std::max(1, std::min(nprobe, num_lists));
+        std::vector<std::pair<float, int>> lists(num_lists);
+        for (int c = 0; c < num_lists; ++c)
+            lists[c] = {squaredDistance(query, centroids_.data() + size_t(c) * dim_), c};
+        std::partial_sort(lists.begin(), lists.begin() + nprobe, lists.end());
+
+        // 大顶堆保留当前最近的k个
+        result.reserve(k + 1);
+        for (int p = 0; p < nprobe; ++p)
+        {
+            const int c = lists[p].second;
+            for (uint32_t pos = list_offsets_[c]; pos < list_offsets_[c + 1]; ++pos)
+            {
+                if (ids_[pos] >= max_id)
+                    continue;
+                const float dist = squaredDistance(query, vectors_.data() + size_t(pos) * dim_);
+                if (int(result.size()) < k)
+                {
+                    result.emplace_back(dist, ids_[pos]);
+                    std::push_heap(result.begin(), result.end());
+                }
+                else if (dist < result.front().first)
+                {
+                    std::pop_heap(result.begin(), result.end());
+                    result.back() = {dist, ids_[pos]};
+                    std::push_heap(result.begin(), result.end());
+                }
+            }
+        }
+        std::sort_heap(result.begin(), result.end());
+        return result;
+    }
+
+    bool save(const std::string &file) const
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        const uint32_t header[4] = {FILE_VERSION, uint32_t(dim_), uint32_t(size()), uint32_t(nlist())};
+        out.write(MAGIC, sizeof(MAGIC));
+        out.write(reinterpret_cast<const char *>(header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(centroids_.data()), centroids_.size() * sizeof(float));
+        out.write(reinterpret_cast<const char *>(list_offsets_.data()), list_offsets_.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(ids_.data()), ids_.size() * sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(vectors_.data()), vectors_.size() * sizeof(float));
+        return out.good();
+    }
+
+    // 文件版本、维度或点数与预期不符时返回false
+    bool load(const std::string &file, size_t expected_size, int expected_dim)
+    {
+        clear();
+        std::ifstream in(file, std::ios::binary);
+        if (!in.is_open())
+            return false;
+
+        char magic[sizeof(MAGIC)];
+        uint32_t header[4];
+        in.read(magic, sizeof(magic));
+        in.read(reinterpret_cast<char *>(header), sizeof(header));
+        if (!in.good() || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || header[0] != FILE_VERSION || header[1] != uint32_t(expected_dim) ||
+            header[2] != expected_size || header[3] == 0)
+            return false;
+
+        const size_t num_points = header[2], num_lists = header[3];
+        dim_ = expected_dim;
+        centroids_.resize(num_lists * dim_);
+        list_offsets_.resize(num_lists + 1);
+        ids_.resize(num_points);
+        vectors_.resize(num_points * dim_);
+        in.read(reinterpret_cast<char *>(centroids_.data()), centroids_.size() * sizeof(float));
+        in.read(reinterpret_cast<char *>(list_offsets_.data()), list_offsets_.size() * sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(ids_.data()), ids_.size() * sizeof(uint32_t));
+        in.read(reinterpret_cast<char *>(vectors_.data()), vectors_.size() * sizeof(float));
+        if (!in.good() || list_offsets_.back() != num_points)
+        {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'S', 'C', 'I', 'V', 'F', 0, 0, 0};
+
+    inline float squaredDistance(const float *a, const float *b) const
+    {
+        float dist = 0;
+        for (int d = 0; d < dim_; ++d)
+            dist += (a[d] - b[d]) * (a[d] - b[d]);
+        return dist;
+    }
+
+    int nearestCentroid(const float *point) const
+    {
+        int best = 0;
+        float best_dist = std::numeric_limits<float>::max();
+        const int num_centroids = centroids_.size() / dim_;
+        for (int c = 0; c < num_centroids; ++c)
+        {
+            const float dist = squaredDistance(point, centroids_.data() + size_t(c) * dim_);
+            if (dist < best_dist)
+            {
+                best_dist = dist;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    int dim_ = 0;
+    std::vector<float> centroids_;       // nlist * dim
+    std::vector<uint32_t> list_offsets_; // nlist + 1, 第c个簇是[list_offsets_[c], list_offsets_[c + 1])
+    std::vector<uint32_t> ids_;          // size(), 按簇排列后每个位置对应的原始id
+    std::vector<float> vectors_;         // size() * dim, 按簇排列
+};
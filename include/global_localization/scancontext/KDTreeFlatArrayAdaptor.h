@@ -0,0 +1,160 @@
+#pragma once
+
+#include "nanoflann.hpp"
+
+#include <vector>
+
+/**
+ * nanoflann adaptor over a flat, row-major std::vector<num_t> holding DIM values per point.
+ * Only the first `num_points` points are indexed, so a prefix of the array can be searched without copying it.
+ * DIM = -1 takes the dimensionality at runtime from `dim`.
+ */
+template <typename num_t, int DIM, class Distance = nanoflann::metric_L2, typename IndexType = size_t>
+struct KDTreeFlatArrayAdaptor
+{
+	typedef KDTreeFlatArrayAdaptor<num_t, DIM, Distance, IndexType> self_t;
+	typedef typename Distance::template traits<num_t, self_t>::distance_t metric_t;
+	typedef nanoflann::KDTreeSingleIndexAdaptor<metric_t, self_t, DIM, IndexType> index_t;
+
+	index_t *index; //! The kd-tree index for the user to call its methods as usual with any other FLANN index.
+
+	KDTreeFlatArrayAdaptor(const std::vector<num_t> &data, const size_t num_points, const int leaf_max_size = 10, const int dim = DIM)
+		: m_data(data), m_num_points(num_points), m_dim(dim)
+	{
+		assert(dim > 0 && num_points != 0 && num_points * dim <= data.size());
+		index = new index_t(dim, *this /* adaptor */, nanoflann::KDTreeSingleIndexAdaptorParams(leaf_max_size));
+		index->buildIndex();
+	}
+
+	~KDTreeFlatArrayAdaptor()
+	{
+		delete index;
+	}
+
+	const std::vector<num_t> &m_data;
+	const size_t m_num_points;
+	const int m_dim;
+
+	inline void query(const num_t *query_point, const size_t num_closest, IndexType *out_indices, num_t *out_distances_sq) const
+	{
+		nanoflann::KNNResultSet<num_t, IndexType> resultSet(num_closest);
+		resultSet.init(out_indices, out_distances_sq);
+		index->findNeighbors(resultSet, query_point, nanoflann::SearchParams());
+	}
+
+	const self_t &derived() const
+	{
+		return *this;
+	}
+	self_t &derived()
+	{
+		return *this;
+	}
+
+	inline size_t kdtree_get_point_count() const
+	{
+		return m_num_points;
+	}
+
+	inline num_t kdtree_get_pt(const size_t idx, const size_t dim) const
+	{
+		return m_data[idx * m_dim + dim];
+	}
+
+	template <class BBOX>
+	bool kdtree_get_bbox(BBOX & /*bb*/) const
+	{
+		return false;
+	}
+};
+
+/**
+ * Incrementally insertable variant: points appended to the flat array are indexed by update(),
+ * using nanoflann's logarithmic forest of static trees instead of rebuilding one tree from scratch.
+ */
+template <typename num_t, int DIM, class Distance = nanoflann::metric_L2, typename IndexType = size_t>
+struct KDTreeFlatArrayDynamicAdaptor
+{
+	typedef KDTreeFlatArrayDynamicAdaptor<num_t, DIM, Distance, IndexType> self_t;
+	typedef typename Distance::template traits<num_t, self_t>::distance_t metric_t;
+	typedef nanoflann::KDTreeSingleIndexDynamicAdaptor<metric_t, self_t, DIM, IndexType> index_t;
+
+	index_t *index; //! The kd-tree index for the user to call its methods as usual with any other FLANN index.
+
+	KDTreeFlatArrayDynamicAdaptor(const std::vector<num_t> &data, const int leaf_max_size = 10, const int dim = DIM, const size_t max_point_count = 1000000000U)
+		: m_data(data), m_num_points(0), m_dim(dim)
+	{
+		assert(dim > 0);
+		index = new index_t(dim, *this /* adaptor */, nanoflann::KDTreeSingleIndexAdaptorParams(leaf_max_size), max_point_count);
+		update();
+	}
+
+	~KDTreeFlatArrayDynamicAdaptor()
+	{
+		delete index;
+	}
+
+	/// Index the points appended to the array since the last call
+	inline void update()
+	{
+		const size_t num_points = m_data.size() / m_dim;
+		if (num_points <= m_num_points)
+			return;
+		const size_t start = m_num_points;
+		m_num_points = num_points;
+		index->addPoints(start, num_points - 1);
+	}
+
+	const std::vector<num_t> &m_data;
+	size_t m_num_points;
+	const int m_dim;
+
+	const self_t &derived() const
+	{
+		return *this;
+	}
+	self_t &derived()
+	{
+		return *this;
+	}
+
+	inline size_t kdtree_get_point_count() const
+	{
+		return m_num_points;
+	}
+
+	inline num_t kdtree_get_pt(const size_t idx, const size_t dim) const
+	{
+		return m_data[idx * m_dim + dim];
+	}
+
+	template <class BBOX>
+	bool kdtree_get_bbox(BBOX & /*bb*/) const
+	{
+		return false;
+	}
+};
+
+/**
+ * KNN result set that skips every point whose index is >= max_index,
+ * so the most recent points can be excluded at query time without rebuilding the index.
+ */
+template <typename DistanceType, typename IndexType = size_t, typename CountType = size_t>
+class KNNResultSetBelowIndex : public nanoflann::KNNResultSet<DistanceType, IndexType, CountType>
+{
+public:
+	typedef nanoflann::KNNResultSet<DistanceType, IndexType, CountType> Base;
+
+	inline KNNResultSetBelowIndex(CountType capacity_, IndexType max_index_)
+		: Base(capacity_), max_index(max_index_) {}
+
+	inline bool addPoint(DistanceType dist, IndexType index)
+	{
+		if (index >= max_index)
+			return true;
+		return Base::addPoint(dist, index);
+	}
+
+private:
+	IndexType max_index;
+};
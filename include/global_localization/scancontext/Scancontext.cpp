@@ -1,6 +1,14 @@
 #include "Scancontext.h"
 #include <fstream>
 #include <iomanip>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace ScanContext
 {
@@ -36,39 +44,232 @@ namespace ScanContext
     } // xy2theta
 
     /**
-     * @brief  对矩阵进行循环右移
-     *
-     * @param[in] _mat  输入矩阵
-     * @param[in] _num_shift   循环右移的列数
-     * @return MatrixXd  移动之后最终的矩阵
+     * @brief 与几何尺寸相关的打分函数。R/S是编译期的ring/sector数量，常用尺寸特化后Eigen按定长向量展开，
+     *        取Eigen::Dynamic时为通用实现，尺寸在运行时传入。
+     *        定长展开的点积累加顺序与通用实现不同，距离在末位可能有差异(sc_distance_check按容差比较)
      */
-    MatrixXd circshift(MatrixXd &_mat, int _num_shift)
+    template <int R, int S>
+    struct SCKernelImpl
     {
-        // shift columns to right direction
-        assert(_num_shift >= 0);
+        using Matrix = Eigen::Matrix<float, R, S>;
+        using SectorVector = Eigen::Matrix<float, 1, S>;
+
+        static int fastAlign(const float *_vkey1, const float *_vkey2, int _num_ring, int _num_sector)
+        {
+            const int num_sector = S == Eigen::Dynamic ? _num_sector : S;
+            Eigen::Map<const SectorVector> vkey1(_vkey1, 1, num_sector), vkey2(_vkey2, 1, num_sector);
+
+            int argmin_vkey_shift = 0;
+            double min_veky_diff_norm = 10000000;
+            for (int shift_idx = 0; shift_idx < num_sector; shift_idx++)
+            {
+                // 右移之后：[shift, N)对应_vkey2的[0, N-shift)，[0, shift)对应_vkey2的[N-shift, N)
+                const int tail_size = num_sector - shift_idx;
+                double cur_diff_norm = std::sqrt((vkey1.tail(tail_size) - vkey2.head(tail_size)).squaredNorm() +
+                                                 (vkey1.head(shift_idx) - vkey2.tail(shift_idx)).squaredNorm()); // 算范数
+                // 查找最小的偏移量
+                if (cur_diff_norm < min_veky_diff_norm)
+                {
+                    argmin_vkey_shift = shift_idx;
+                    min_veky_diff_norm = cur_diff_norm;
+                }
+            }
+            return argmin_vkey_shift;
+        }
+
+        static double distDirect(const float *_sc1, const float *_norms1, const float *_sc2, const float *_norms2, int _num_shift, int _num_ring, int _num_sector)
+        {
+            const int num_ring = R == Eigen::Dynamic ? _num_ring : R;
+            const int num_sector = S == Eigen::Dynamic ? _num_sector : S;
+            Eigen::Map<const Matrix> sc1(_sc1, num_ring, num_sector), sc2(_sc2, num_ring, num_sector);
+
+            int num_eff_cols = 0; // i.e., to exclude all-nonzero sector
+            double sum_sector_similarity = 0;
+            // 遍历两个SC矩阵的所有列，col_idx2是_sc2右移之后对应的列
+            int col_idx2 = (num_sector - _num_shift) % num_sector;
+            for (int col_idx = 0; col_idx < num_sector; col_idx++, col_idx2++)
+            {
+                if (col_idx2 == num_sector)
+                    col_idx2 = 0;
+
+                const float norm_sc1 = _norms1[col_idx];
+                const float norm_sc2 = _norms2[col_idx2];
+
+                // 如果其中有一列一个点云都没有，那么直接不比较
+                if (norm_sc1 == 0 || norm_sc2 == 0)
+                    continue; // don't count this sector pair.
+
+                // 求两个列向量之间的 cos(\theta)
+                double sector_similarity = sc1.col(col_idx).dot(sc2.col(col_idx2)) / (norm_sc1 * norm_sc2);
+
+                sum_sector_similarity = sum_sector_similarity + sector_similarity;
+                num_eff_cols = num_eff_cols + 1;
+            }
+
+            // 越相似，cos越大，得分越大
+            double sc_sim = sum_sector_similarity / num_eff_cols;
+            return 1.0 - sc_sim; // 然后1-cos，变成如果越相似，则值越小
+        }
 
-        if (_num_shift == 0)
+        // sector-key对齐后，在对齐偏移左右各_search_radius列内找SC距离最小的偏移，距离相同时取较小的偏移
+        static std::pair<double, int> distance(const float *_sc1, const float *_vkey1, const float *_norms1,
+                                               const float *_sc2, const float *_vkey2, const float *_norms2, int _search_radius, int _num_ring, int _num_sector)
         {
-            MatrixXd shifted_mat(_mat);
-            return shifted_mat; // Early return
+            const int num_sector = S == Eigen::Dynamic ? _num_sector : S;
+            const int argmin_vkey_shift = fastAlign(_vkey1, _vkey2, _num_ring, _num_sector);
+
+            int argmin_shift = 0;
+            double min_sc_dist = 10000000;
+            for (int ii = -_search_radius; ii <= _search_radius; ii++)
+            {
+                const int num_shift = (argmin_vkey_shift + ii + num_sector) % num_sector;
+                double cur_sc_dist = distDirect(_sc1, _norms1, _sc2, _norms2, num_shift, _num_ring, _num_sector);
+                if (cur_sc_dist < min_sc_dist || (cur_sc_dist == min_sc_dist && num_shift < argmin_shift))
+                {
+                    argmin_shift = num_shift;
+                    min_sc_dist = cur_sc_dist;
+                }
+            }
+            return std::make_pair(min_sc_dist, argmin_shift);
         }
 
-        MatrixXd shifted_mat = MatrixXd::Zero(_mat.rows(), _mat.cols());
-        for (int col_idx = 0; col_idx < _mat.cols(); col_idx++)
+        static int fastAlignQuantized(const uint16_t *_sums1, const uint16_t *_sums2, int _num_sector)
         {
-            int new_location = (col_idx + _num_shift) % _mat.cols();
-            shifted_mat.col(new_location) = _mat.col(col_idx);
+            const int num_sector = S == Eigen::Dynamic ? _num_sector : S;
+            int argmax_shift = 0;
+            uint32_t max_correlation = 0;
+            for (int shift_idx = 0; shift_idx < num_sector; shift_idx++)
+            {
+                const int tail_size = num_sector - shift_idx;
+                uint32_t correlation = 0;
+                for (int j = 0; j < tail_size; ++j)
+                    correlation += uint32_t(_sums1[shift_idx + j]) * _sums2[j];
+                for (int j = 0; j < shift_idx; ++j)
+                    correlation += uint32_t(_sums1[j]) * _sums2[tail_size + j];
+
+                if (correlation > max_correlation)
+                {
+                    argmax_shift = shift_idx;
+                    max_correlation = correlation;
+                }
+            }
+            return argmax_shift;
         }
 
-        return shifted_mat;
+        static double distDirectQuantized(const uint8_t *_codes1, const float *_inv_norms1, const uint8_t *_codes2, const float *_inv_norms2,
+                                          int _num_shift, int _num_ring, int _num_sector)
+        {
+            const int num_ring = R == Eigen::Dynamic ? _num_ring : R;
+            const int num_sector = S == Eigen::Dynamic ? _num_sector : S;
+            const int tail_size = num_sector - _num_shift;
 
-    } // circshift
+            Eigen::Matrix<uint32_t, S, 1> dots = Eigen::Matrix<uint32_t, S, 1>::Zero(num_sector);
+            for (int ring = 0; ring < num_ring; ++ring)
+            {
+                const uint8_t *row1 = _codes1 + ring * num_sector;
+                const uint8_t *row2 = _codes2 + ring * num_sector;
+                for (int j = 0; j < tail_size; ++j)
+                    dots[_num_shift + j] += uint16_t(row1[_num_shift + j] * row2[j]);
+                for (int j = 0; j < _num_shift; ++j)
+                    dots[j] += uint16_t(row1[j] * row2[tail_size + j]);
+            }
 
-    std::vector<float> eig2stdvec(MatrixXd _eigmat)
+            // 空列的模长倒数是0，乘积为0即不参与统计
+            float sum_sector_similarity = 0;
+            int num_eff_cols = 0;
+            for (int j = 0; j < tail_size; ++j)
+            {
+                const float weight = _inv_norms1[_num_shift + j] * _inv_norms2[j];
+                sum_sector_similarity += dots[_num_shift + j] * weight;
+                num_eff_cols += weight > 0;
+            }
+            for (int j = 0; j < _num_shift; ++j)
+            {
+                const float weight = _inv_norms1[j] * _inv_norms2[tail_size + j];
+                sum_sector_similarity += dots[j] * weight;
+                num_eff_cols += weight > 0;
+            }
+
+            return 1.0 - double(sum_sector_similarity) / num_eff_cols;
+        }
+    };
+
+    struct SCKernels
+    {
+        int num_ring;   // Eigen::Dynamic: generic
+        int num_sector;
+        decltype(&SCKernelImpl<Eigen::Dynamic, Eigen::Dynamic>::fastAlign) fast_align;
+        decltype(&SCKernelImpl<Eigen::Dynamic, Eigen::Dynamic>::distDirect) dist_direct;
+        decltype(&SCKernelImpl<Eigen::Dynamic, Eigen::Dynamic>::distance) distance;
+        decltype(&SCKernelImpl<Eigen::Dynamic, Eigen::Dynamic>::fastAlignQuantized) fast_align_quantized;
+        decltype(&SCKernelImpl<Eigen::Dynamic, Eigen::Dynamic>::distDirectQuantized) dist_direct_quantized;
+    };
+
+    template <int R, int S>
+    static constexpr SCKernels makeKernels()
+    {
+        return SCKernels{R, S, &SCKernelImpl<R, S>::fastAlign, &SCKernelImpl<R, S>::distDirect, &SCKernelImpl<R, S>::distance,
+                         &SCKernelImpl<R, S>::fastAlignQuantized, &SCKernelImpl<R, S>::distDirectQuantized};
+    }
+
+    // 特化的常用尺寸：论文默认的20x60，室内/小型雷达常用的更细sector划分；最后一项是通用实现
+    static const SCKernels SC_KERNELS[] = {
+        makeKernels<20, 60>(),
+        makeKernels<20, 120>(),
+        makeKernels<40, 60>(),
+        makeKernels<40, 120>(),
+        makeKernels<Eigen::Dynamic, Eigen::Dynamic>(),
+    };
+
+    static const SCKernels *selectKernels(int num_ring, int num_sector)
     {
-        std::vector<float> vec(_eigmat.data(), _eigmat.data() + _eigmat.size());
-        return vec;
-    } // eig2stdvec
+        for (const auto &kernels : SC_KERNELS)
+            if (kernels.num_ring == num_ring && kernels.num_sector == num_sector)
+                return &kernels;
+        return &SC_KERNELS[sizeof(SC_KERNELS) / sizeof(SC_KERNELS[0]) - 1];
+    }
+
+    bool SCManager::setGeometry(int _num_ring, int _num_sector, double _max_radius)
+    {
+        // ring/sector查表用uint16，量化描述子的列和也是uint16(255 * 257 < 65536)
+        if (_num_ring < 1 || _num_ring > 257 || _num_sector < 3 || _num_sector > 65535 || !(_max_radius > 0))
+        {
+            cout << "[SC] invalid geometry: " << _num_ring << " rings, " << _num_sector << " sectors, max radius " << _max_radius << "." << endl;
+            return false;
+        }
+
+        PC_NUM_RING = _num_ring;
+        PC_NUM_SECTOR = _num_sector;
+        PC_MAX_RADIUS = _max_radius;
+        PC_UNIT_SECTORANGLE = 360.0 / double(PC_NUM_SECTOR);
+        PC_UNIT_RINGGAP = PC_MAX_RADIUS / double(PC_NUM_RING);
+        bin_lookup_ = SCBinLookup(PC_NUM_RING, PC_NUM_SECTOR, float(PC_MAX_RADIUS));
+        kernels_ = selectKernels(PC_NUM_RING, PC_NUM_SECTOR);
+
+        embedding_cos_basis_.resize(PC_NUM_SECTOR, SC_EMBEDDING_HARMONICS);
+        embedding_sin_basis_.resize(PC_NUM_SECTOR, SC_EMBEDDING_HARMONICS);
+        for (int j = 0; j < PC_NUM_SECTOR; ++j)
+            for (int k = 0; k < SC_EMBEDDING_HARMONICS; ++k)
+            {
+                embedding_cos_basis_(j, k) = std::cos(2.0 * M_PI * j * k / PC_NUM_SECTOR);
+                embedding_sin_basis_(j, k) = std::sin(2.0 * M_PI * j * k / PC_NUM_SECTOR);
+            }
+
+        // 旧尺寸的描述子和索引都不能再用
+        polarcontexts_timestamp_.clear();
+        polarcontexts_.setGeometry(PC_NUM_RING, PC_NUM_SECTOR);
+        polarcontext_tree_.reset();
+        quantized_contexts_.setGeometry(PC_NUM_RING, PC_NUM_SECTOR);
+        embedding_index_.clear();
+        keyframe_positions_.clear();
+        position_tree_.reset();
+        return true;
+    }
+
+    bool SCManager::hasSpecializedKernels(void) const
+    {
+        return kernels_->num_ring != Eigen::Dynamic;
+    }
 
     /**
      * @brief 输入两个_sc矩阵，计算他们之间的SC距离
@@ -77,65 +278,53 @@ namespace ScanContext
      * @param[in] _sc2
      * @return double
      */
-    double SCManager::distDirectSC(MatrixXd &_sc1, MatrixXd &_sc2)
+    double SCManager::distDirectSC(const SCDescriptorRef &_sc1, const SCDescriptorRef &_sc2)
     {
-        int num_eff_cols = 0; // i.e., to exclude all-nonzero sector
-        double sum_sector_similarity = 0;
-        // 遍历两个SC矩阵的所有列
-        for (int col_idx = 0; col_idx < _sc1.cols(); col_idx++)
-        {
-            VectorXd col_sc1 = _sc1.col(col_idx);
-            VectorXd col_sc2 = _sc2.col(col_idx);
-
-            // 如果其中有一列一个点云都没有，那么直接不比较
-            if (col_sc1.norm() == 0 | col_sc2.norm() == 0)
-                continue; // don't count this sector pair.
-
-            // 求两个列向量之间的 cos(\theta)
-            double sector_similarity = col_sc1.dot(col_sc2) / (col_sc1.norm() * col_sc2.norm());
-
-            sum_sector_similarity = sum_sector_similarity + sector_similarity;
-            num_eff_cols = num_eff_cols + 1;
-        }
-
-        // 越相似，cos越大，得分越大
-        double sc_sim = sum_sector_similarity / num_eff_cols;
-        return 1.0 - sc_sim; // 然后1-cos，变成如果越相似，则值越小
+        SCColumnNorms norms_sc1 = _sc1.colwise().norm();
+        SCColumnNorms norms_sc2 = _sc2.colwise().norm();
+        return distDirectSC(_sc1, norms_sc1, _sc2, norms_sc2, 0);
+    } // distDirectSC
 
+    /**
+     * @brief 计算_sc1和循环右移_num_shift列之后的_sc2之间的SC距离。
+     *        不生成移位后的矩阵，右移后的第col列就是原_sc2的第(col - _num_shift)列，直接用下标访问；
+     *        列向量的模长由调用者预先算好，每列只剩一次长度为ring数的点积（常用尺寸下为Eigen定长向量化）
+     *
+     * @param[in] _sc1
+     * @param[in] _norms1  _sc1每列的模长
+     * @param[in] _sc2
+     * @param[in] _norms2  _sc2每列的模长（未移位）
+     * @param[in] _num_shift  _sc2循环右移的列数
+     * @return double
+     */
+    double SCManager::distDirectSC(const SCDescriptorRef &_sc1, const SCSectorRef &_norms1, const SCDescriptorRef &_sc2, const SCSectorRef &_norms2, int _num_shift)
+    {
+        assert(_sc1.outerStride() == PC_NUM_RING && _sc2.outerStride() == PC_NUM_RING);
+        return kernels_->dist_direct(_sc1.data(), _norms1.data(), _sc2.data(), _norms2.data(), _num_shift, PC_NUM_RING, PC_NUM_SECTOR);
     } // distDirectSC
 
     /**
-     * @brief 输入两个sector key，寻找让他们两个最匹配的水平偏移
+     * @brief 输入两个sector key，寻找让他们两个最匹配的水平偏移。
+     *        _vkey2右移shift之后与_vkey1的差，拆成首尾两段连续区间计算，不生成移位后的向量
      *
      * @param[in] _vkey1
      * @param[in] _vkey2
      * @return int  _vkey2右移几个sector，结果和_vkey1最匹配
      */
-    int SCManager::fastAlignUsingVkey(MatrixXd &_vkey1, MatrixXd &_vkey2)
+    int SCManager::fastAlignUsingVkey(const SCSectorRef &_vkey1, const SCSectorRef &_vkey2)
     {
-        int argmin_vkey_shift = 0;
-        double min_veky_diff_norm = 10000000;
-        for (int shift_idx = 0; shift_idx < _vkey1.cols(); shift_idx++)
-        {
-            // 矩阵的列，循环右移shift个单位
-            MatrixXd vkey2_shifted = circshift(_vkey2, shift_idx);
-
-            // 直接相减，sector key是1xN的矩阵，即一个行向量
-            MatrixXd vkey_diff = _vkey1 - vkey2_shifted;
-
-            double cur_diff_norm = vkey_diff.norm(); // 算范数
-            // 查找最小的偏移量
-            if (cur_diff_norm < min_veky_diff_norm)
-            {
-                argmin_vkey_shift = shift_idx;
-                min_veky_diff_norm = cur_diff_norm;
-            }
-        }
-
-        return argmin_vkey_shift;
-
+        return kernels_->fast_align(_vkey1.data(), _vkey2.data(), PC_NUM_RING, PC_NUM_SECTOR);
     } // fastAlignUsingVkey
 
+    /**
+     * @brief 以sector-key对齐的偏移量为中心，左右各扩展的列数，作为精确打分的搜索空间
+     */
+    int SCManager::searchRadius(void) const
+    {
+        // 注意这个SEARCH_RADIUS是区间的一半，即左右偏移。这里是0.5* 10% * 60 = 3，也就是左右扩展3列
+        return std::min<int>(round(0.5 * SEARCH_RATIO * PC_NUM_SECTOR), (PC_NUM_SECTOR - 1) / 2); // a half of search range
+    } // searchRadius
+
     /**
      * @brief 输入两个Scan-Context矩阵，计算它们之间的相似度得分
      *
@@ -143,133 +332,57 @@ namespace ScanContext
      * @param[in] _sc2
      * @return std::pair<double, int>  <最小的SC距离，此时_sc2应该右移几列>
      */
-    std::pair<double, int> SCManager::distanceBtnScanContext(MatrixXd &_sc1, MatrixXd &_sc2)
+    std::pair<double, int> SCManager::distanceBtnScanContext(const SCDescriptorRef &_sc1, const SCDescriptorRef &_sc2)
+    {
+        // 计算sector Key,也就是sector最大高度均值组成的数组，1xN
+        SCSectorKey vkey_sc1 = makeSectorkeyFromScancontext(_sc1);
+        SCSectorKey vkey_sc2 = makeSectorkeyFromScancontext(_sc2);
+        SCColumnNorms norms_sc1 = _sc1.colwise().norm();
+        SCColumnNorms norms_sc2 = _sc2.colwise().norm();
+        return distanceBtnScanContext(_sc1, vkey_sc1, norms_sc1, _sc2, vkey_sc2, norms_sc2);
+    } // distanceBtnScanContext
+
+    /**
+     * @brief 同上，sector-key和列模长已经预先算好（数据库中的描述子都有），整个过程没有堆内存分配
+     */
+    std::pair<double, int> SCManager::distanceBtnScanContext(const SCDescriptorRef &_sc1, const SCSectorRef &_vkey1, const SCSectorRef &_norms1,
+                                                             const SCDescriptorRef &_sc2, const SCSectorRef &_vkey2, const SCSectorRef &_norms2)
     {
         // Step 1. 使用sector-key快速对齐，把矩阵的列进行移动
         // 1. fast align using variant key (not in original IROS18)
-        // 计算sector Key,也就是sector最大高度均值组成的数组，1xN
-        MatrixXd vkey_sc1 = makeSectorkeyFromScancontext(_sc1);
-        MatrixXd vkey_sc2 = makeSectorkeyFromScancontext(_sc2);
         // 这里将_vkey2循环右移，然后跟_vkey1作比较，找到一个最相似（二者做差最小）的时候，记下循环右移的量
-        int argmin_vkey_shift = fastAlignUsingVkey(vkey_sc1, vkey_sc2);
-
-        // 上面用sector key匹配，找到一个初始的偏移量，但肯定不是准确的，再在这个偏移量左右扩展一下搜索空间
-        // 注意这个SEARCH_RADIUS是区间的一半，即左右偏移。这里是0.5* 10% * 60 = 3，也就是左右扩展3列
-        const int SEARCH_RADIUS = round(0.5 * SEARCH_RATIO * _sc1.cols()); // a half of search range
-        std::vector<int> shift_idx_search_space{argmin_vkey_shift};
-        for (int ii = 1; ii < SEARCH_RADIUS + 1; ii++)
-        {
-            //! 疑问：这里感觉+ii的时候不用再加_sc1.cols()？
-            shift_idx_search_space.push_back((argmin_vkey_shift + ii + _sc1.cols()) % _sc1.cols());
-            shift_idx_search_space.push_back((argmin_vkey_shift - ii + _sc1.cols()) % _sc1.cols());
-        }
-        std::sort(shift_idx_search_space.begin(), shift_idx_search_space.end());
-
-        // Step 2. 对_sc2循环右移，计算最相近的scan context
+        // Step 2. 上面用sector key匹配，找到一个初始的偏移量，但肯定不是准确的，再在这个偏移量左右扩展一下搜索空间，
+        // 对_sc2循环右移，计算最相近的scan context
         // 2. fast columnwise diff
-        int argmin_shift = 0;
-        double min_sc_dist = 10000000;
-        for (int num_shift : shift_idx_search_space)
-        {
-            // sc2循环右移几位，注意这里是对矩阵进行右移，而不是移动sector-key
-            MatrixXd sc2_shifted = circshift(_sc2, num_shift);
-            // 计算两个SC之间的距离
-            double cur_sc_dist = distDirectSC(_sc1, sc2_shifted);
-            if (cur_sc_dist < min_sc_dist)
-            {
-                argmin_shift = num_shift;
-                min_sc_dist = cur_sc_dist;
-            }
-        }
-
-        return make_pair(min_sc_dist, argmin_shift);
-
+        assert(_sc1.outerStride() == PC_NUM_RING && _sc2.outerStride() == PC_NUM_RING);
+        return kernels_->distance(_sc1.data(), _vkey1.data(), _norms1.data(), _sc2.data(), _vkey2.data(), _norms2.data(), searchRadius(), PC_NUM_RING, PC_NUM_SECTOR);
     } // distanceBtnScanContext
 
     /**
-     * @brief 输入一帧点云，生成Scan-Context
+     * @brief 数据库中两个关键帧之间的SC距离，直接使用数据库中的sector-key和列模长
      *
-     * @param[in] _scan_down, SCPointType类型，是pcl::PointXYZI
-     * @return MatrixXd, 生成的Scan-Context矩阵
+     * @return std::pair<double, int>  <最小的SC距离，此时_idx2应该右移几列>
      */
-    MatrixXd SCManager::makeScancontext(pcl::PointCloud<SCPointType> &_scan_down)
+    std::pair<double, int> SCManager::distanceBtnKeyframes(size_t _idx1, size_t _idx2)
     {
-        // TicToc t_making_desc;
-
-        // 这帧点云的点的数量
-        int num_pts_scan_down = _scan_down.points.size();
-
-        // Step 1. 创建bin的矩阵，并把每个bin内点云最大高度初始化为-1000
-        // main
-        const int NO_POINT = -1000; // 标记格子中是否有点，如果没有点高度设置成-1000, 是一个肯定没有的值
-        // ring行、sector列的矩阵，和论文中一致
-        MatrixXd desc = NO_POINT * MatrixXd::Ones(PC_NUM_RING, PC_NUM_SECTOR);
-
-        SCPointType pt;
-        float azim_angle, azim_range; // wihtin 2d plane
-        int ring_idx, sctor_idx;
-        // Step 2. 遍历每个点，往bin中赋值点云最大高度
-        for (int pt_idx = 0; pt_idx < num_pts_scan_down; pt_idx++)
-        {
-            pt.x = _scan_down.points[pt_idx].x;
-            pt.y = _scan_down.points[pt_idx].y;
-            //! 疑问：这里把所有的高度+2，让高度>0，为什么要这么做？
-            // 解答：目前感觉就是对于地面机器人这种场景，安装高度不变，然后把安装高度加上去之后，
-            //      让安装高度之下的点云的高度从负数也都变成正数
-            pt.z = _scan_down.points[pt_idx].z + LIDAR_HEIGHT; // naive adding is ok (all points should be > 0).
-
-            // xyz to ring, sector
-            azim_range = sqrt(pt.x * pt.x + pt.y * pt.y); // 距离
-            azim_angle = xy2theta(pt.x, pt.y);            // 角度
-
-            // if range is out of roi, pass
-            // 距离超过80米的点不考虑
-            if (azim_range > PC_MAX_RADIUS)
-                continue;
-
-            // 计算这个点落到那个bin中，下标从1开始数。注意下面先min再max，其实就是把结果限制到1~PC_NUM之间
-            ring_idx = std::max(std::min(PC_NUM_RING, int(ceil((azim_range / PC_MAX_RADIUS) * PC_NUM_RING))), 1);
-            sctor_idx = std::max(std::min(PC_NUM_SECTOR, int(ceil((azim_angle / 360.0) * PC_NUM_SECTOR))), 1);
-
-            // taking maximum z
-            // 用z值，也就是高度来更新这个格子，存最大的高度。
-            // 注意之这里为什么-1，以为数组的索引从0开始，上面的索引是[1, PC_NUM]，而在编程中数组的索引应该是[0, PC_NUM-1]
-            if (desc(ring_idx - 1, sctor_idx - 1) < pt.z) // -1 means cpp starts from 0
-                desc(ring_idx - 1, sctor_idx - 1) = pt.z; // update for taking maximum value at that bin
-        }
-
-        // Step 3. 把bin中没有点的那些，高度设置成0
-        // reset no points to zero (for cosine dist later)
-        for (int row_idx = 0; row_idx < desc.rows(); row_idx++)
-            for (int col_idx = 0; col_idx < desc.cols(); col_idx++)
-                if (desc(row_idx, col_idx) == NO_POINT)
-                    desc(row_idx, col_idx) = 0;
-
-        // t_making_desc.toc("PolarContext making");
-
-        return desc;
-    } // SCManager::makeScancontext
+        return distanceBtnScanContext(polarcontexts_.descriptor(_idx1), polarcontexts_.sectorKey(_idx1), polarcontexts_.columnNorms(_idx1),
+                                      polarcontexts_.descriptor(_idx2), polarcontexts_.sectorKey(_idx2), polarcontexts_.columnNorms(_idx2));
+    } // distanceBtnKeyframes
 
     /**
      * @brief 输入构造的SC矩阵，计算ring-key。其实就是对于矩阵的每一行（对应每一个环），
      *        计算这一行的平均值（即计算一个环中点云最大高度的平均值）
      *
      * @param[in] _desc
-     * @return MatrixXd， ring行的向量，每个值都是每个环的平均值
+     * @return SCRingKey， ring行的向量，每个值都是每个环的平均值
      */
-    MatrixXd SCManager::makeRingkeyFromScancontext(Eigen::MatrixXd &_desc)
+    SCRingKey SCManager::makeRingkeyFromScancontext(const SCDescriptorRef &_desc)
     {
         /*
          * summary: rowwise mean vector
          */
-        Eigen::MatrixXd invariant_key(_desc.rows(), 1);
-        for (int row_idx = 0; row_idx < _desc.rows(); row_idx++)
-        {
-            Eigen::MatrixXd curr_row = _desc.row(row_idx);
-            // 计算平均值。注意这个命名很有意思，说ring-key是不变的key，这是由于ring具有旋转不变性
-            invariant_key(row_idx, 0) = curr_row.mean();
-        }
-
+        // 计算平均值。注意这个命名很有意思，说ring-key是不变的key，这是由于ring具有旋转不变性
+        SCRingKey invariant_key = _desc.rowwise().mean();
         return invariant_key;
     } // SCManager::makeRingkeyFromScancontext
 
@@ -278,148 +391,303 @@ namespace ScanContext
      *        计算这一列的平均值（即计算一个扇区中点云最大高度的平均值）
      *
      * @param[in] _desc
-     * @return MatrixXd
+     * @return SCSectorKey
      */
-    MatrixXd SCManager::makeSectorkeyFromScancontext(Eigen::MatrixXd &_desc)
+    SCSectorKey SCManager::makeSectorkeyFromScancontext(const SCDescriptorRef &_desc)
     {
         /*
          * summary: columnwise mean vector
          */
-        Eigen::MatrixXd variant_key(1, _desc.cols());
-        for (int col_idx = 0; col_idx < _desc.cols(); col_idx++)
-        {
-            Eigen::MatrixXd curr_col = _desc.col(col_idx);
-            // 计算平均值，这里说sector是变化的key，以为旋转一下之后，variant_key中相当于不同位置之间进行了交换
-            variant_key(0, col_idx) = curr_col.mean();
-        }
-
+        // 计算平均值，这里说sector是变化的key，以为旋转一下之后，variant_key中相当于不同位置之间进行了交换
+        SCSectorKey variant_key = _desc.colwise().mean();
         return variant_key;
     } // SCManager::makeSectorkeyFromScancontext
 
     /**
-     * @brief 输入一帧点云，生成ScanContext，并计算ring-key和sector-key，然后存到数据库中
+     * @brief 旋转不变的嵌入向量：每个ring沿sector方向做DFT，取前SC_EMBEDDING_HARMONICS阶的幅值。
+     *        yaw变化只是sector的循环移位，只改变DFT的相位，幅值不变；第0阶就是ring-key * PC_NUM_SECTOR，
+     *        更高阶保留了ring内的角度结构。整体做L2归一化，对高度的整体缩放不敏感
      *
-     * @param[in] _scan_down
+     * @param[in] _desc
+     * @return SCEmbedding
      */
-    void SCManager::makeAndSaveScancontextAndKeys(pcl::PointCloud<SCPointType> &_scan_down)
+    SCEmbedding SCManager::makeEmbeddingFromScancontext(const SCDescriptorRef &_desc)
     {
-        // Step 1. 对输入点云计算Scan-Context矩阵
-        Eigen::MatrixXd sc = makeScancontext(_scan_down); // v1
+        Eigen::MatrixXf real = _desc * embedding_cos_basis_;
+        Eigen::MatrixXf imag = _desc * embedding_sin_basis_;
+        Eigen::MatrixXf magnitude = (real.array().square() + imag.array().square()).sqrt();
 
-        // Step 2. 使用计算的Scan-Context矩阵，计算ring-key和sector-key
-        Eigen::MatrixXd ringkey = makeRingkeyFromScancontext(sc);     // ring-key旋转不变
-        Eigen::MatrixXd sectorkey = makeSectorkeyFromScancontext(sc); // sector-key旋转变化
-        // 把ring-key的Eigen向量，转成std::vector的数据格式
-        // 最终就是使用ring-key在历史帧中查询相同的ring-key来得到候选匹配，然后计算Scan-Context距离
-        std::vector<float> polarcontext_invkey_vec = eig2stdvec(ringkey);
+        SCEmbedding embedding = Eigen::Map<const SCEmbedding>(magnitude.data(), magnitude.size());
+        const float norm = embedding.norm();
+        if (norm > 0)
+            embedding /= norm;
+        return embedding;
+    } // SCManager::makeEmbeddingFromScancontext
 
-        // Step 3. 把这帧的数据存到类成员变量中，即存到数据库中
-        polarcontexts_.push_back(sc);
-        polarcontext_invkeys_.push_back(ringkey);
-        polarcontext_vkeys_.push_back(sectorkey);
-        polarcontext_invkeys_mat_.push_back(polarcontext_invkey_vec);
+    /**
+     * @brief 量化描述子的sector对齐：|v1 - shift(v2)|^2 = |v1|^2 + |v2|^2 - 2 * v1·shift(v2)，前两项与偏移无关，
+     *        所以最小化差的范数就是最大化循环互相关，两帧的scale只是正的整体缩放，可以直接用整数的列和计算
+     *
+     * @return int  _sums2右移几个sector，结果和_sums1最匹配
+     */
+    int SCManager::fastAlignQuantized(const uint16_t *_sums1, const uint16_t *_sums2)
+    {
+        return kernels_->fast_align_quantized(_sums1, _sums2, PC_NUM_SECTOR);
+    } // fastAlignQuantized
 
-        // cout <<polarcontext_vkeys_.size() << endl;
+    /**
+     * @brief 量化描述子的列余弦距离，与distDirectSC的定义相同
+     *        codes是ring-major的，右移后第j列对应_db2的第(j - _num_shift)列，拆成首尾两段连续区间，
+     *        每个ring累加一行uint8乘积到uint32的列点积中；255 * 255 < 65536，乘积按uint16计算不会溢出，编译器可以用16位整数乘法向量化
+     *
+     * @return double
+     */
+    double SCManager::distDirectQuantizedSC(const QSCDatabase &_db1, size_t _idx1, const QSCDatabase &_db2, size_t _idx2, int _num_shift)
+    {
+        return kernels_->dist_direct_quantized(_db1.codes(_idx1), _db1.invColumnNorms(_idx1), _db2.codes(_idx2), _db2.invColumnNorms(_idx2),
+                                               _num_shift, PC_NUM_RING, PC_NUM_SECTOR);
+    } // distDirectQuantizedSC
 
-    } // SCManager::makeAndSaveScancontextAndKeys
+    /**
+     * @brief 量化描述子之间的粗略SC距离，只用于候选粗排
+     *        只计算sector-key对齐的那一个偏移，不在左右SEARCH_RADIUS内搜索，打分量约为精确距离的1/7；
+     *        粗排保留的前若干个候选会再用float描述子按distanceBtnScanContext精确打分
+     *
+     * @return std::pair<double, int>  <对齐偏移处的SC距离，此时_idx2应该右移几列>
+     */
+    std::pair<double, int> SCManager::distanceBtnQuantizedScanContext(const QSCDatabase &_db1, size_t _idx1, const QSCDatabase &_db2, size_t _idx2)
+    {
+        int argmax_shift = fastAlignQuantized(_db1.sectorSums(_idx1), _db2.sectorSums(_idx2));
+        return make_pair(distDirectQuantizedSC(_db1, _idx1, _db2, _idx2, argmax_shift), argmax_shift);
+    } // distanceBtnQuantizedScanContext
 
-    std::pair<int, float> SCManager::detectClosestKeyframeID(int num_exclude_recent, const std::vector<float> &curr_key, Eigen::MatrixXd &curr_desc)
+    /**
+     * @brief 在数据库中检索与当前描述子最相似的前top_k个关键帧
+     *
+     * @param[in] num_exclude_recent  数据库中最近的若干帧不参与检索
+     * @param[in] curr_key  当前帧的ring-key
+     * @param[in] curr_desc  当前帧的Scan-Context
+     * @param[in] top_k  最多返回的候选数量
+     * @param[in] num_tree_candidates  kdtree返回的候选数量（扇出），不足top_k时按top_k
+     * @param[in] use_ann  ANN_SEARCH_EN且索引已建立时，再合并嵌入向量索引返回的NUM_CANDIDATES_FROM_ANN个候选
+     * @return std::vector<SCCandidate>  SC距离小于SC_DIST_THRES的候选，按距离从小到大排列
+     */
+    std::vector<SCCandidate> SCManager::detectTopKCandidates(int num_exclude_recent, const SCRingKey &curr_key, const SCDescriptorRef &curr_desc,
+                                                             int top_k, int num_tree_candidates, bool use_ann, const SCSpatialPrior *prior)
     {
-        int loop_id{-1}; // init with -1, -1 means no loop (== LeGO-LOAM's variable "closestHistoryFrameID")
+        std::vector<SCCandidate> candidates;
 
         /*
          * step 1: candidates from ringkey tree_
          */
         // Step 1. 数据库中关键帧数量太少，则不检测回环？
-        if (polarcontext_invkeys_mat_.size() < num_exclude_recent + 1)
+        if (polarcontexts_.size() < num_exclude_recent + 1 || top_k <= 0)
+            return candidates; // Early return
+
+        // 最近的num_exclude_recent帧很难构成回环，查询时直接跳过这些索引
+        const size_t max_index = polarcontexts_.size() - num_exclude_recent;
+        num_tree_candidates = std::max(num_tree_candidates, top_k);
+
+        // 没有登记任何关键帧位置时，位置先验不起作用，退化为全局检索
+        if (prior && keyframe_positions_.empty())
+            prior = nullptr;
+
+        if (prior)
         {
-            std::pair<int, float> result{loop_id, 0.0};
-            return result; // Early return
+            // Step 2'. 有位置先验时，先用位置索引取出区域内的关键帧，区域内的关键帧一般只有几百个，
+            // 直接按ring-key距离取最近的num_tree_candidates个，相当于只在区域内查询kdtree
+            std::vector<size_t> region = keyframesInRegion(*prior, max_index);
+            std::vector<std::pair<float, size_t>> key_dists(region.size());
+            for (size_t i = 0; i < region.size(); ++i)
+                key_dists[i] = {(polarcontexts_.ringKey(region[i]) - curr_key).squaredNorm(), region[i]};
+
+            const size_t num_keep = std::min<size_t>(num_tree_candidates, key_dists.size());
+            std::partial_sort(key_dists.begin(), key_dists.begin() + num_keep, key_dists.end());
+            candidates.resize(num_keep);
+            for (size_t candidate_iter_idx = 0; candidate_iter_idx < num_keep; candidate_iter_idx++)
+                candidates[candidate_iter_idx].index = key_dists[candidate_iter_idx].second;
         }
-
-        // Step 2. 经过一段时间之后，就重新构造 ring-key的kdtree
-        // tree_ reconstruction (not mandatory to make everytime)
-        if (tree_making_period_conter % TREE_MAKING_PERIOD_ == 0) // to save computation cost
+        else
         {
-            // TicToc t_tree_construction;
+            // Step 2. 把上次查询之后新加入数据库的ring-key增量插入kdtree，不再周期性地整体重建
+            if (!polarcontext_tree_)
+                polarcontext_tree_ = std::make_shared<InvKeyDynamicTree>(polarcontexts_.ringKeys(), 10 /* max leaf */, PC_NUM_RING);
+            polarcontext_tree_->update();
+
+            // Step 3. 使用kdtree进行knn的最近邻查找
+            // knn search
+            std::vector<size_t> candidate_indexes(num_tree_candidates); // 最相似候选帧的索引
+            std::vector<float> out_dists_sqr(num_tree_candidates);      // 最相似候选帧的距离
+
+            KNNResultSetBelowIndex<float> knnsearch_result(num_tree_candidates, max_index);
+            knnsearch_result.init(&candidate_indexes[0], &out_dists_sqr[0]);
+            polarcontext_tree_->index->findNeighbors(knnsearch_result, curr_key.data() /* query */, nanoflann::SearchParams(10));
+
+            candidates.resize(knnsearch_result.size());
+            for (size_t candidate_iter_idx = 0; candidate_iter_idx < candidates.size(); candidate_iter_idx++)
+                candidates[candidate_iter_idx].index = candidate_indexes[candidate_iter_idx];
+        }
 
-            polarcontext_invkeys_to_search_.clear();
-            // 最近50帧很难构成回环，因此构造kdtree的数据不包括最近的50帧
-            polarcontext_invkeys_to_search_.assign(polarcontext_invkeys_mat_.begin(), polarcontext_invkeys_mat_.end() - num_exclude_recent);
+        // ring-key只是每个ring的均值，丢掉了角度结构，重复场景中真值可能不在kdtree的候选里，
+        // 用旋转不变的嵌入向量再做一次近似最近邻，补充kdtree没有返回的候选；有位置先验时只保留区域内的
+        if (use_ann && ANN_SEARCH_EN && !embedding_index_.empty())
+        {
+            SCEmbedding curr_embedding = makeEmbeddingFromScancontext(curr_desc);
+            auto ann_result = embedding_index_.search(curr_embedding.data(), NUM_CANDIDATES_FROM_ANN, ANN_NPROBE, max_index);
+            const size_t num_tree_found = candidates.size();
+            for (const auto &neighbor : ann_result)
+            {
+                if (prior)
+                {
+                    const size_t idx = neighbor.second;
+                    if (2 * idx + 1 >= keyframe_positions_.size())
+                        continue;
+                    const float dx = keyframe_positions_[2 * idx] - prior->x, dy = keyframe_positions_[2 * idx + 1] - prior->y;
+                    if (dx * dx + dy * dy >= prior->radius * prior->radius)
+                        continue;
+                }
+                auto end = candidates.begin() + num_tree_found;
+                if (std::find_if(candidates.begin(), end, [&](const SCCandidate &c)
+                                 { return c.index == int(neighbor.second); }) == end)
+                    candidates.push_back(SCCandidate{int(neighbor.second), 0, 0});
+            }
+        }
+        const int num_found = candidates.size();
 
-            // 重新构造kdtree
-            polarcontext_tree_.reset();
-            polarcontext_tree_ = std::make_shared<InvKeyTree>(PC_NUM_RING /* dim */, polarcontext_invkeys_to_search_, 10 /* max leaf */);
-            // tree_ptr_->index->buildIndex(); // inernally called in the constructor of InvKeyTree (for detail, refer the nanoflann and KDtreeVectorOfVectorsAdaptor)
-            // t_tree_construction.toc("Tree construction");
+        // Step 4. 开启量化打分时，先用uint8描述子给所有候选粗排，只保留前若干个再用float描述子精确打分
+        const int num_rerank = std::max(top_k, QUANTIZED_RERANK_CANDIDATES);
+        if (QUANTIZED_SCORING_EN && num_found > num_rerank)
+        {
+            quantized_contexts_.reserve(polarcontexts_.size());
+            while (quantized_contexts_.size() < polarcontexts_.size())
+                quantized_contexts_.push_back(polarcontexts_.descriptor(quantized_contexts_.size()));
+
+            QSCDatabase curr_quantized(PC_NUM_RING, PC_NUM_SECTOR);
+            curr_quantized.push_back(curr_desc);
+#pragma omp parallel for schedule(dynamic, 4) if (num_found >= PARALLEL_SCORING_MIN_CANDIDATES)
+            for (int candidate_iter_idx = 0; candidate_iter_idx < num_found; candidate_iter_idx++)
+            {
+                double distance = distanceBtnQuantizedScanContext(curr_quantized, 0, quantized_contexts_, candidates[candidate_iter_idx].index).first;
+                candidates[candidate_iter_idx].distance = std::isnan(distance) ? std::numeric_limits<double>::max() : distance;
+            }
+            std::stable_sort(candidates.begin(), candidates.end(), [](const SCCandidate &a, const SCCandidate &b)
+                             { return a.distance < b.distance; });
+            candidates.resize(num_rerank);
         }
-        tree_making_period_conter = tree_making_period_conter + 1;
-
-        double min_dist = 10000000; // init with somthing large
-        int nn_align = 0;
-        int nn_idx = 0;
-
-        // Step 3. 使用kdtree进行knn的最近邻查找
-        // knn search
-        // 从kdtree中寻找10个最相似的候选帧
-        std::vector<size_t> candidate_indexes(NUM_CANDIDATES_FROM_TREE); // 10个最相似候选帧的索引
-        std::vector<float> out_dists_sqr(NUM_CANDIDATES_FROM_TREE);      // 10个最相似候选帧的距离
-
-        // TicToc t_tree_search;
-        nanoflann::KNNResultSet<float> knnsearch_result(NUM_CANDIDATES_FROM_TREE);
-        knnsearch_result.init(&candidate_indexes[0], &out_dists_sqr[0]);
-        // 调用接口查找距离最近的10个候选帧
-        polarcontext_tree_->index->findNeighbors(knnsearch_result, &curr_key[0] /* query */, nanoflann::SearchParams(10));
-        // t_tree_search.toc("Tree search");
-
-        // Step 4. 遍历最相似候选帧，计算Scan-Context距离
+
+        // Step 5. 遍历最相似候选帧，计算Scan-Context距离，候选多时并行计算
         /*
          *  step 2: pairwise distance (find optimal columnwise best-fit using cosine distance)
          */
-        // TicToc t_calc_dist;
-        for (int candidate_iter_idx = 0; candidate_iter_idx < NUM_CANDIDATES_FROM_TREE; candidate_iter_idx++)
+        // 当前帧的sector-key和列模长只算一次，候选帧的直接用数据库中预先算好的
+        SCSectorKey curr_vkey = makeSectorkeyFromScancontext(curr_desc);
+        SCColumnNorms curr_norms = curr_desc.colwise().norm();
+        const int num_scoring = candidates.size();
+#pragma omp parallel for schedule(dynamic, 4) if (num_scoring >= PARALLEL_SCORING_MIN_CANDIDATES)
+        for (int candidate_iter_idx = 0; candidate_iter_idx < num_scoring; candidate_iter_idx++)
         {
-            // 每个相似候选帧的SC矩阵
-            MatrixXd polarcontext_candidate = polarcontexts_[candidate_indexes[candidate_iter_idx]];
-            // 当前帧和SC矩阵计算相似得分，返回结果是 <最近的sc距离， _sc2右移的列数>
-            std::pair<double, int> sc_dist_result = distanceBtnScanContext(curr_desc, polarcontext_candidate);
-
-            double candidate_dist = sc_dist_result.first;
-            int candidate_align = sc_dist_result.second;
-
-            if (candidate_dist < min_dist)
-            {
-                min_dist = candidate_dist;
-                nn_align = candidate_align;
-
-                nn_idx = candidate_indexes[candidate_iter_idx]; // 找到最匹配的关键帧的索引
-            }
+            const size_t candidate_idx = candidates[candidate_iter_idx].index;
+            // 当前帧和候选帧的SC矩阵计算相似得分，返回结果是 <最近的sc距离， _sc2右移的列数>
+            std::pair<double, int> sc_dist_result = distanceBtnScanContext(curr_desc, curr_vkey, curr_norms,
+                                                                           polarcontexts_.descriptor(candidate_idx), polarcontexts_.sectorKey(candidate_idx), polarcontexts_.columnNorms(candidate_idx));
+            candidates[candidate_iter_idx].distance = sc_dist_result.first;
+            candidates[candidate_iter_idx].yaw_rad = deg2rad(sc_dist_result.second * PC_UNIT_SECTORANGLE);
         }
-        // t_calc_dist.toc("Distance calc");
 
-        // Step 5. 计算的最小距离要小于设定的阈值
+        // Step 6. 计算的距离要小于设定的阈值，按距离排序取前top_k个（距离相同时保持kdtree的顺序）
         /*
          * loop threshold check
          */
-        if (min_dist < SC_DIST_THRES)
-        {
-            loop_id = nn_idx;
+        candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [this](const SCCandidate &candidate)
+                                        { return !(candidate.distance < SC_DIST_THRES); }),
+                         candidates.end());
+        std::stable_sort(candidates.begin(), candidates.end(), [](const SCCandidate &a, const SCCandidate &b)
+                         { return a.distance < b.distance; });
+        if (candidates.size() > top_k)
+            candidates.resize(top_k);
+
+        return candidates;
+    }
 
-            // std::cout.precision(3);
-            cout << "[Loop found] Nearest distance: " << min_dist << " btn " << polarcontexts_.size() - 1 << " and " << nn_idx << "." << endl;
-            cout << "[Loop found] yaw diff: " << nn_align * PC_UNIT_SECTORANGLE << " deg." << endl;
-        }
-        else
+    /**
+     * @brief 对数据库中所有描述子计算嵌入向量并建立IVF索引，之后新加入的关键帧不在索引中（只影响ANN补充的候选）
+     *
+     * @param[in] nlist  簇的数量，<= 0时取sqrt(关键帧数量)
+     */
+    void SCManager::buildEmbeddingIndex(int nlist)
+    {
+        const size_t num = polarcontexts_.size();
+        const int dim = PC_NUM_RING * SC_EMBEDDING_HARMONICS;
+        std::vector<float> embeddings(num * dim);
+#pragma omp parallel for schedule(static)
+        for (int64_t i = 0; i < int64_t(num); ++i)
+            Eigen::Map<SCEmbedding>(embeddings.data() + i * dim, dim) = makeEmbeddingFromScancontext(polarcontexts_.descriptor(i));
+        embedding_index_.build(embeddings.data(), num, dim, nlist);
+    }
+
+    void SCManager::addKeyframePosition(float x, float y)
+    {
+        keyframe_positions_.push_back(x);
+        keyframe_positions_.push_back(y);
+    }
+
+    /**
+     * @brief 查询位于位置先验区域内的关键帧，位置kdtree在查询时增量更新
+     *
+     * @param[in] prior
+     * @param[in] max_index  只返回下标小于max_index的关键帧
+     * @return std::vector<size_t>  从小到大排列的关键帧下标
+     */
+    std::vector<size_t> SCManager::keyframesInRegion(const SCSpatialPrior &prior, size_t max_index)
+    {
+        std::vector<size_t> region;
+        if (keyframe_positions_.empty() || prior.radius <= 0)
+            return region;
+
+        if (!position_tree_)
+            position_tree_ = std::make_shared<PositionDynamicTree>(keyframe_positions_, 10 /* max leaf */);
+        position_tree_->update();
+
+        const float query[2] = {prior.x, prior.y};
+        std::vector<std::pair<size_t, float>> indices_dists;
+        nanoflann::RadiusResultSet<float, size_t> radius_result(prior.radius * prior.radius, indices_dists);
+        position_tree_->index->findNeighbors(radius_result, query, nanoflann::SearchParams());
+
+        region.reserve(indices_dists.size());
+        for (const auto &neighbor : indices_dists)
+            if (neighbor.first < max_index)
+                region.push_back(neighbor.first);
+        std::sort(region.begin(), region.end());
+        return region;
+    }
+
+    bool SCManager::saveEmbeddingIndex(const std::string &file) const
+    {
+        return !embedding_index_.empty() && embedding_index_.save(file);
+    }
+
+    bool SCManager::loadEmbeddingIndex(const std::string &file)
+    {
+        return embedding_index_.load(file, polarcontexts_.size(), PC_NUM_RING * SC_EMBEDDING_HARMONICS);
+    }
+
+    std::pair<int, float> SCManager::detectClosestKeyframeID(int num_exclude_recent, const SCRingKey &curr_key, const SCDescriptorRef &curr_desc, const SCSpatialPrior *prior)
+    {
+        int loop_id{-1}; // init with -1, -1 means no loop (== LeGO-LOAM's variable "closestHistoryFrameID")
+        float yaw_diff_rad = 0;
+
+        auto candidates = detectTopKCandidates(num_exclude_recent, curr_key, curr_desc, 1, NUM_CANDIDATES_FROM_TREE, false, prior);
+        if (!candidates.empty())
         {
+            loop_id = candidates[0].index;
+            yaw_diff_rad = candidates[0].yaw_rad;
+
             // std::cout.precision(3);
-            // cout << "[Not loop] Nearest distance: " << min_dist << " btn " << polarcontexts_.size() - 1 << " and " << nn_idx << "." << endl;
-            // cout << "[Not loop] yaw diff: " << nn_align * PC_UNIT_SECTORANGLE << " deg." << endl;
+            cout << "[Loop found] Nearest distance: " << candidates[0].distance << " btn " << polarcontexts_.size() - 1 << " and " << loop_id << "." << endl;
+            cout << "[Loop found] yaw diff: " << rad2deg(yaw_diff_rad) << " deg." << endl;
         }
 
-        // To do: return also nn_align (i.e., yaw diff)
-        float yaw_diff_rad = deg2rad(nn_align * PC_UNIT_SECTORANGLE);
         std::pair<int, float> result{loop_id, yaw_diff_rad};
-
         return result;
     }
 
@@ -430,15 +698,42 @@ namespace ScanContext
      */
     std::pair<int, float> SCManager::detectLoopClosureID(int num_exclude_recent)
     {
-        auto curr_key = polarcontext_invkeys_mat_.back(); // current observation (query)
-        auto curr_desc = polarcontexts_.back();           // current observation (query)
+        return detectLoopClosureID(num_exclude_recent, polarcontexts_.size() - 1);
+    } // SCManager::detectLoopClosureID
 
-        return detectClosestKeyframeID(num_exclude_recent, curr_key, curr_desc);
+    /**
+     * @brief 检测数据库中第query_index帧和它之前的历史帧之间的回环关系
+     *
+     * @param[in] num_exclude_recent  query_index之前最近的若干帧不参与检测
+     * @param[in] query_index
+     * @param[in] prior  可选的位置先验，只在区域内的关键帧中检测
+     * @return std::pair<int, float>
+     */
+    std::pair<int, float> SCManager::detectLoopClosureID(int num_exclude_recent, int query_index, const SCSpatialPrior *prior)
+    {
+        SCRingKey curr_key = polarcontexts_.ringKey(query_index);        // current observation (query)
+        SCDescriptor curr_desc = polarcontexts_.descriptor(query_index); // current observation (query)
+
+        // query_index之后的帧也一并排除
+        int num_exclude = polarcontexts_.size() - 1 - query_index + num_exclude_recent;
+        return detectClosestKeyframeID(num_exclude, curr_key, curr_desc, prior);
     } // SCManager::detectLoopClosureID
 
+    /**
+     * @brief 同上，返回按SC距离排序的前top_k个候选
+     */
+    std::vector<SCCandidate> SCManager::detectLoopClosureCandidates(int num_exclude_recent, int query_index, int top_k, const SCSpatialPrior *prior)
+    {
+        SCRingKey curr_key = polarcontexts_.ringKey(query_index);        // current observation (query)
+        SCDescriptor curr_desc = polarcontexts_.descriptor(query_index); // current observation (query)
+
+        int num_exclude = polarcontexts_.size() - 1 - query_index + num_exclude_recent;
+        return detectTopKCandidates(num_exclude, curr_key, curr_desc, top_k, std::max(NUM_CANDIDATES_FROM_TREE, top_k), false, prior);
+    } // SCManager::detectLoopClosureCandidates
+
     void SCManager::saveCurrentSCD(const std::string &save_path, int num_digits, const std::string &delimiter)
     {
-        const auto &curr_scd = polarcontexts_.back();
+        const auto curr_scd = polarcontexts_.descriptor(polarcontexts_.size() - 1);
         std::ostringstream out;
         out << std::internal << std::setfill('0') << std::setw(num_digits) << polarcontexts_.size() - 1;
         std::string curr_scd_node_idx = out.str();
@@ -457,14 +752,14 @@ namespace ScanContext
 
     void SCManager::loadPriorSCD(const std::string &path, int num_digits, int num_keyframe)
     {
+        polarcontexts_.reserve(polarcontexts_.size() + num_keyframe);
         for (auto i = 0; i < num_keyframe; ++i)
         {
             std::ostringstream out;
             out << std::internal << std::setfill('0') << std::setw(num_digits) << i;
             std::string curr_scd_node_idx = out.str();
             std::ifstream file(path + "/" + curr_scd_node_idx + ".scd");
-            Eigen::MatrixXd curr_scd;
-            curr_scd.resize(PC_NUM_RING, PC_NUM_SECTOR);
+            SCDescriptor curr_scd = SCDescriptor::Zero(PC_NUM_RING, PC_NUM_SECTOR);
 
             if (file.is_open())
             {
@@ -475,31 +770,153 @@ namespace ScanContext
                 file.close();
             }
 
-            Eigen::MatrixXd ringkey = makeRingkeyFromScancontext(curr_scd);
-            Eigen::MatrixXd sectorkey = makeSectorkeyFromScancontext(curr_scd);
-            std::vector<float> polarcontext_invkey_vec = eig2stdvec(ringkey);
+            polarcontexts_.push_back(curr_scd, makeRingkeyFromScancontext(curr_scd), makeSectorkeyFromScancontext(curr_scd));
+        }
+    }
+
+    /**
+     * @brief 二进制描述子数据库的文件头，记录数count在每次追加后更新，
+     * 建图中途退出时以count和文件长度中较小者为准；version 2起记录完整的几何参数(含最大半径)
+     */
+    struct SCDatabaseFileHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t num_ring;
+        uint32_t num_sector;
+        uint32_t record_size; // floats per record
+        uint64_t count;
+        float max_radius; // since version 2
+        uint32_t reserved;
+    };
+
+    static const char SCDB_MAGIC[8] = {'S', 'C', 'D', 'B', 'I', 'N', 0, 0};
+    static constexpr uint32_t SCDB_VERSION = 2;
+    static constexpr size_t SCDB_HEADER_BYTES_V1 = offsetof(SCDatabaseFileHeader, max_radius); // version 1没有max_radius，固定为SC_MAX_RADIUS
+
+    static SCDatabaseFileHeader makeDatabaseHeader(const SCDatabase &db, double max_radius, uint64_t count)
+    {
+        SCDatabaseFileHeader header;
+        std::memcpy(header.magic, SCDB_MAGIC, sizeof(SCDB_MAGIC));
+        header.version = SCDB_VERSION;
+        header.num_ring = db.numRing();
+        header.num_sector = db.numSector();
+        header.record_size = db.recordSize();
+        header.count = count;
+        header.max_radius = max_radius;
+        header.reserved = 0;
+        return header;
+    }
 
-            polarcontexts_.push_back(curr_scd);
-            polarcontext_invkeys_.push_back(ringkey);
-            polarcontext_vkeys_.push_back(sectorkey);
-            polarcontext_invkeys_mat_.push_back(polarcontext_invkey_vec);
+    static bool pwriteAll(int fd, const void *buf, size_t len, off_t offset)
+    {
+        const char *ptr = static_cast<const char *>(buf);
+        while (len > 0)
+        {
+            ssize_t n = pwrite(fd, ptr, len, offset);
+            if (n <= 0)
+                return false;
+            ptr += n;
+            len -= n;
+            offset += n;
         }
+        return true;
     }
 
-    std::pair<int, float> SCManager::relocalize(pcl::PointCloud<SCPointType> &scan_down)
+    bool SCManager::appendCurrentToDatabase(const std::string &file)
     {
         if (polarcontexts_.empty())
+            return false;
+
+        // 第一帧时截断重建，避免在旧地图的文件后面继续追加
+        const uint64_t idx = polarcontexts_.size() - 1;
+        int fd = open(file.c_str(), idx == 0 ? (O_WRONLY | O_CREAT | O_TRUNC) : (O_WRONLY | O_CREAT), 0644);
+        if (fd < 0)
+            return false;
+
+        const size_t record_bytes = polarcontexts_.recordSize() * sizeof(float);
+        std::vector<float> record(polarcontexts_.recordSize());
+        polarcontexts_.copyRecord(idx, record.data());
+        SCDatabaseFileHeader header = makeDatabaseHeader(polarcontexts_, PC_MAX_RADIUS, idx + 1);
+        bool ok = pwriteAll(fd, record.data(), record_bytes, sizeof(header) + idx * record_bytes) &&
+                  pwriteAll(fd, &header, sizeof(header), 0);
+        close(fd);
+        return ok;
+    }
+
+    bool SCManager::saveDatabase(const std::string &file)
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return false;
+
+        SCDatabaseFileHeader header = makeDatabaseHeader(polarcontexts_, PC_MAX_RADIUS, polarcontexts_.size());
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        std::vector<float> record(polarcontexts_.recordSize());
+        for (size_t i = 0; i < polarcontexts_.size(); ++i)
         {
-            std::pair<int, float> result{-1, 0.0};
-            return result;
+            polarcontexts_.copyRecord(i, record.data());
+            out.write(reinterpret_cast<const char *>(record.data()), record.size() * sizeof(float));
         }
+        return out.good();
+    }
+
+    bool SCManager::loadDatabase(const std::string &file, int num_keyframe)
+    {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
 
-        Eigen::MatrixXd sc = makeScancontext(scan_down);
-        Eigen::MatrixXd ringkey = makeRingkeyFromScancontext(sc);
-        // Eigen::MatrixXd sectorkey = makeSectorkeyFromScancontext(sc);
-        std::vector<float> polarcontext_invkey_vec = eig2stdvec(ringkey);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)SCDB_HEADER_BYTES_V1)
+        {
+            close(fd);
+            return false;
+        }
+
+        const size_t file_size = st.st_size;
+        void *addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        madvise(addr, file_size, MADV_SEQUENTIAL);
+
+        SCDatabaseFileHeader header;
+        std::memcpy(&header, addr, SCDB_HEADER_BYTES_V1);
+        size_t header_bytes = SCDB_HEADER_BYTES_V1;
+        header.max_radius = SC_MAX_RADIUS;
+        if (header.version == SCDB_VERSION && file_size >= sizeof(header))
+        {
+            std::memcpy(&header, addr, sizeof(header));
+            header_bytes = sizeof(header);
+        }
+
+        bool ok = std::memcmp(header.magic, SCDB_MAGIC, sizeof(SCDB_MAGIC)) == 0 && (header.version == 1 || header_bytes == sizeof(header)) &&
+                  header.record_size == uint64_t(header.num_ring) * header.num_sector + header.num_ring + 2 * header.num_sector;
+
+        // 描述子只能和同样几何参数生成的描述子比较：空的manager采用文件中的几何参数，否则必须一致
+        if (ok && (int(header.num_ring) != PC_NUM_RING || int(header.num_sector) != PC_NUM_SECTOR || header.max_radius != float(PC_MAX_RADIUS)))
+        {
+            if (polarcontexts_.empty() && setGeometry(header.num_ring, header.num_sector, header.max_radius))
+                cout << "[SC] geometry from database: " << PC_NUM_RING << " rings, " << PC_NUM_SECTOR << " sectors, max radius " << PC_MAX_RADIUS << " m." << endl;
+            else
+                ok = false;
+        }
+
+        const size_t record_bytes = size_t(header.record_size) * sizeof(float);
+        const uint64_t num_records = ok ? std::min<uint64_t>(header.count, (file_size - header_bytes) / record_bytes) : 0;
+        ok = ok && num_records >= (uint64_t)num_keyframe;
+
+        if (ok)
+        {
+            const float *records = reinterpret_cast<const float *>(static_cast<const char *>(addr) + header_bytes);
+            polarcontexts_.reserve(polarcontexts_.size() + num_keyframe);
+            for (int i = 0; i < num_keyframe; ++i)
+                polarcontexts_.pushBackRecord(records + (size_t)i * header.record_size);
+        }
 
-        return detectClosestKeyframeID(0, polarcontext_invkey_vec, sc);
+        munmap(addr, file_size);
+        return ok;
     }
 
 } // namespace SC2
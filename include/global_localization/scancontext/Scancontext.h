@@ -9,6 +9,7 @@
 #include <cstdlib>
 #include <memory>
 #include <iostream>
+#include <cstdint>
 
 #include <Eigen/Dense>
 
@@ -17,7 +18,8 @@
 #include <pcl/filters/voxel_grid.h>
 
 #include "nanoflann.hpp"
-#include "KDTreeVectorOfVectorsAdaptor.h"
+#include "KDTreeFlatArrayAdaptor.h"
+#include "EmbeddingIVFIndex.h"
 
 // #include "tictoc.h"
 
@@ -33,8 +35,6 @@ using std::cos;
 using std::sin;
 
 using SCPointType = pcl::PointXYZI; // using xyz only. but a user can exchange the original bin encoding function (i.e., max hegiht) to max intensity (for detail, refer 20 ICRA Intensity Scan Context)
-using KeyMat = std::vector<std::vector<float> >;
-using InvKeyTree = KDTreeVectorOfVectorsAdaptor< KeyMat, float >;
 
 
 namespace ScanContext
@@ -45,64 +45,485 @@ void coreImportTest ( void );
 
 // sc param-independent helper functions 
 float xy2theta( const float & _x, const float & _y );
-MatrixXd circshift( MatrixXd &_mat, int _num_shift );
-std::vector<float> eig2stdvec( MatrixXd _eigmat );
+
+
+/**
+ * @brief float型Scan-Context描述子数据库：所有描述子、ring-key、sector-key分别连续存放在一块数组中，遍历候选时对cache友好
+ *        ring/sector数量在运行时确定（来自配置或数据库文件头），描述子按列主序存放，一列就是一个sector
+ */
+class ScanContextDatabase
+{
+public:
+    ScanContextDatabase( int _num_ring, int _num_sector ) { setGeometry(_num_ring, _num_sector); }
+
+    void setGeometry( int _num_ring, int _num_sector ) // 会清空数据库
+    {
+        clear();
+        num_ring_ = _num_ring;
+        num_sector_ = _num_sector;
+    }
+
+    int numRing( void ) const { return num_ring_; }
+    int numSector( void ) const { return num_sector_; }
+    int descriptorSize( void ) const { return num_ring_ * num_sector_; }
+
+    // 二进制数据库文件中一条记录的布局: descriptor | ring-key | sector-key | column norms
+    int recordSize( void ) const { return descriptorSize() + num_ring_ + 2 * num_sector_; }
+
+    void reserve( size_t _num )
+    {
+        descriptors_.reserve(_num * descriptorSize());
+        ring_keys_.reserve(_num * num_ring_);
+        sector_keys_.reserve(_num * num_sector_);
+        column_norms_.reserve(_num * num_sector_);
+    }
+
+    void clear( void )
+    {
+        descriptors_.clear();
+        ring_keys_.clear();
+        sector_keys_.clear();
+        column_norms_.clear();
+    }
+
+    void push_back( const Eigen::Ref<const Eigen::MatrixXf> &_desc, const Eigen::Ref<const Eigen::VectorXf> &_ringkey, const Eigen::Ref<const Eigen::RowVectorXf> &_sectorkey )
+    {
+        assert(_desc.rows() == num_ring_ && _desc.cols() == num_sector_);
+        for (int col = 0; col < num_sector_; ++col)
+            descriptors_.insert(descriptors_.end(), _desc.col(col).data(), _desc.col(col).data() + num_ring_);
+        ring_keys_.insert(ring_keys_.end(), _ringkey.data(), _ringkey.data() + num_ring_);
+        sector_keys_.insert(sector_keys_.end(), _sectorkey.data(), _sectorkey.data() + num_sector_);
+
+        Eigen::RowVectorXf norms = _desc.colwise().norm();
+        column_norms_.insert(column_norms_.end(), norms.data(), norms.data() + num_sector_);
+    }
+
+    void pushBackRecord( const float *_record ) // keys和norms直接使用记录中预先算好的值
+    {
+        descriptors_.insert(descriptors_.end(), _record, _record + descriptorSize());
+        _record += descriptorSize();
+        ring_keys_.insert(ring_keys_.end(), _record, _record + num_ring_);
+        _record += num_ring_;
+        sector_keys_.insert(sector_keys_.end(), _record, _record + num_sector_);
+        _record += num_sector_;
+        column_norms_.insert(column_norms_.end(), _record, _record + num_sector_);
+    }
+
+    void copyRecord( size_t _idx, float *_record ) const
+    {
+        _record = std::copy_n(descriptors_.data() + _idx * descriptorSize(), descriptorSize(), _record);
+        _record = std::copy_n(ring_keys_.data() + _idx * num_ring_, num_ring_, _record);
+        _record = std::copy_n(sector_keys_.data() + _idx * num_sector_, num_sector_, _record);
+        std::copy_n(column_norms_.data() + _idx * num_sector_, num_sector_, _record);
+    }
+
+    size_t size( void ) const { return ring_keys_.size() / num_ring_; }
+    bool empty( void ) const { return ring_keys_.empty(); }
+
+    Eigen::Map<const Eigen::MatrixXf> descriptor( size_t _idx ) const { return Eigen::Map<const Eigen::MatrixXf>(descriptors_.data() + _idx * descriptorSize(), num_ring_, num_sector_); }
+    Eigen::Map<const Eigen::VectorXf> ringKey( size_t _idx ) const { return Eigen::Map<const Eigen::VectorXf>(ring_keys_.data() + _idx * num_ring_, num_ring_); }
+    Eigen::Map<const Eigen::RowVectorXf> sectorKey( size_t _idx ) const { return Eigen::Map<const Eigen::RowVectorXf>(sector_keys_.data() + _idx * num_sector_, num_sector_); }
+    Eigen::Map<const Eigen::RowVectorXf> columnNorms( size_t _idx ) const { return Eigen::Map<const Eigen::RowVectorXf>(column_norms_.data() + _idx * num_sector_, num_sector_); }
+
+    const std::vector<float> &ringKeys( void ) const { return ring_keys_; }
+
+private:
+    int num_ring_;
+    int num_sector_;
+    std::vector<float> descriptors_; // size() * RING * SECTOR
+    std::vector<float> ring_keys_;   // size() * RING
+    std::vector<float> sector_keys_; // size() * SECTOR
+    std::vector<float> column_norms_; // size() * SECTOR
+};
+
+
+/**
+ * @brief uint8量化的描述子数据库，用于大地图上的候选粗排
+ *        每帧存一个scale(最大高度/255)，高度量化为round(h / scale)，负高度截断为0；
+ *        余弦距离对每列的缩放不敏感，所以打分时只用整数点积和每列模长的倒数；sector-key对齐等价于最大化循环互相关，
+ *        也与整体缩放无关，直接用每列code之和做整数互相关；scale只用于恢复高度；
+ *        codes按ring-major存放，同一ring的所有sector连续，移位点积沿sector方向可以整数向量化
+ */
+class QuantizedScanContextDatabase
+{
+public:
+    QuantizedScanContextDatabase( int _num_ring, int _num_sector ) { setGeometry(_num_ring, _num_sector); }
+
+    void setGeometry( int _num_ring, int _num_sector ) // 会清空数据库
+    {
+        clear();
+        num_ring_ = _num_ring;
+        num_sector_ = _num_sector;
+    }
+
+    void reserve( size_t _num )
+    {
+        codes_.reserve(_num * num_ring_ * num_sector_);
+        scales_.reserve(_num);
+        sector_sums_.reserve(_num * num_sector_);
+        inv_column_norms_.reserve(_num * num_sector_);
+    }
+
+    void clear( void )
+    {
+        codes_.clear();
+        scales_.clear();
+        sector_sums_.clear();
+        inv_column_norms_.clear();
+    }
+
+    void push_back( const Eigen::Ref<const Eigen::MatrixXf> &_desc )
+    {
+        assert(_desc.rows() == num_ring_ && _desc.cols() == num_sector_ && num_ring_ <= 257); // 列和不超过uint16
+        const float max_height = _desc.maxCoeff();
+        const float scale = max_height > 0 ? max_height / 255.0f : 0.0f;
+        const float inv_scale = max_height > 0 ? 255.0f / max_height : 0.0f;
+
+        const size_t offset = codes_.size();
+        codes_.resize(offset + num_ring_ * num_sector_);
+        uint8_t *codes = codes_.data() + offset;
+        for (int col = 0; col < num_sector_; ++col)
+        {
+            uint32_t sum = 0, sum_sq = 0;
+            for (int row = 0; row < num_ring_; ++row)
+            {
+                const uint8_t code = uint8_t(std::min(255.0f, std::max(0.0f, _desc(row, col)) * inv_scale + 0.5f));
+                codes[row * num_sector_ + col] = code;
+                sum += code;
+                sum_sq += code * code;
+            }
+            sector_sums_.push_back(uint16_t(sum));
+            inv_column_norms_.push_back(sum_sq > 0 ? 1.0f / std::sqrt(float(sum_sq)) : 0.0f); // 空列为0，打分时跳过
+        }
+        scales_.push_back(scale);
+    }
+
+    int numRing( void ) const { return num_ring_; }
+    int numSector( void ) const { return num_sector_; }
+    size_t size( void ) const { return scales_.size(); }
+    bool empty( void ) const { return scales_.empty(); }
+
+    const uint8_t *codes( size_t _idx ) const { return codes_.data() + _idx * num_ring_ * num_sector_; }
+    const float *invColumnNorms( size_t _idx ) const { return inv_column_norms_.data() + _idx * num_sector_; }
+    float scale( size_t _idx ) const { return scales_[_idx]; }
+
+    const uint16_t *sectorSums( size_t _idx ) const { return sector_sums_.data() + _idx * num_sector_; } // 每列code之和，即sector-key / scale * NumRing
+
+private:
+    int num_ring_;
+    int num_sector_;
+    std::vector<uint8_t> codes_;            // size() * RING * SECTOR, ring-major
+    std::vector<float> scales_;             // size()
+    std::vector<uint16_t> sector_sums_;     // size() * SECTOR
+    std::vector<float> inv_column_norms_;   // size() * SECTOR
+};
+
+
+/**
+ * @brief 点到bin的查表器，构造描述子时不再需要sqrt/atan/ceil
+ *        ring: 比较半径平方和预先算好的阈值(k*gap)^2，按r^2均匀分桶查表，每个桶内最多一个阈值，再比较一次即可
+ *        sector: 用菱形角(diamond angle, 只有一次除法且随方位角单调)分桶查表，桶内的sector边界再用一次叉乘判断
+ *        分桶规则与原实现一致：ring = ceil(r / gap) - 1, sector = ceil(theta / unit) - 1，且都不小于0
+ */
+class ScanContextBinLookup
+{
+public:
+    ScanContextBinLookup( int _num_ring, int _num_sector, float _max_radius )
+        : num_ring_(_num_ring), num_sector_(_num_sector), size_(_num_ring * _num_sector),
+          ring_bins_(4 * _num_ring * _num_ring), sector_bins_(16 * _num_sector)
+    {
+        max_radius_sq_ = _max_radius * _max_radius;
+        const float ring_gap = _max_radius / num_ring_;
+        ring_threshold_sq_.resize(num_ring_ + 1);
+        for (int k = 0; k <= num_ring_; ++k)
+            ring_threshold_sq_[k] = (k * ring_gap) * (k * ring_gap);
+
+        // 相邻阈值的间距不小于gap^2 = 4个桶宽
+        ring_bin_scale_ = ring_bins_ / max_radius_sq_;
+        ring_table_.resize(ring_bins_);
+        for (int j = 0, count = 0; j < ring_bins_; ++j)
+        {
+            while (count + 1 < num_ring_ && ring_threshold_sq_[count + 1] < j / ring_bin_scale_)
+                ++count;
+            ring_table_[j] = count;
+        }
+
+        // 第k条sector边界的方向，相邻边界的菱形角间距不小于pi/num_sector > 4/sector_bins
+        std::vector<float> boundary_diamond(num_sector_ + 1);
+        sector_cos_.resize(num_sector_ + 1);
+        sector_sin_.resize(num_sector_ + 1);
+        for (int k = 0; k <= num_sector_; ++k)
+        {
+            const double theta = 2.0 * M_PI * k / num_sector_;
+            sector_cos_[k] = std::cos(theta);
+            sector_sin_[k] = std::sin(theta);
+            boundary_diamond[k] = diamondAngle(sector_cos_[k], sector_sin_[k]);
+        }
+        sector_table_.resize(sector_bins_);
+        for (int j = 0, count = 0; j < sector_bins_; ++j)
+        {
+            while (count + 1 < num_sector_ && boundary_diamond[count + 1] < j * (4.0f / sector_bins_))
+                ++count;
+            sector_table_[j] = count;
+        }
+    }
+
+    int size( void ) const { return size_; }
+    int outOfRange( void ) const { return size_; } // 超出最大半径的点落到描述子之外的一个垃圾桶
+
+    // 按[0, 4)返回的伪角度，与xy2theta的象限划分相同；y>=0时为1-x/(|x|+|y|)，y<0时为3+x/(|x|+|y|)，原点为0
+    static inline float diamondAngle( float _x, float _y )
+    {
+        const float sum = std::abs(_x) + std::abs(_y);
+        const float t = sum > 0 ? _x / sum : 1.0f;
+        return _y >= 0 ? 1.0f - t : 3.0f + t;
+    }
+
+    inline int ring( float _range_sq ) const
+    {
+        const int j = int(std::min(float(ring_bins_ - 1), _range_sq * ring_bin_scale_)); // 先在float上截断，NaN也会落到最后一个桶
+        const int r = ring_table_[j];
+        return r + ((r + 1 < num_ring_) & (_range_sq > ring_threshold_sq_[r + 1]));
+    }
+
+    inline int sector( float _x, float _y ) const
+    {
+        const int j = int(std::min(float(sector_bins_ - 1), diamondAngle(_x, _y) * (sector_bins_ / 4.0f)));
+        const int s = sector_table_[j];
+        return s + ((s + 1 < num_sector_) & (sector_cos_[s + 1] * _y - sector_sin_[s + 1] * _x > 0));
+    }
+
+    // 列主序描述子中的下标(sector * num_ring + ring)，超出最大半径(或NaN)返回outOfRange()
+    // 不做提前返回，点云里远处的点很多，分支预测失败比多算一次查表更贵
+    inline int binIndex( float _x, float _y ) const
+    {
+        const float range_sq = _x * _x + _y * _y;
+        const int idx = sector(_x, _y) * num_ring_ + ring(range_sq);
+        return range_sq <= max_radius_sq_ ? idx : size_;
+    }
+
+private:
+    int num_ring_;
+    int num_sector_;
+    int size_;
+    int ring_bins_;   // 4 * num_ring^2
+    int sector_bins_; // 16 * num_sector
+
+    float max_radius_sq_;
+    float ring_bin_scale_;
+    std::vector<float> ring_threshold_sq_; // num_ring + 1
+    std::vector<float> sector_cos_;        // num_sector + 1
+    std::vector<float> sector_sin_;        // num_sector + 1
+    std::vector<uint16_t> ring_table_;
+    std::vector<uint16_t> sector_table_;
+};
+
+
+struct SCCandidate
+{
+    int index;       // keyframe index in the database
+    double distance; // scan context distance
+    float yaw_rad;   // relative yaw, sc2右移 <=> lidar左转
+};
+
+/**
+ * @brief 位置先验(如GNSS或人工给定的大致位置)：只检索位于以(x, y)为圆心、radius为半径的圆内的关键帧
+ */
+struct SCSpatialPrior
+{
+    float x;
+    float y;
+    float radius; // meter
+};
+
+static constexpr int SC_NUM_RING = 20; // 20 in the original paper (IROS 18), default of SCManager::setGeometry
+static constexpr int SC_NUM_SECTOR = 60; // 60 in the original paper (IROS 18), default of SCManager::setGeometry
+static constexpr double SC_MAX_RADIUS = 80.0; // 80 meter max in the original paper (IROS 18)
+
+using SCDatabase = ScanContextDatabase;
+using SCDescriptor = Eigen::MatrixXf; // num_ring x num_sector, column-major, 一列就是一个sector
+using SCDescriptorRef = Eigen::Ref<const SCDescriptor>; // 既可以传SCDescriptor，也可以传数据库中的Map，都不会拷贝
+using SCRingKey = Eigen::VectorXf;
+using SCSectorKey = Eigen::RowVectorXf;
+using SCColumnNorms = Eigen::RowVectorXf; // 每个sector列向量的模长，计算余弦距离时不用每次重算
+using SCSectorRef = Eigen::Ref<const Eigen::RowVectorXf>; // sector-key或列模长
+using InvKeyTree = KDTreeFlatArrayAdaptor<float, -1>; // ring数量运行时确定
+using InvKeyDynamicTree = KDTreeFlatArrayDynamicAdaptor<float, -1>;
+using PositionDynamicTree = KDTreeFlatArrayDynamicAdaptor<float, 2>;
+using SCBinLookup = ScanContextBinLookup;
+using QSCDatabase = QuantizedScanContextDatabase;
+
+static constexpr int SC_EMBEDDING_HARMONICS = 4; // 每个ring沿sector方向DFT的前几阶幅值，对循环移位(即yaw)不变
+using SCEmbedding = Eigen::VectorXf; // num_ring * SC_EMBEDDING_HARMONICS
+using SCEmbeddingIndex = EmbeddingIVFIndex;
+
+struct SCKernels; // 按几何尺寸特化的打分函数，见Scancontext.cpp
 
 
 class SCManager
 {
 public: 
-    SCManager( ) = default; // reserving data space (of std::vector) could be considered. but the descriptor is lightweight so don't care.
+    SCManager( ) { setGeometry(SC_NUM_RING, SC_NUM_SECTOR, SC_MAX_RADIUS); } // reserving data space (of std::vector) could be considered. but the descriptor is lightweight so don't care.
 
-    Eigen::MatrixXd makeScancontext( pcl::PointCloud<SCPointType> & _scan_down );
-    Eigen::MatrixXd makeRingkeyFromScancontext( Eigen::MatrixXd &_desc );
-    Eigen::MatrixXd makeSectorkeyFromScancontext( Eigen::MatrixXd &_desc );
+    // 设置ring/sector数量和最大半径，清空数据库、索引和关键帧位置；常用尺寸使用模板特化的打分函数，其余使用通用实现
+    bool setGeometry( int _num_ring, int _num_sector, double _max_radius );
+    bool hasSpecializedKernels( void ) const; // false: the generic fallback is used for this geometry
 
-    int fastAlignUsingVkey ( MatrixXd & _vkey1, MatrixXd & _vkey2 ); 
-    double distDirectSC ( MatrixXd &_sc1, MatrixXd &_sc2 ); // "d" (eq 5) in the original paper (IROS 18)
-    std::pair<double, int> distanceBtnScanContext ( MatrixXd &_sc1, MatrixXd &_sc2 ); // "D" (eq 6) in the original paper (IROS 18)
+    template <typename PointT>
+    SCDescriptor makeScancontext( const pcl::PointCloud<PointT> & _scan_down ) const; // 任意带xyz的点类型，不需要先拷贝成SCPointType
+    SCRingKey makeRingkeyFromScancontext( const SCDescriptorRef &_desc );
+    SCSectorKey makeSectorkeyFromScancontext( const SCDescriptorRef &_desc );
+    SCEmbedding makeEmbeddingFromScancontext( const SCDescriptorRef &_desc ); // rotation-invariant, L2-normalized
+
+    int fastAlignUsingVkey ( const SCSectorRef & _vkey1, const SCSectorRef & _vkey2 ); 
+    double distDirectSC ( const SCDescriptorRef &_sc1, const SCDescriptorRef &_sc2 ); // "d" (eq 5) in the original paper (IROS 18)
+    double distDirectSC ( const SCDescriptorRef &_sc1, const SCSectorRef &_norms1, const SCDescriptorRef &_sc2, const SCSectorRef &_norms2, int _num_shift ); // _sc2 shifted right by _num_shift
+    std::pair<double, int> distanceBtnScanContext ( const SCDescriptorRef &_sc1, const SCDescriptorRef &_sc2 ); // "D" (eq 6) in the original paper (IROS 18)
+    std::pair<double, int> distanceBtnScanContext ( const SCDescriptorRef &_sc1, const SCSectorRef &_vkey1, const SCSectorRef &_norms1,
+                                                    const SCDescriptorRef &_sc2, const SCSectorRef &_vkey2, const SCSectorRef &_norms2 ); // with precomputed sector-keys and column norms
+    std::pair<double, int> distanceBtnKeyframes ( size_t _idx1, size_t _idx2 ); // "D" between two descriptors already in the database
+    int fastAlignQuantized ( const uint16_t *_sums1, const uint16_t *_sums2 ); // argmax of the integer circular cross-correlation of sector sums
+    double distDirectQuantizedSC ( const QSCDatabase &_db1, size_t _idx1, const QSCDatabase &_db2, size_t _idx2, int _num_shift ); // integer dot products on uint8 codes
+    std::pair<double, int> distanceBtnQuantizedScanContext ( const QSCDatabase &_db1, size_t _idx1, const QSCDatabase &_db2, size_t _idx2 ); // coarse, at the sector-key aligned shift only
 
     // User-side API
-    void makeAndSaveScancontextAndKeys( pcl::PointCloud<SCPointType> & _scan_down );
-    std::pair<int, float> detectClosestKeyframeID(int num_exclude_recent, const std::vector<float> &curr_key, Eigen::MatrixXd &curr_desc);
+    template <typename PointT>
+    void makeAndSaveScancontextAndKeys( const pcl::PointCloud<PointT> & _scan_down );
+    std::vector<SCCandidate> detectTopKCandidates(int num_exclude_recent, const SCRingKey &curr_key, const SCDescriptorRef &curr_desc, int top_k, int num_tree_candidates,
+                                                  bool use_ann = false, const SCSpatialPrior *prior = nullptr); // ranked by distance, below SC_DIST_THRES
+    std::pair<int, float> detectClosestKeyframeID(int num_exclude_recent, const SCRingKey &curr_key, const SCDescriptorRef &curr_desc, const SCSpatialPrior *prior = nullptr);
     std::pair<int, float> detectLoopClosureID( int num_exclude_recent = 50 ); // int: nearest node index, float: relative yaw  
+    std::pair<int, float> detectLoopClosureID( int num_exclude_recent, int query_index, const SCSpatialPrior *prior = nullptr ); // query an already saved keyframe, excluding the ones recent to it
+    std::vector<SCCandidate> detectLoopClosureCandidates( int num_exclude_recent, int query_index, int top_k, const SCSpatialPrior *prior = nullptr );
+
+    // keyframe positions for spatial priors, index i is the position of descriptor i; keyframes without one never match a prior
+    void addKeyframePosition(float x, float y);
+    std::vector<size_t> keyframesInRegion(const SCSpatialPrior &prior, size_t max_index); // ascending, only indices < max_index
 
     void saveCurrentSCD(const std::string &fileName, int num_digits = 6, const std::string &delimiter = " ");
     void loadPriorSCD(const std::string &path, int num_digits, int num_keyframe);
-    std::pair<int, float> relocalize(pcl::PointCloud<SCPointType> &_scan_down);
+
+    // binary descriptor database: header + one fixed-size record (descriptor and precomputed keys) per keyframe
+    static constexpr const char *DATABASE_FILENAME = "descriptors.scdb";
+    bool appendCurrentToDatabase(const std::string &file); // write the latest descriptor as record size()-1
+    bool saveDatabase(const std::string &file);
+    bool loadDatabase(const std::string &file, int num_keyframe); // mmap, false if missing, mismatched or shorter than num_keyframe; an empty manager adopts the file geometry
+
+    // ANN index over the rotation-invariant embeddings of the whole database, built offline with the map
+    static constexpr const char *EMBEDDING_INDEX_FILENAME = "descriptors.ivf";
+    void buildEmbeddingIndex(int nlist = 0);
+    bool saveEmbeddingIndex(const std::string &file) const;
+    bool loadEmbeddingIndex(const std::string &file); // false if missing or built for a different database size
+    template <typename PointT>
+    std::pair<int, float> relocalize(const pcl::PointCloud<PointT> &_scan_down, const SCSpatialPrior *prior = nullptr);
+    template <typename PointT>
+    std::vector<SCCandidate> relocalizeCandidates(const pcl::PointCloud<PointT> &_scan_down, int top_k, const SCSpatialPrior *prior = nullptr);
 
 public:
     // hyper parameters ()
     double LIDAR_HEIGHT = 2.2; // lidar height : add this for simply directly using lidar scan in the lidar local coord (not robot base coord) / if you use robot-coord-transformed lidar scans, just set this as 0.
 
-    const int    PC_NUM_RING = 20; // 20 in the original paper (IROS 18)
-    const int    PC_NUM_SECTOR = 60; // 60 in the original paper (IROS 18)
-    const double PC_MAX_RADIUS = 80.0; // 80 meter max in the original paper (IROS 18)
-    const double PC_UNIT_SECTORANGLE = 360.0 / double(PC_NUM_SECTOR);
-    const double PC_UNIT_RINGGAP = PC_MAX_RADIUS / double(PC_NUM_RING);
+    // geometry, read only, changed together by setGeometry()
+    int PC_NUM_RING = SC_NUM_RING;
+    int PC_NUM_SECTOR = SC_NUM_SECTOR;
+    double PC_MAX_RADIUS = SC_MAX_RADIUS;
+    double PC_UNIT_SECTORANGLE = 360.0 / double(PC_NUM_SECTOR);
+    double PC_UNIT_RINGGAP = PC_MAX_RADIUS / double(PC_NUM_RING);
+    SCBinLookup bin_lookup_{SC_NUM_RING, SC_NUM_SECTOR, float(SC_MAX_RADIUS)}; // 点到bin的查表器
 
     // tree
-    const int    NUM_CANDIDATES_FROM_TREE = 10; // 10 is enough. (refer the IROS 18 paper)
+    int          NUM_CANDIDATES_FROM_TREE = 10; // 10 is enough. (refer the IROS 18 paper)
+    int          PARALLEL_SCORING_MIN_CANDIDATES = 32; // score candidates with openmp when the tree returns at least this many
+
+    // quantized scoring: tree candidates are ranked with uint8 descriptors first, only the best few are re-scored with the float ones
+    bool         QUANTIZED_SCORING_EN = false;
+    int          QUANTIZED_RERANK_CANDIDATES = 10;
+
+    // ann: candidates from the embedding index are merged with the ring-key tree candidates when relocalizing
+    bool         ANN_SEARCH_EN = false;
+    int          NUM_CANDIDATES_FROM_ANN = 10;
+    int          ANN_NPROBE = 8; // clusters scanned per query, higher = better recall, nlist = brute force
 
     // loop thres
-    const double SEARCH_RATIO = 0.2; // for fast comparison, no Brute-force, but search 10 % is okay. // not was in the original conf paper, but improved ver.
+    double SEARCH_RATIO = 0.2; // for fast comparison, no Brute-force, but search 10 % is okay. // not was in the original conf paper, but improved ver.
     // const double SC_DIST_THRES = 0.13; // empirically 0.1-0.2 is fine (rare false-alarms) for 20x60 polar context (but for 0.15 <, DCS or ICP fit score check (e.g., in LeGO-LOAM) should be required for robustness)
     double SC_DIST_THRES = 0.5; // 0.4-0.6 is good choice for using with robust kernel (e.g., Cauchy, DCS) + icp fitness threshold / if not, recommend 0.1-0.15
 
-    // config 
-    const int    TREE_MAKING_PERIOD_ = 50; // i.e., remaking tree frequency, to avoid non-mandatory every remaking, to save time cost / if you want to find a very recent revisits use small value of it (it is enough fast ~ 5-50ms wrt N.).
-    int          tree_making_period_conter = 0;
-
     // data 
     std::vector<double> polarcontexts_timestamp_; // optional.
-    std::vector<Eigen::MatrixXd> polarcontexts_;
-    std::vector<Eigen::MatrixXd> polarcontext_invkeys_;
-    std::vector<Eigen::MatrixXd> polarcontext_vkeys_;
+    SCDatabase polarcontexts_{SC_NUM_RING, SC_NUM_SECTOR}; // descriptors, ring-keys and sector-keys
+
+    std::shared_ptr<InvKeyDynamicTree> polarcontext_tree_; // incrementally indexes polarcontexts_ ring-keys, recent ones are excluded at query time
+    QSCDatabase quantized_contexts_{SC_NUM_RING, SC_NUM_SECTOR}; // uint8 copy of polarcontexts_, appended lazily at query time when QUANTIZED_SCORING_EN
+    SCEmbeddingIndex embedding_index_; // static, covers the first embedding_index_.size() keyframes
+
+    std::vector<float> keyframe_positions_; // x, y per keyframe, optional, only needed by spatial priors
+    std::shared_ptr<PositionDynamicTree> position_tree_; // incrementally indexes keyframe_positions_
 
-    KeyMat polarcontext_invkeys_mat_;
-    KeyMat polarcontext_invkeys_to_search_;
-    std::shared_ptr<InvKeyTree> polarcontext_tree_;
+private:
+    int searchRadius( void ) const; // shifts searched on each side of the sector-key alignment
+
+    const SCKernels *kernels_ = nullptr;
+    Eigen::MatrixXf embedding_cos_basis_; // num_sector x SC_EMBEDDING_HARMONICS
+    Eigen::MatrixXf embedding_sin_basis_;
 
 }; // SCManager
 
+
+/**
+ * @brief 输入一帧点云，生成Scan-Context
+ *        直接遍历原始点类型，查表得到bin下标后取最大高度；超出最大半径的点写到描述子后面的垃圾桶里，不用单独判断
+ *
+ * @param[in] _scan_down, 任意带xyz字段的点云，如PointXYZI/PointXYZINormal
+ * @return SCDescriptor, 生成的Scan-Context矩阵
+ */
+template <typename PointT>
+SCDescriptor SCManager::makeScancontext( const pcl::PointCloud<PointT> & _scan_down ) const
+{
+    // 标记格子中是否有点，如果没有点高度设置成-1000, 是一个肯定没有的值
+    const float NO_POINT = -1000;
+    std::vector<float> bins(bin_lookup_.size() + 1, NO_POINT);
+
+    // 所有的高度加上安装高度，让安装高度之下的点云的高度也变成正数
+    const float lidar_height = LIDAR_HEIGHT;
+    for (const auto &pt : _scan_down.points)
+    {
+        const int idx = bin_lookup_.binIndex(pt.x, pt.y);
+        bins[idx] = std::max(bins[idx], pt.z + lidar_height); // taking maximum z
+    }
+
+    // reset no points to zero (for cosine dist later)
+    Eigen::Map<const SCDescriptor> desc(bins.data(), PC_NUM_RING, PC_NUM_SECTOR);
+    return (desc.array() == NO_POINT).select(0.0f, desc);
+} // SCManager::makeScancontext
+
+/**
+ * @brief 输入一帧点云，生成ScanContext，并计算ring-key和sector-key，然后存到数据库中
+ */
+template <typename PointT>
+void SCManager::makeAndSaveScancontextAndKeys( const pcl::PointCloud<PointT> & _scan_down )
+{
+    SCDescriptor sc = makeScancontext(_scan_down);
+    polarcontexts_.push_back(sc, makeRingkeyFromScancontext(sc), makeSectorkeyFromScancontext(sc));
+} // SCManager::makeAndSaveScancontextAndKeys
+
+template <typename PointT>
+std::pair<int, float> SCManager::relocalize( const pcl::PointCloud<PointT> &_scan_down, const SCSpatialPrior *prior )
+{
+    auto candidates = relocalizeCandidates(_scan_down, 1, prior);
+    if (candidates.empty())
+        return std::pair<int, float>{-1, 0.0};
+    return std::pair<int, float>{candidates[0].index, candidates[0].yaw_rad};
+}
+
+template <typename PointT>
+std::vector<SCCandidate> SCManager::relocalizeCandidates( const pcl::PointCloud<PointT> &_scan_down, int top_k, const SCSpatialPrior *prior )
+{
+    if (polarcontexts_.empty())
+        return std::vector<SCCandidate>();
+
+    SCDescriptor sc = makeScancontext(_scan_down);
+    return detectTopKCandidates(0, makeRingkeyFromScancontext(sc), sc, top_k, std::max(NUM_CANDIDATES_FROM_TREE, top_k), true, prior);
+}
+
 } // namespace ScanContext
@@ -0,0 +1,232 @@
+#include "Header.h"
+#include "global_localization/scancontext/Scancontext.h"
+#include <random>
+
+FILE *location_log = nullptr;
+
+/**
+ * 用随机生成的描述子检查distDirectSC/distanceBtnScanContext与原来基于circshift的实现结果一致，并比较两者的耗时。
+ * 常用尺寸的特化实现按定长向量展开点积，累加顺序不同，距离只要求在DIST_TOLERANCE之内；
+ * 偏移量不同时，参考实现在两个偏移下的距离也必须在容差之内(近似并列)
+ */
+void usage(const char *prog)
+{
+    printf("usage: %s [num_descriptors] [seed] [num_ring num_sector]\n", prog);
+    printf("  num_descriptors  default = 200, every pair is compared\n");
+    printf("  seed             default = 0\n");
+    printf("  num_ring         default = %d\n", ScanContext::SC_NUM_RING);
+    printf("  num_sector       default = %d\n", ScanContext::SC_NUM_SECTOR);
+}
+
+/**
+ * 原来的实现：每个偏移都复制一份循环右移之后的sector-key/描述子，每次重新计算列的模长
+ */
+namespace reference
+{
+    template <typename MatrixType>
+    MatrixType circshift(const MatrixType &_mat, int _num_shift)
+    {
+        if (_num_shift == 0)
+            return _mat;
+
+        MatrixType shifted_mat(_mat.rows(), _mat.cols());
+        for (int col_idx = 0; col_idx < _mat.cols(); col_idx++)
+            shifted_mat.col((col_idx + _num_shift) % _mat.cols()) = _mat.col(col_idx);
+        return shifted_mat;
+    }
+
+    double distDirectSC(const ScanContext::SCDescriptor &_sc1, const ScanContext::SCDescriptor &_sc2)
+    {
+        int num_eff_cols = 0;
+        double sum_sector_similarity = 0;
+        for (int col_idx = 0; col_idx < _sc1.cols(); col_idx++)
+        {
+            const auto col_sc1 = _sc1.col(col_idx);
+            const auto col_sc2 = _sc2.col(col_idx);
+            const float norm_sc1 = col_sc1.norm();
+            const float norm_sc2 = col_sc2.norm();
+            if (norm_sc1 == 0 || norm_sc2 == 0)
+                continue;
+
+            sum_sector_similarity += col_sc1.dot(col_sc2) / (norm_sc1 * norm_sc2);
+            num_eff_cols++;
+        }
+        return 1.0 - sum_sector_similarity / num_eff_cols;
+    }
+
+    int fastAlignUsingVkey(const ScanContext::SCSectorKey &_vkey1, const ScanContext::SCSectorKey &_vkey2)
+    {
+        int argmin_vkey_shift = 0;
+        double min_veky_diff_norm = 10000000;
+        for (int shift_idx = 0; shift_idx < _vkey1.cols(); shift_idx++)
+        {
+            double cur_diff_norm = (_vkey1 - circshift(_vkey2, shift_idx)).norm();
+            if (cur_diff_norm < min_veky_diff_norm)
+            {
+                argmin_vkey_shift = shift_idx;
+                min_veky_diff_norm = cur_diff_norm;
+            }
+        }
+        return argmin_vkey_shift;
+    }
+
+    std::pair<double, int> distanceBtnScanContext(ScanContext::SCManager &_sc_manager, const ScanContext::SCDescriptor &_sc1, const ScanContext::SCDescriptor &_sc2)
+    {
+        int argmin_vkey_shift = fastAlignUsingVkey(_sc_manager.makeSectorkeyFromScancontext(_sc1), _sc_manager.makeSectorkeyFromScancontext(_sc2));
+
+        const int SEARCH_RADIUS = round(0.5 * _sc_manager.SEARCH_RATIO * _sc1.cols());
+        std::vector<int> shift_idx_search_space{argmin_vkey_shift};
+        for (int ii = 1; ii < SEARCH_RADIUS + 1; ii++)
+        {
+            shift_idx_search_space.push_back((argmin_vkey_shift + ii + _sc1.cols()) % _sc1.cols());
+            shift_idx_search_space.push_back((argmin_vkey_shift - ii + _sc1.cols()) % _sc1.cols());
+        }
+        std::sort(shift_idx_search_space.begin(), shift_idx_search_space.end());
+
+        int argmin_shift = 0;
+        double min_sc_dist = 10000000;
+        for (int num_shift : shift_idx_search_space)
+        {
+            double cur_sc_dist = distDirectSC(_sc1, circshift(_sc2, num_shift));
+            if (cur_sc_dist < min_sc_dist)
+            {
+                argmin_shift = num_shift;
+                min_sc_dist = cur_sc_dist;
+            }
+        }
+        return std::make_pair(min_sc_dist, argmin_shift);
+    }
+} // namespace reference
+
+const double DIST_TOLERANCE = 1e-6; // float点积的舍入误差在1e-8量级
+
+bool close(double a, double b)
+{
+    return std::abs(a - b) <= DIST_TOLERANCE || (std::isnan(a) && std::isnan(b)); // 没有有效列时为nan
+}
+
+/**
+ * 随机描述子：每列最大高度，约1/5的列为空；奇数号是前一个描述子循环右移并加噪声的结果，相似的描述子对也能覆盖到
+ */
+std::vector<ScanContext::SCDescriptor> make_descriptors(int num, int num_ring, int num_sector, std::mt19937 &rng)
+{
+    std::uniform_real_distribution<float> height(0, 5);
+    std::uniform_int_distribution<int> shift(0, num_sector - 1);
+    std::normal_distribution<float> noise(0, 0.1);
+    std::vector<ScanContext::SCDescriptor> descriptors;
+    for (int i = 0; i < num; ++i)
+    {
+        ScanContext::SCDescriptor desc(num_ring, num_sector);
+        if (i % 2 == 1)
+        {
+            desc = reference::circshift(descriptors.back(), shift(rng));
+            for (int k = 0; k < desc.size(); ++k)
+                if (desc(k) > 0)
+                    desc(k) = std::max(0.0f, desc(k) + noise(rng));
+        }
+        else
+        {
+            for (int k = 0; k < desc.size(); ++k)
+                desc(k) = (rng() % 3 == 0) ? 0.0f : height(rng);
+            for (int col = 0; col < num_sector; ++col)
+                if (rng() % 5 == 0)
+                    desc.col(col).setZero();
+        }
+        descriptors.push_back(desc);
+    }
+    return descriptors;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help"))
+    {
+        usage(argv[0]);
+        return 0;
+    }
+
+    const int num = argc > 1 ? std::max(2, std::atoi(argv[1])) : 200;
+    std::mt19937 rng(argc > 2 ? std::atoi(argv[2]) : 0);
+    ScanContext::SCManager sc_manager;
+    if (argc > 4 && !sc_manager.setGeometry(std::atoi(argv[3]), std::atoi(argv[4]), ScanContext::SC_MAX_RADIUS))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const auto descriptors = make_descriptors(num, sc_manager.PC_NUM_RING, sc_manager.PC_NUM_SECTOR, rng);
+
+    std::vector<ScanContext::SCSectorKey> vkeys;
+    std::vector<ScanContext::SCColumnNorms> norms;
+    for (const auto &desc : descriptors)
+    {
+        vkeys.push_back(sc_manager.makeSectorkeyFromScancontext(desc));
+        norms.push_back(desc.colwise().norm());
+    }
+
+    // 1. 每个偏移的"d"
+    size_t num_mismatch = 0, num_checked = 0;
+    for (int i = 0; i < num; ++i)
+    {
+        for (int j = 0; j < num; ++j)
+        {
+            for (int shift = 0; shift < sc_manager.PC_NUM_SECTOR; ++shift)
+            {
+                const double expected = reference::distDirectSC(descriptors[i], reference::circshift(descriptors[j], shift));
+                const double actual = sc_manager.distDirectSC(descriptors[i], norms[i], descriptors[j], norms[j], shift);
+                ++num_checked;
+                if (!close(expected, actual) && num_mismatch++ < 10)
+                    LOG_ERROR("distDirectSC mismatch, pair = (%d, %d), shift = %d, expected = %.17g, actual = %.17g.", i, j, shift, expected, actual);
+            }
+            const double expected = reference::distDirectSC(descriptors[i], descriptors[j]);
+            const double actual = sc_manager.distDirectSC(descriptors[i], descriptors[j]);
+            ++num_checked;
+            if (!close(expected, actual) && num_mismatch++ < 10)
+                LOG_ERROR("distDirectSC mismatch, pair = (%d, %d), expected = %.17g, actual = %.17g.", i, j, expected, actual);
+        }
+    }
+
+    // 2. "D"：原始描述子，以及预先算好sector-key和列模长(数据库中的关键帧)两种接口
+    std::vector<std::pair<double, int>> expected_results, raw_results, precomputed_results;
+    expected_results.reserve(num * num);
+    raw_results.reserve(num * num);
+    precomputed_results.reserve(num * num);
+    Timer timer;
+    for (int i = 0; i < num; ++i)
+        for (int j = 0; j < num; ++j)
+            expected_results.push_back(reference::distanceBtnScanContext(sc_manager, descriptors[i], descriptors[j]));
+    const double reference_time = timer.elapsedLast();
+    for (int i = 0; i < num; ++i)
+        for (int j = 0; j < num; ++j)
+            raw_results.push_back(sc_manager.distanceBtnScanContext(descriptors[i], descriptors[j]));
+    const double raw_time = timer.elapsedLast();
+    for (int i = 0; i < num; ++i)
+        for (int j = 0; j < num; ++j)
+            precomputed_results.push_back(sc_manager.distanceBtnScanContext(descriptors[i], vkeys[i], norms[i], descriptors[j], vkeys[j], norms[j]));
+    const double precomputed_time = timer.elapsedLast();
+
+    for (size_t k = 0; k < expected_results.size(); ++k)
+    {
+        const auto &expected = expected_results[k];
+        for (const auto *actual : {&raw_results[k], &precomputed_results[k]})
+        {
+            ++num_checked;
+            const bool same_shift = expected.second == actual->second ||
+                                    close(expected.first, reference::distDirectSC(descriptors[k / num], reference::circshift(descriptors[k % num], actual->second)));
+            if ((!close(expected.first, actual->first) || !same_shift) && num_mismatch++ < 10)
+                LOG_ERROR("distanceBtnScanContext mismatch, pair = (%lu, %lu), expected = (%.17g, %d), actual = (%.17g, %d).", k / num, k % num,
+                          expected.first, expected.second, actual->first, actual->second);
+        }
+    }
+
+    const double num_pairs = double(num) * num;
+    LOG_WARN("distanceBtnScanContext per pair: circshift reference = %.2f us, raw descriptors = %.2f us, precomputed keys = %.2f us.",
+             reference_time * 1000 / num_pairs, raw_time * 1000 / num_pairs, precomputed_time * 1000 / num_pairs);
+    if (num_mismatch > 0)
+    {
+        LOG_ERROR("%lu of %lu results differ from the circshift reference!", num_mismatch, num_checked);
+        return 1;
+    }
+    LOG_WARN("%lu results match the circshift reference within %g (%d descriptors, %d x %d, %s kernels).", num_checked, DIST_TOLERANCE, num,
+             sc_manager.PC_NUM_RING, sc_manager.PC_NUM_SECTOR, sc_manager.hasSpecializedKernels() ? "specialized" : "generic");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include "Header.h"
+#include "global_localization/scancontext/Scancontext.h"
+#include <fstream>
+#include <sstream>
+
+FILE *location_log = nullptr;
+
+/**
+ * 把旧地图scancontext/目录下逐帧的文本.scd转换成一个二进制描述子数据库，重定位启动时直接mmap加载；
+ * 同时在输出文件的同一目录下建立描述子嵌入向量的ANN索引
+ */
+void usage(const char *prog)
+{
+    printf("usage: %s <scd_path> [output_file] [max_radius]\n", prog);
+    printf("  scd_path     directory with 000000.scd, 000001.scd, ...\n");
+    printf("  output_file  default = <scd_path>/%s\n", ScanContext::SCManager::DATABASE_FILENAME);
+    printf("  max_radius   max radius the descriptors were built with, default = %.0f m\n", ScanContext::SC_MAX_RADIUS);
+}
+
+/**
+ * .scd不记录几何参数，按第一个文件的行数(ring)和每行的数值个数(sector)推断
+ */
+bool infer_geometry(const std::string &scd_file, int &num_ring, int &num_sector)
+{
+    std::ifstream file(scd_file);
+    if (!file.is_open())
+        return false;
+
+    num_ring = num_sector = 0;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::istringstream values(line);
+        int count = 0;
+        float value;
+        while (values >> value)
+            ++count;
+        if (count == 0)
+            continue;
+        if (num_sector != 0 && count != num_sector)
+            return false;
+        num_sector = count;
+        ++num_ring;
+    }
+    return num_ring > 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::string scd_path = argv[1];
+    std::string output_file = argc > 2 ? argv[2] : scd_path + "/" + ScanContext::SCManager::DATABASE_FILENAME;
+    if (!fs::exists(scd_path))
+    {
+        LOG_ERROR("path not exists, path = %s!", scd_path.c_str());
+        return 1;
+    }
+
+    int scd_file_count = FileOperation::getFilesNumByExtension(scd_path, ".scd");
+    if (scd_file_count == 0)
+    {
+        LOG_ERROR("no scd file found, path = %s!", scd_path.c_str());
+        return 1;
+    }
+    std::string first_file = FileOperation::getOneFilenameByExtension(scd_path, ".scd");
+    int num_digits = first_file.length() - std::string(".scd").length();
+
+    int num_ring = 0, num_sector = 0;
+    double max_radius = argc > 3 ? std::atof(argv[3]) : ScanContext::SC_MAX_RADIUS;
+    ScanContext::SCManager sc_manager;
+    if (!infer_geometry(scd_path + "/" + first_file, num_ring, num_sector) || !sc_manager.setGeometry(num_ring, num_sector, max_radius))
+    {
+        LOG_ERROR("unrecognized scd geometry, file = %s!", first_file.c_str());
+        return 1;
+    }
+
+    Timer timer;
+    sc_manager.loadPriorSCD(scd_path, num_digits, scd_file_count);
+    double load_text_time = timer.elapsedLast();
+
+    if (!sc_manager.saveDatabase(output_file))
+    {
+        LOG_ERROR("save scan context database failed, path = %s!", output_file.c_str());
+        return 1;
+    }
+
+    timer.record();
+    ScanContext::SCManager sc_manager_check;
+    if (!sc_manager_check.loadDatabase(output_file, scd_file_count))
+    {
+        LOG_ERROR("reload scan context database failed, path = %s!", output_file.c_str());
+        return 1;
+    }
+    double load_binary_time = timer.elapsedLast();
+
+    // 同时离线建立ANN索引，重定位时直接加载
+    std::string index_file = fs::path(output_file).replace_filename(ScanContext::SCManager::EMBEDDING_INDEX_FILENAME).string();
+    sc_manager.buildEmbeddingIndex();
+    if (!sc_manager.saveEmbeddingIndex(index_file))
+    {
+        LOG_ERROR("save scan context embedding index failed, path = %s!", index_file.c_str());
+        return 1;
+    }
+    double build_index_time = timer.elapsedLast();
+
+    LOG_WARN("converted %d scd files (%d x %d, %.0f m) to %s, load text = %.1f ms, load binary = %.1f ms, build embedding index = %.1f ms.", scd_file_count,
+             num_ring, num_sector, max_radius, output_file.c_str(), load_text_time, load_binary_time, build_index_time);
+    return 0;
+}
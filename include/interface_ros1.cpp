@@ -306,13 +306,32 @@ void load_parameters()
     ros::param::param("mapping/ikdtree_reconstruct_downsamp_size", backend.backend->ikdtree_reconstruct_downsamp_size, 0.1f);
 
     ros::param::param("mapping/loop_closure_enable_flag", backend.loop_closure_enable_flag, false);
-    ros::param::param("mapping/loop_closure_interval", backend.loop_closure_interval, 1000);
+    ros::param::param("mapping/loop_closure_max_backlog", backend.loop_closure_max_backlog, 10);
+    ros::param::param("mapping/loop_closure_deadline", backend.loop_closure_deadline, 3000.);
     ros::param::param("mapping/loop_keyframe_num_thld", backend.loopClosure->loop_keyframe_num_thld, 50);
     ros::param::param("mapping/loop_closure_search_radius", backend.loopClosure->loop_closure_search_radius, 10.f);
     ros::param::param("mapping/loop_closure_keyframe_interval", backend.loopClosure->loop_closure_keyframe_interval, 30);
     ros::param::param("mapping/keyframe_search_num", backend.loopClosure->keyframe_search_num, 20);
     ros::param::param("mapping/loop_closure_fitness_score_thld", backend.loopClosure->loop_closure_fitness_score_thld, 0.05f);
     ros::param::param("mapping/icp_downsamp_size", backend.loopClosure->icp_downsamp_size, 0.1f);
+    ros::param::param("mapping/loop_closure_coarse_resolutions", backend.loopClosure->coarse_resolutions, vector<double>({1.0, 0.5}));
+    ros::param::param("mapping/loop_closure_coarse_iterations", backend.loopClosure->coarse_iterations, 20);
+    ros::param::param("mapping/loop_closure_coarse_fitness_score_thld", backend.loopClosure->coarse_fitness_score_thld, 1.0f);
+    ros::param::param("mapping/loop_precheck_enable", backend.loopClosure->precheck_enable, true);
+    ros::param::param("mapping/loop_precheck_sc_dist_thld", backend.loopClosure->precheck_sc_dist_thld, 0.6f);
+    ros::param::param("mapping/loop_precheck_height_hist_thld", backend.loopClosure->precheck_height_hist_thld, 0.5f);
+    ros::param::param("mapping/loop_precheck_height_hist_min_z", backend.loopClosure->precheck_height_hist_min_z, -1.0f);
+    ros::param::param("mapping/loop_precheck_height_hist_max_z", backend.loopClosure->precheck_height_hist_max_z, 9.0f);
+    ros::param::param("mapping/loop_precheck_height_hist_bin_size", backend.loopClosure->precheck_height_hist_bin_size, 0.5f);
+    ros::param::param("mapping/loop_precheck_overlap_resolution", backend.loopClosure->precheck_overlap_resolution, 2.0f);
+    ros::param::param("mapping/loop_precheck_overlap_thld", backend.loopClosure->precheck_overlap_thld, 0.f);
+    ros::param::param("mapping/loop_negative_cache_enable", backend.loopClosure->negative_cache_enable, true);
+    ros::param::param("mapping/loop_negative_cache_cell_size", backend.loopClosure->negative_cache_cell_size, 2.0f);
+    ros::param::param("mapping/loop_negative_cache_backoff", backend.loopClosure->negative_cache_backoff, 5.0);
+    ros::param::param("mapping/loop_negative_cache_max_backoff", backend.loopClosure->negative_cache_max_backoff, 120.0);
+    ros::param::param("mapping/loop_negative_cache_graph_change_dist", backend.loopClosure->negative_cache_graph_change_dist, 0.5f);
+    ros::param::param("mapping/loop_negative_cache_graph_change_yaw", backend.loopClosure->negative_cache_graph_change_yaw, 0.05f);
+    ros::param::param("mapping/loop_closure_sc_top_k", backend.loopClosure->sc_top_k, 3);
     ros::param::param("mapping/manually_loop_vaild_period", backend.loopClosure->loop_vaild_period["manually"], vector<double>());
     ros::param::param("mapping/odom_loop_vaild_period", backend.loopClosure->loop_vaild_period["odom"], vector<double>());
     ros::param::param("mapping/scancontext_loop_vaild_period", backend.loopClosure->loop_vaild_period["scancontext"], vector<double>());
@@ -331,8 +350,26 @@ void load_parameters()
     else
         backend.map_path = PCD_FILE_DIR("");
 
+    int sc_num_ring, sc_num_sector;
+    double sc_max_radius;
+    ros::param::param("scan_context/num_ring", sc_num_ring, 20);
+    ros::param::param("scan_context/num_sector", sc_num_sector, 60);
+    ros::param::param("scan_context/max_radius", sc_max_radius, 80.0);
+    if (!backend.relocalization->sc_manager->setGeometry(sc_num_ring, sc_num_sector, sc_max_radius))
+        LOG_ERROR("invalid scan context geometry, use %d x %d, %.0f m!", backend.relocalization->sc_manager->PC_NUM_RING,
+                  backend.relocalization->sc_manager->PC_NUM_SECTOR, backend.relocalization->sc_manager->PC_MAX_RADIUS);
+    ros::param::param("scan_context/search_ratio", backend.relocalization->sc_manager->SEARCH_RATIO, 0.2);
     ros::param::param("scan_context/lidar_height", backend.relocalization->sc_manager->LIDAR_HEIGHT, 2.0);
     ros::param::param("scan_context/sc_dist_thres", backend.relocalization->sc_manager->SC_DIST_THRES, 0.5);
+    ros::param::param("scan_context/tree_candidates", backend.relocalization->sc_manager->NUM_CANDIDATES_FROM_TREE, 10);
+    ros::param::param("scan_context/relocalization_top_k", backend.relocalization->sc_top_k, 3);
+    ros::param::param("scan_context/quantized_scoring_en", backend.relocalization->sc_manager->QUANTIZED_SCORING_EN, false);
+    ros::param::param("scan_context/quantized_rerank", backend.relocalization->sc_manager->QUANTIZED_RERANK_CANDIDATES, 10);
+    ros::param::param("scan_context/ann_search_en", backend.relocalization->sc_manager->ANN_SEARCH_EN, false);
+    ros::param::param("scan_context/ann_candidates", backend.relocalization->sc_manager->NUM_CANDIDATES_FROM_ANN, 10);
+    ros::param::param("scan_context/ann_nprobe", backend.relocalization->sc_manager->ANN_NPROBE, 8);
+    ros::param::param("scan_context/prior_radius", backend.relocalization->sc_prior_radius, 200.0);
+    ros::param::param("scan_context/prior_gnss_timeout", backend.relocalization->sc_prior_gnss_timeout, 10.0);
 
     if (false)
     {
@@ -343,6 +380,7 @@ void load_parameters()
         backend.relocalization->set_extrinsic(extrinT_eigen, extrinR_eigen);
 
         ros::param::param("relocalization_cfg/algorithm_type", backend.relocalization->algorithm_type, std::string("UNKONW"));
+        ros::param::param("relocalization_cfg/time_budget", backend.relocalization->time_budget_ms, 0.);
 
         BnbOptions match_option;
         ros::param::param("bnb3d/linear_xy_window_size", match_option.linear_xy_window_size, 10.);
@@ -354,7 +392,7 @@ void load_parameters()
         ros::param::param("bnb3d/enough_score", match_option.enough_score, 0.8);
         ros::param::param("bnb3d/min_xy_resolution", match_option.min_xy_resolution, 0.2);
         ros::param::param("bnb3d/min_z_resolution", match_option.min_z_resolution, 0.1);
-        ros::param::param("bnb3d/min_angular_resolution", match_option.min_angular_resolution, 0.1);
+        ros::param::param("bnb3d/min_angular_resolution", match_option.min_angular_resolution, 1.);
         ros::param::param("bnb3d/filter_size_scan", match_option.filter_size_scan, 0.1);
         ros::param::param("bnb3d/debug_mode", match_option.debug_mode, false);
 
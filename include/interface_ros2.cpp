@@ -319,13 +319,32 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
     node->declare_parameter("ikdtree_reconstruct_keyframe_num", 10);
     node->declare_parameter("ikdtree_reconstruct_downsamp_size", 0.1f);
     node->declare_parameter("loop_closure_enable_flag", false);
-    node->declare_parameter("loop_closure_interval", 1000);
+    node->declare_parameter("loop_closure_max_backlog", 10);
+    node->declare_parameter("loop_closure_deadline", 3000.);
     node->declare_parameter("loop_keyframe_num_thld", 50);
     node->declare_parameter("loop_closure_search_radius", 10.f);
     node->declare_parameter("loop_closure_keyframe_interval", 30);
     node->declare_parameter("keyframe_search_num", 20);
     node->declare_parameter("loop_closure_fitness_score_thld", 0.05);
     node->declare_parameter("icp_downsamp_size", 0.1);
+    node->declare_parameter("loop_closure_coarse_resolutions", vector<double>({1.0, 0.5}));
+    node->declare_parameter("loop_closure_coarse_iterations", 20);
+    node->declare_parameter("loop_closure_coarse_fitness_score_thld", 1.0);
+    node->declare_parameter("loop_precheck_enable", true);
+    node->declare_parameter("loop_precheck_sc_dist_thld", 0.6f);
+    node->declare_parameter("loop_precheck_height_hist_thld", 0.5f);
+    node->declare_parameter("loop_precheck_height_hist_min_z", -1.0f);
+    node->declare_parameter("loop_precheck_height_hist_max_z", 9.0f);
+    node->declare_parameter("loop_precheck_height_hist_bin_size", 0.5f);
+    node->declare_parameter("loop_precheck_overlap_resolution", 2.0f);
+    node->declare_parameter("loop_precheck_overlap_thld", 0.f);
+    node->declare_parameter("loop_negative_cache_enable", true);
+    node->declare_parameter("loop_negative_cache_cell_size", 2.0f);
+    node->declare_parameter("loop_negative_cache_backoff", 5.0);
+    node->declare_parameter("loop_negative_cache_max_backoff", 120.0);
+    node->declare_parameter("loop_negative_cache_graph_change_dist", 0.5f);
+    node->declare_parameter("loop_negative_cache_graph_change_yaw", 0.05f);
+    node->declare_parameter("loop_closure_sc_top_k", 3);
     node->declare_parameter("manually_loop_vaild_period", vector<double>());
     node->declare_parameter("odom_loop_vaild_period", vector<double>());
     node->declare_parameter("scancontext_loop_vaild_period", vector<double>());
@@ -335,6 +354,19 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
     node->declare_parameter("map_path", "");
     node->declare_parameter("lidar_height", 2.0);
     node->declare_parameter("sc_dist_thres", 0.5);
+    node->declare_parameter("sc_num_ring", 20);
+    node->declare_parameter("sc_num_sector", 60);
+    node->declare_parameter("sc_max_radius", 80.0);
+    node->declare_parameter("sc_search_ratio", 0.2);
+    node->declare_parameter("sc_tree_candidates", 10);
+    node->declare_parameter("sc_relocalization_top_k", 3);
+    node->declare_parameter("sc_quantized_scoring_en", false);
+    node->declare_parameter("sc_quantized_rerank", 10);
+    node->declare_parameter("sc_ann_search_en", false);
+    node->declare_parameter("sc_ann_candidates", 10);
+    node->declare_parameter("sc_ann_nprobe", 8);
+    node->declare_parameter("sc_prior_radius", 200.0);
+    node->declare_parameter("sc_prior_gnss_timeout", 10.0);
 
     node->get_parameter("keyframe_add_dist_threshold", backend.backend->keyframe_add_dist_threshold);
     node->get_parameter("keyframe_add_angle_threshold", backend.backend->keyframe_add_angle_threshold);
@@ -354,13 +386,32 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
     node->get_parameter("ikdtree_reconstruct_downsamp_size", backend.backend->ikdtree_reconstruct_downsamp_size);
 
     node->get_parameter("loop_closure_enable_flag", backend.loop_closure_enable_flag);
-    node->get_parameter("loop_closure_interval", backend.loop_closure_interval);
+    node->get_parameter("loop_closure_max_backlog", backend.loop_closure_max_backlog);
+    node->get_parameter("loop_closure_deadline", backend.loop_closure_deadline);
     node->get_parameter("loop_keyframe_num_thld", backend.loopClosure->loop_keyframe_num_thld);
     node->get_parameter("loop_closure_search_radius", backend.loopClosure->loop_closure_search_radius);
     node->get_parameter("loop_closure_keyframe_interval", backend.loopClosure->loop_closure_keyframe_interval);
     node->get_parameter("keyframe_search_num", backend.loopClosure->keyframe_search_num);
     node->get_parameter("loop_closure_fitness_score_thld", backend.loopClosure->loop_closure_fitness_score_thld);
     node->get_parameter("icp_downsamp_size", backend.loopClosure->icp_downsamp_size);
+    node->get_parameter("loop_closure_coarse_resolutions", backend.loopClosure->coarse_resolutions);
+    node->get_parameter("loop_closure_coarse_iterations", backend.loopClosure->coarse_iterations);
+    node->get_parameter("loop_closure_coarse_fitness_score_thld", backend.loopClosure->coarse_fitness_score_thld);
+    node->get_parameter("loop_precheck_enable", backend.loopClosure->precheck_enable);
+    node->get_parameter("loop_precheck_sc_dist_thld", backend.loopClosure->precheck_sc_dist_thld);
+    node->get_parameter("loop_precheck_height_hist_thld", backend.loopClosure->precheck_height_hist_thld);
+    node->get_parameter("loop_precheck_height_hist_min_z", backend.loopClosure->precheck_height_hist_min_z);
+    node->get_parameter("loop_precheck_height_hist_max_z", backend.loopClosure->precheck_height_hist_max_z);
+    node->get_parameter("loop_precheck_height_hist_bin_size", backend.loopClosure->precheck_height_hist_bin_size);
+    node->get_parameter("loop_precheck_overlap_resolution", backend.loopClosure->precheck_overlap_resolution);
+    node->get_parameter("loop_precheck_overlap_thld", backend.loopClosure->precheck_overlap_thld);
+    node->get_parameter("loop_negative_cache_enable", backend.loopClosure->negative_cache_enable);
+    node->get_parameter("loop_negative_cache_cell_size", backend.loopClosure->negative_cache_cell_size);
+    node->get_parameter("loop_negative_cache_backoff", backend.loopClosure->negative_cache_backoff);
+    node->get_parameter("loop_negative_cache_max_backoff", backend.loopClosure->negative_cache_max_backoff);
+    node->get_parameter("loop_negative_cache_graph_change_dist", backend.loopClosure->negative_cache_graph_change_dist);
+    node->get_parameter("loop_negative_cache_graph_change_yaw", backend.loopClosure->negative_cache_graph_change_yaw);
+    node->get_parameter("loop_closure_sc_top_k", backend.loopClosure->sc_top_k);
     node->get_parameter("manually_loop_vaild_period", backend.loopClosure->loop_vaild_period["manually"]);
     node->get_parameter("odom_loop_vaild_period", backend.loopClosure->loop_vaild_period["odom"]);
     node->get_parameter("scancontext_loop_vaild_period", backend.loopClosure->loop_vaild_period["scancontext"]);
@@ -381,12 +432,31 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
 
     node->get_parameter("lidar_height", backend.relocalization->sc_manager->LIDAR_HEIGHT);
     node->get_parameter("sc_dist_thres", backend.relocalization->sc_manager->SC_DIST_THRES);
+    int sc_num_ring, sc_num_sector;
+    double sc_max_radius;
+    node->get_parameter("sc_num_ring", sc_num_ring);
+    node->get_parameter("sc_num_sector", sc_num_sector);
+    node->get_parameter("sc_max_radius", sc_max_radius);
+    if (!backend.relocalization->sc_manager->setGeometry(sc_num_ring, sc_num_sector, sc_max_radius))
+        LOG_ERROR("invalid scan context geometry, use %d x %d, %.0f m!", backend.relocalization->sc_manager->PC_NUM_RING,
+                  backend.relocalization->sc_manager->PC_NUM_SECTOR, backend.relocalization->sc_manager->PC_MAX_RADIUS);
+    node->get_parameter("sc_search_ratio", backend.relocalization->sc_manager->SEARCH_RATIO);
+    node->get_parameter("sc_tree_candidates", backend.relocalization->sc_manager->NUM_CANDIDATES_FROM_TREE);
+    node->get_parameter("sc_relocalization_top_k", backend.relocalization->sc_top_k);
+    node->get_parameter("sc_quantized_scoring_en", backend.relocalization->sc_manager->QUANTIZED_SCORING_EN);
+    node->get_parameter("sc_quantized_rerank", backend.relocalization->sc_manager->QUANTIZED_RERANK_CANDIDATES);
+    node->get_parameter("sc_ann_search_en", backend.relocalization->sc_manager->ANN_SEARCH_EN);
+    node->get_parameter("sc_ann_candidates", backend.relocalization->sc_manager->NUM_CANDIDATES_FROM_ANN);
+    node->get_parameter("sc_ann_nprobe", backend.relocalization->sc_manager->ANN_NPROBE);
+    node->get_parameter("sc_prior_radius", backend.relocalization->sc_prior_radius);
+    node->get_parameter("sc_prior_gnss_timeout", backend.relocalization->sc_prior_gnss_timeout);
 
     if (false)
     {
         node->declare_parameter("extrinsicT_imu2gnss", vector<double>());
         node->declare_parameter("extrinsicR_imu2gnss", vector<double>());
         node->declare_parameter("relocal_cfg_algorithm_type", "UNKONW");
+        node->declare_parameter("relocal_cfg_time_budget", 0.);
 
         node->get_parameter("extrinsicT_imu2gnss", extrinT);
         node->get_parameter("extrinsicR_imu2gnss", extrinR);
@@ -395,6 +465,7 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
         backend.relocalization->set_extrinsic(extrinT_eigen, extrinR_eigen);
 
         node->get_parameter("relocal_cfg_algorithm_type", backend.relocalization->algorithm_type);
+        node->get_parameter("relocal_cfg_time_budget", backend.relocalization->time_budget_ms);
 
         BnbOptions match_option;
         node->declare_parameter("bnb3d_linear_xy_window_size", 10.);
@@ -406,7 +477,7 @@ void load_parameters(rclcpp::Node::SharedPtr &node)
         node->declare_parameter("bnb3d_enough_score", 0.8);
         node->declare_parameter("bnb3d_min_xy_resolution", 0.2);
         node->declare_parameter("bnb3d_min_z_resolution", 0.1);
-        node->declare_parameter("bnb3d_min_angular_resolution", 0.1);
+        node->declare_parameter("bnb3d_min_angular_resolution", 1.);
         node->declare_parameter("bnb3d_filter_size_scan", 0.1);
         node->declare_parameter("bnb3d_debug_mode", false);
 
@@ -0,0 +1,307 @@
+#pragma once
+#include <omp.h>
+#include <atomic>
+#include <set>
+#include "Header.h"
+#include "pgo/FactorGraphOptimization.hpp"
+#include "pgo/LoopClosure.hpp"
+#include "global_localization/scancontext/Scancontext.h"
+
+struct LoopCandidate
+{
+    int loop_key_cur;
+    int loop_key_ref;
+    float sc_dist;
+    float sc_yaw_rad;
+};
+
+struct LoopFactor
+{
+    int loop_key_cur;
+    int loop_key_ref;
+    gtsam::Pose3 pose_between;
+    float noise_score;
+};
+
+/**
+ * 离线闭环检测：对已保存的地图，所有关键帧两两之间做scan context检索，并行配准验证，把新的闭环因子写入factor_graph.fg
+ */
+class LoopDiscovery
+{
+public:
+    LoopDiscovery()
+    {
+        keyframe_pose6d.reset(new pcl::PointCloud<PointXYZIRPYT>());
+        sc_manager = std::make_shared<ScanContext::SCManager>();
+        loop_closure = std::make_shared<LoopClosure>(sc_manager);
+        num_workers = omp_get_max_threads();
+    }
+
+    bool load_map(const std::string &path)
+    {
+        map_path = path;
+        string trajectory_path = path + "/trajectory.pcd";
+        string keyframe_path = path + "/keyframe/";
+        string scd_path = path + "/scancontext/";
+
+        Timer timer;
+        if (pcl::io::loadPCDFile(trajectory_path, *keyframe_pose6d) == -1 || keyframe_pose6d->empty())
+        {
+            LOG_ERROR("load trajectory failed, path = %s!", trajectory_path.c_str());
+            return false;
+        }
+        int keyframe_num = keyframe_pose6d->size();
+
+        if (!sc_manager->loadDatabase(scd_path + ScanContext::SCManager::DATABASE_FILENAME, keyframe_num))
+        {
+            int scd_file_count = FileOperation::getFilesNumByExtension(scd_path, ".scd");
+            if (scd_file_count != keyframe_num)
+            {
+                LOG_ERROR("scd_file_count != trajectory_poses! %d, %d", scd_file_count, keyframe_num);
+                return false;
+            }
+            int num_digits = FileOperation::getOneFilenameByExtension(scd_path, ".scd").length() - std::string(".scd").length();
+            sc_manager->loadPriorSCD(scd_path, num_digits, keyframe_num);
+        }
+
+        keyframe_scan.resize(keyframe_num);
+#pragma omp parallel for num_threads(num_workers) schedule(dynamic, 16)
+        for (int i = 0; i < keyframe_num; ++i)
+        {
+            keyframe_scan[i].reset(new PointCloudType());
+            load_keyframe(keyframe_path, keyframe_scan[i], i);
+            octreeDownsampling(keyframe_scan[i], keyframe_scan[i], keyframe_downsample);
+        }
+
+        load_existing_loops(path + "/factor_graph.fg");
+        loop_closure->copy_keyframe_pose6d = keyframe_pose6d;
+        LOG_WARN("Load map successfully! keyframes = %d, existing loops = %lu, time = %.2f ms.", keyframe_num, existing_loops.size(), timer.elapsedLast());
+        return true;
+    }
+
+    /**
+     * 并行scan context检索：每个关键帧在ring-key树中只查询早于它loop_closure_keyframe_interval以上的关键帧，
+     * 计算scan context距离，保留距离小于阈值的最好的max_candidates_per_keyframe个
+     */
+    void retrieve_candidates()
+    {
+        Timer timer;
+        candidates.clear();
+        int keyframe_num = keyframe_pose6d->size();
+        InvKeyTree tree(sc_manager->polarcontexts_.ringKeys(), keyframe_num, 10, sc_manager->PC_NUM_RING);
+
+        std::vector<std::vector<LoopCandidate>> thread_candidates(num_workers);
+#pragma omp parallel for num_threads(num_workers) schedule(dynamic, 64)
+        for (int i = 0; i < keyframe_num; ++i)
+        {
+            // 时间上相邻的关键帧在查询时就排除，不占用knn的名额
+            const int max_index = i - loop_closure->loop_closure_keyframe_interval;
+            if (max_index <= 0)
+                continue;
+
+            auto &local_candidates = thread_candidates[omp_get_thread_num()];
+            std::vector<size_t> indexes(num_candidates_per_keyframe);
+            std::vector<float> dists_sqr(num_candidates_per_keyframe);
+            KNNResultSetBelowIndex<float> knn_result(num_candidates_per_keyframe, max_index);
+            knn_result.init(&indexes[0], &dists_sqr[0]);
+            tree.index->findNeighbors(knn_result, sc_manager->polarcontexts_.ringKey(i).data(), nanoflann::SearchParams(10));
+
+            std::vector<LoopCandidate> keyframe_candidates;
+            for (auto k = 0; k < knn_result.size(); ++k)
+            {
+                int j = indexes[k];
+                if (existing_loops.count(std::make_pair(i, j)))
+                    continue;
+
+                auto sc_res = sc_manager->distanceBtnKeyframes(i, j);
+                if (sc_res.first < sc_manager->SC_DIST_THRES)
+                    keyframe_candidates.push_back({i, j, (float)sc_res.first, (float)DEG2RAD(sc_res.second * sc_manager->PC_UNIT_SECTORANGLE)});
+            }
+            std::sort(keyframe_candidates.begin(), keyframe_candidates.end(), [](const LoopCandidate &a, const LoopCandidate &b)
+                      { return a.sc_dist < b.sc_dist; });
+            if (keyframe_candidates.size() > max_candidates_per_keyframe)
+                keyframe_candidates.resize(max_candidates_per_keyframe);
+            local_candidates.insert(local_candidates.end(), keyframe_candidates.begin(), keyframe_candidates.end());
+        }
+
+        for (auto &local_candidates : thread_candidates)
+            candidates.insert(candidates.end(), local_candidates.begin(), local_candidates.end());
+        std::sort(candidates.begin(), candidates.end(), [](const LoopCandidate &a, const LoopCandidate &b)
+                  { return a.loop_key_cur != b.loop_key_cur ? a.loop_key_cur < b.loop_key_cur : a.sc_dist < b.sc_dist; });
+        LOG_WARN("scan context retrieval finished! candidates = %lu, time = %.2f ms.", candidates.size(), timer.elapsedLast());
+    }
+
+    /**
+     * 配准工作池：每个候选独立做预检和由粗到精的gicp，动态调度保证负载均衡
+     */
+    void verify_candidates()
+    {
+        Timer timer;
+        loop_factors.clear();
+        std::atomic<int> finished_num(0);
+        std::atomic<int> rejected_num(0);
+        std::vector<std::vector<LoopFactor>> thread_factors(num_workers);
+
+#pragma omp parallel for num_threads(num_workers) schedule(dynamic, 1)
+        for (int i = 0; i < (int)candidates.size(); ++i)
+        {
+            LoopFactor factor;
+            if (verify_candidate(candidates[i], factor))
+                thread_factors[omp_get_thread_num()].emplace_back(factor);
+            else
+                ++rejected_num;
+
+            int finished = ++finished_num;
+            if (finished % 100 == 0)
+                LOG_INFO("verified %d / %lu candidates, rejected = %d.", finished, candidates.size(), rejected_num.load());
+        }
+
+        for (auto &local_factors : thread_factors)
+            loop_factors.insert(loop_factors.end(), local_factors.begin(), local_factors.end());
+        std::sort(loop_factors.begin(), loop_factors.end(), [](const LoopFactor &a, const LoopFactor &b)
+                  { return a.loop_key_cur < b.loop_key_cur; });
+        LOG_WARN("verification finished! loops = %lu, rejected = %d, time = %.2f ms.", loop_factors.size(), rejected_num.load(), timer.elapsedLast());
+    }
+
+    /**
+     * 新的闭环因子追加到factor_graph.fg中，原文件备份为factor_graph.fg.bak
+     */
+    bool save_loop_factors()
+    {
+        string fg_path = map_path + "/factor_graph.fg";
+        std::ifstream ifs(fg_path);
+        if (!ifs.is_open())
+        {
+            LOG_ERROR("open factor graph failed, path = %s!", fg_path.c_str());
+            return false;
+        }
+
+        std::vector<std::string> vertex_lines, edge_lines;
+        std::string line;
+        while (std::getline(ifs, line))
+        {
+            if (line.compare(0, 7, "VERTEX ") == 0)
+                vertex_lines.emplace_back(line);
+            else if (line.compare(0, 5, "EDGE ") == 0)
+                edge_lines.emplace_back(line);
+        }
+        ifs.close();
+        fs::copy_file(fg_path, fg_path + ".bak", fs::copy_options::overwrite_existing);
+
+        FILE *ofs = fopen(fg_path.c_str(), "w");
+        fprintf(ofs, "VERTEX_SIZE: %ld\n", vertex_lines.size());
+        for (const auto &vertex : vertex_lines)
+            fprintf(ofs, "%s\n", vertex.c_str());
+        fprintf(ofs, "EDGE_SIZE: %ld\n", edge_lines.size() + loop_factors.size());
+        for (const auto &edge : edge_lines)
+            fprintf(ofs, "%s\n", edge.c_str());
+        for (const auto &factor : loop_factors)
+        {
+            const auto &value = factor.pose_between;
+            double noise = std::sqrt(factor.noise_score);
+            fprintf(ofs, "EDGE %d: %d %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
+                    GtsamFactor::Loop, factor.loop_key_cur, factor.loop_key_ref,
+                    value.x(), value.y(), value.z(),
+                    value.rotation().roll(), value.rotation().pitch(), value.rotation().yaw(),
+                    noise, noise, noise, noise, noise, noise);
+        }
+        fclose(ofs);
+        LOG_WARN("Success save %lu loop factors to %s.", loop_factors.size(), fg_path.c_str());
+        return true;
+    }
+
+private:
+    bool verify_candidate(const LoopCandidate &candidate, LoopFactor &factor) const
+    {
+        const int &loop_key_cur = candidate.loop_key_cur;
+        const int &loop_key_ref = candidate.loop_key_ref;
+
+        PointCloudType::Ptr cur_keyframe_cloud = pointcloudKeyframeToWorld(keyframe_scan[loop_key_cur], keyframe_pose6d->points[loop_key_cur]);
+        PointCloudType::Ptr ref_near_keyframe_cloud(new PointCloudType());
+        for (int i = -loop_closure->keyframe_search_num; i <= loop_closure->keyframe_search_num; ++i)
+        {
+            int key_near = loop_key_ref + i;
+            if (key_near < 0 || key_near >= keyframe_pose6d->size())
+                continue;
+            *ref_near_keyframe_cloud += *pointcloudKeyframeToWorld(keyframe_scan[key_near], keyframe_pose6d->points[key_near]);
+        }
+        octreeDownsampling(cur_keyframe_cloud, cur_keyframe_cloud, loop_closure->icp_downsamp_size);
+        octreeDownsampling(ref_near_keyframe_cloud, ref_near_keyframe_cloud, loop_closure->icp_downsamp_size);
+        if (cur_keyframe_cloud->size() < 300 || ref_near_keyframe_cloud->size() < 1000)
+            return false;
+
+        const auto &pose_ref = keyframe_pose6d->points[loop_key_ref];
+        Eigen::Matrix4f pose_ref_mat = EigenMath::CreateAffineMatrix(V3D(pose_ref.x, pose_ref.y, pose_ref.z), V3D(pose_ref.roll, pose_ref.pitch, pose_ref.yaw + candidate.sc_yaw_rad)).cast<float>();
+        const auto &pose_cur = keyframe_pose6d->points[loop_key_cur];
+        Eigen::Matrix4f pose_cur_mat = EigenMath::CreateAffineMatrix(V3D(pose_cur.x, pose_cur.y, pose_cur.z), V3D(pose_cur.roll, pose_cur.pitch, pose_cur.yaw)).cast<float>();
+        Eigen::Matrix4f init_guess = pose_cur_mat.inverse() * pose_ref_mat;
+
+        if (loop_closure->precheck_enable &&
+            loop_closure->voxel_overlap_ratio(cur_keyframe_cloud, ref_near_keyframe_cloud, init_guess) < loop_closure->precheck_overlap_thld)
+            return false;
+
+        Eigen::Matrix4f final_transform;
+        float fitness_score;
+        if (!loop_closure->coarse_to_fine_registration(cur_keyframe_cloud, ref_near_keyframe_cloud, init_guess, final_transform, fitness_score, "offline"))
+            return false;
+
+        float x, y, z, roll, pitch, yaw;
+        Eigen::Affine3f correctionLidarFrame;
+        correctionLidarFrame = final_transform;
+        Eigen::Affine3f tWrong = pclPointToAffine3f(pose_cur);
+        Eigen::Affine3f tCorrect = correctionLidarFrame * tWrong;
+        pcl::getTranslationAndEulerAngles(tCorrect, x, y, z, roll, pitch, yaw);
+        gtsam::Pose3 poseFrom = gtsam::Pose3(gtsam::Rot3::RzRyRx(roll, pitch, yaw), gtsam::Point3(x, y, z));
+        gtsam::Pose3 poseTo = pclPointTogtsamPose3(pose_ref);
+
+        factor.loop_key_cur = loop_key_cur;
+        factor.loop_key_ref = loop_key_ref;
+        factor.pose_between = poseFrom.between(poseTo);
+        factor.noise_score = fitness_score;
+        return true;
+    }
+
+    void load_existing_loops(const std::string &fg_path)
+    {
+        existing_loops.clear();
+        std::ifstream ifs(fg_path);
+        std::string line;
+        int factor_type, index_from, index_to;
+        while (std::getline(ifs, line))
+        {
+            if (sscanf(line.c_str(), "EDGE %d: %d %d", &factor_type, &index_from, &index_to) == 3 && factor_type == GtsamFactor::Loop)
+                existing_loops.emplace(index_from, index_to);
+        }
+    }
+
+    void load_keyframe(const std::string &keyframe_path, PointCloudType::Ptr keyframe_pc, int keyframe_cnt, int num_digits = 6)
+    {
+        std::ostringstream out;
+        out << std::internal << std::setfill('0') << std::setw(num_digits) << keyframe_cnt;
+        std::string keyframe_idx = out.str();
+        string keyframe_file(keyframe_path + keyframe_idx + string(".pcd"));
+        pcl::PointCloud<pcl::PointXYZI>::Ptr tmp_pc(new pcl::PointCloud<pcl::PointXYZI>());
+        pcl::io::loadPCDFile(keyframe_file, *tmp_pc);
+        keyframe_pc->points.resize(tmp_pc->points.size());
+        for (auto i = 0; i < tmp_pc->points.size(); ++i)
+        {
+            pcl::copyPoint(tmp_pc->points[i], keyframe_pc->points[i]);
+        }
+    }
+
+public:
+    int num_workers;
+    int num_candidates_per_keyframe = 10; // ring-key树的knn数量
+    size_t max_candidates_per_keyframe = 3; // 每个关键帧最多验证的候选数量
+    float keyframe_downsample = 0.2;
+
+    std::string map_path;
+    pcl::PointCloud<PointXYZIRPYT>::Ptr keyframe_pose6d;
+    std::vector<PointCloudType::Ptr> keyframe_scan;
+    std::shared_ptr<ScanContext::SCManager> sc_manager;
+    std::shared_ptr<LoopClosure> loop_closure; // loop params and registration
+
+    std::set<std::pair<int, int>> existing_loops;
+    std::vector<LoopCandidate> candidates;
+    std::vector<LoopFactor> loop_factors;
+};
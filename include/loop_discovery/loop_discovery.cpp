@@ -0,0 +1,43 @@
+#include "loop_discovery/LoopDiscovery.hpp"
+
+FILE *location_log = nullptr;
+
+void usage(const char *prog)
+{
+    printf("usage: %s <map_path> [num_workers] [sc_dist_thld] [fitness_score_thld]\n", prog);
+    printf("  map_path            saved map directory (trajectory.pcd, keyframe/, scancontext/, factor_graph.fg)\n");
+    printf("  num_workers         registration threads, default = all cores\n");
+    printf("  sc_dist_thld        scan context distance threshold, default = 0.5\n");
+    printf("  fitness_score_thld  gicp fitness score threshold, default = 0.05\n");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LoopDiscovery loop_discovery;
+    if (argc > 2)
+        loop_discovery.num_workers = std::max(1, std::atoi(argv[2]));
+    if (argc > 3)
+        loop_discovery.sc_manager->SC_DIST_THRES = std::atof(argv[3]);
+    if (argc > 4)
+        loop_discovery.loop_closure->loop_closure_fitness_score_thld = std::atof(argv[4]);
+    LOG_WARN("loop discovery: map = %s, workers = %d, sc_dist_thld = %.2f, fitness_score_thld = %.2f.", argv[1], loop_discovery.num_workers,
+             loop_discovery.sc_manager->SC_DIST_THRES, loop_discovery.loop_closure->loop_closure_fitness_score_thld);
+
+    Timer timer;
+    if (!loop_discovery.load_map(argv[1]))
+        return 1;
+
+    loop_discovery.retrieve_candidates();
+    loop_discovery.verify_candidates();
+    if (!loop_discovery.save_loop_factors())
+        return 1;
+
+    LOG_WARN("loop discovery finished! total time = %.2f s.", timer.elapsedStart() / 1000);
+    return 0;
+}
@@ -62,7 +62,7 @@ public:
             *global_map += *pointcloudKeyframeToWorld(keyframe_pc, (*keyframe_pose6d_prior)[i]);
         }
         octreeDownsampling(global_map, global_map, 0.3);
-        if (!relocalization->load_prior_map(global_map))
+        if (!relocalization->load_prior_map(global_map, path))
         {
             std::exit(100);
         }
@@ -273,11 +273,26 @@ public:
         // 3.descriptor
         for (auto i = 0; i < relocalization->sc_manager->polarcontexts_.size(); ++i)
         {
-            saveSCD(relocalization->sc_manager->polarcontexts_[i], i, scd_path);
+            saveSCD(relocalization->sc_manager->polarcontexts_.descriptor(i), i, scd_path);
         }
         for (auto i = 0; i < sc_manager_stitch->polarcontexts_.size(); ++i)
         {
-            saveSCD(sc_manager_stitch->polarcontexts_[i], i + keyframe_scan_prior.size(), scd_path);
+            saveSCD(sc_manager_stitch->polarcontexts_.descriptor(i), i + keyframe_scan_prior.size(), scd_path);
+        }
+        {
+            ScanContext::SCManager sc_manager_merged;
+            const auto &sc_prior = relocalization->sc_manager;
+            sc_manager_merged.setGeometry(sc_prior->PC_NUM_RING, sc_prior->PC_NUM_SECTOR, sc_prior->PC_MAX_RADIUS);
+            std::vector<float> record(sc_manager_merged.polarcontexts_.recordSize());
+            for (const auto &manager : {relocalization->sc_manager, sc_manager_stitch})
+            {
+                for (auto i = 0; i < manager->polarcontexts_.size(); ++i)
+                {
+                    manager->polarcontexts_.copyRecord(i, record.data());
+                    sc_manager_merged.polarcontexts_.pushBackRecord(record.data());
+                }
+            }
+            sc_manager_merged.saveDatabase(scd_path + ScanContext::SCManager::DATABASE_FILENAME);
         }
 
         // 4.init_values/gtsam_factors
@@ -445,7 +460,7 @@ private:
     {
         int loop_key_cur = index;
 
-        auto detectResult = relocalization->sc_manager->detectClosestKeyframeID(0, sc_manager_stitch->polarcontext_invkeys_mat_[loop_key_cur], sc_manager_stitch->polarcontexts_[loop_key_cur]);
+        auto detectResult = relocalization->sc_manager->detectClosestKeyframeID(0, sc_manager_stitch->polarcontexts_.ringKey(loop_key_cur), sc_manager_stitch->polarcontexts_.descriptor(loop_key_cur));
         // first: nn index, second: yaw diff
         int loop_key_ref = detectResult.first;
         float sc_yaw_rad = detectResult.second; // sc2右移 <=> lidar左转 <=> 左+sc_yaw_rad
@@ -536,6 +551,9 @@ private:
 
         num_digits = FileOperation::getOneFilenameByExtension(path, ".scd").length() - std::string(".scd").length();
 
+        // 两张地图的描述子必须用相同的几何参数比较，文本.scd不记录几何参数，沿用先验地图的
+        const auto &sc_prior = relocalization->sc_manager;
+        sc_manager_stitch->setGeometry(sc_prior->PC_NUM_RING, sc_prior->PC_NUM_SECTOR, sc_prior->PC_MAX_RADIUS);
         sc_manager_stitch->loadPriorSCD(path, num_digits, keyframe_pose6d_stitch->size());
         return true;
     }
@@ -664,7 +682,7 @@ private:
         savePCDFile(keyframe_file, *scan);
     }
 
-    void saveSCD(const Eigen::MatrixXd &scd, int index, const std::string &save_path, int num_digits = 6, const std::string &delimiter = " ")
+    void saveSCD(const ScanContext::SCDescriptorRef &scd, int index, const std::string &save_path, int num_digits = 6, const std::string &delimiter = " ")
     {
         std::ostringstream out;
         out << std::internal << std::setfill('0') << std::setw(num_digits) << index;
@@ -131,6 +131,12 @@ int main(int argc, char **argv)
     ros::param::param("mapping/odom_loop_vaild_period", map_stitch.loop_vaild_period["odom"], vector<double>());
     ros::param::param("mapping/scancontext_loop_vaild_period", map_stitch.loop_vaild_period["scancontext"], vector<double>());
 
+    int sc_num_ring, sc_num_sector;
+    double sc_max_radius;
+    ros::param::param("scan_context/num_ring", sc_num_ring, 20);
+    ros::param::param("scan_context/num_sector", sc_num_sector, 60);
+    ros::param::param("scan_context/max_radius", sc_max_radius, 80.0);
+    map_stitch.relocalization->sc_manager->setGeometry(sc_num_ring, sc_num_sector, sc_max_radius);
     ros::param::param("scan_context/lidar_height", map_stitch.relocalization->sc_manager->LIDAR_HEIGHT, 2.0);
     ros::param::param("scan_context/sc_dist_thres", map_stitch.relocalization->sc_manager->SC_DIST_THRES, 0.5);
 
@@ -145,6 +151,7 @@ int main(int argc, char **argv)
     map_stitch.relocalization->set_extrinsic(extrinT_eigen, extrinR_eigen);
 
     ros::param::param("relocalization_cfg/algorithm_type", map_stitch.relocalization->algorithm_type, std::string("UNKONW"));
+    ros::param::param("relocalization_cfg/time_budget", map_stitch.relocalization->time_budget_ms, 0.);
 
     BnbOptions match_option;
     ros::param::param("bnb3d/linear_xy_window_size", match_option.linear_xy_window_size, 10.);
@@ -156,7 +163,7 @@ int main(int argc, char **argv)
     ros::param::param("bnb3d/enough_score", match_option.enough_score, 0.8);
     ros::param::param("bnb3d/min_xy_resolution", match_option.min_xy_resolution, 0.2);
     ros::param::param("bnb3d/min_z_resolution", match_option.min_z_resolution, 0.1);
-    ros::param::param("bnb3d/min_angular_resolution", match_option.min_angular_resolution, 0.1);
+    ros::param::param("bnb3d/min_angular_resolution", match_option.min_angular_resolution, 1.);
     ros::param::param("bnb3d/filter_size_scan", match_option.filter_size_scan, 0.1);
     ros::param::param("bnb3d/debug_mode", match_option.debug_mode, false);
 
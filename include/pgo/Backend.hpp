@@ -2,12 +2,36 @@
 #include <omp.h>
 #include <math.h>
 #include <thread>
+#include <condition_variable>
+#include <functional>
+#include <future>
 #include "FactorGraphOptimization.hpp"
 #include "LoopClosure.hpp"
 #include "../Header.h"
 #include "../global_localization/Relocalization.hpp"
 #include "../utility/Pcd2Pgm.hpp"
 
+struct LoopQueueMetrics
+{
+    double last_lag = 0;   // ms, time from keyframe enqueued to loop detection start
+    double max_lag = 0;    // ms
+    int pending_num = 0;   // keyframes waiting in queue
+    int processed_num = 0;
+    int coalesced_num = 0; // dropped by backlog coalescing
+    int expired_num = 0;   // dropped by deadline
+};
+
+struct RelocalizationResult
+{
+    bool success = false;
+    bool cancelled = false; // 被更新的请求取消(没开始或提前结束)，或Backend析构时还没有完成
+    double lidar_beg_time = 0;
+    Eigen::Matrix4d imu_pose = Eigen::Matrix4d::Identity();
+    RelocalizationReport report;
+};
+
+using RelocalizationCallback = std::function<void(const RelocalizationResult &)>;
+
 class Backend
 {
 public:
@@ -28,8 +52,23 @@ public:
 
     ~Backend()
     {
+        {
+            std::lock_guard<std::mutex> lock(loop_queue_mtx);
+            loop_thread_exit = true;
+        }
+        loop_queue_cv.notify_all();
         if (loopthread.joinable())
             loopthread.join();
+
+        {
+            std::lock_guard<std::mutex> lock(relocalization_mtx);
+            relocalization_thread_exit = true;
+            relocalization_cancel = true;
+        }
+        relocalization_cv.notify_all();
+        // 重定位线程退出前取消所有还没处理的请求
+        if (relocalization_thread.joinable())
+            relocalization_thread.join();
     }
 
     void init_system_mode()
@@ -69,9 +108,18 @@ public:
 
             loopClosure->get_loop_constraint(loop_constraint);
             backend->run(loop_constraint, this_pose6d, submap_fix);
+
+            if (loop_closure_enable_flag && !test_mode)
+                push_loop_request(keyframe_pose6d_unoptimized->size() - 1);
         }
     }
 
+    LoopQueueMetrics get_loop_queue_metrics()
+    {
+        std::lock_guard<std::mutex> lock(loop_queue_mtx);
+        return loop_queue_metrics;
+    }
+
     void save_globalmap()
     {
         auto keyframe_num = keyframe_scan->size();
@@ -280,13 +328,55 @@ public:
         return globalMapKeyFramesDS;
     }
 
+    // 阻塞直到重定位结束
     bool run_relocalization(PointCloudType::Ptr scan, const double &lidar_beg_time, Eigen::Matrix4d &imu_pose)
     {
-        run_relocalization_thread = true;
-        if (relocalization->run(scan, imu_pose, lidar_beg_time))
-            return true;
-        run_relocalization_thread = false;
-        return false;
+        const RelocalizationResult result = submit_relocalization(scan, lidar_beg_time).get();
+        if (result.success)
+            imu_pose = result.imu_pose;
+        return result.success;
+    }
+
+    /**
+     * @brief 异步重定位：请求交给重定位线程后立即返回，调用者可以继续处理传感器数据。
+     * 只保留最新的请求，新请求会取消还没开始的旧请求，正在运行的旧请求在下一次检查截止时间时提前结束(结果的cancelled = true)
+     *
+     * @param[in] prior  非空时作为初始位姿(imu pose)，同set_init_pose
+     * @param[in] callback  非空时在重定位线程中以结果调用，先于future就绪(包括被取消的请求)，
+     *                      只有Backend析构之后才提交的请求会在调用线程中以取消结果调用
+     */
+    std::future<RelocalizationResult> submit_relocalization(PointCloudType::Ptr scan, const double &lidar_beg_time,
+                                                            const Pose *prior = nullptr, RelocalizationCallback callback = nullptr)
+    {
+        auto request = std::make_shared<RelocalizationRequest>();
+        request->scan = scan;
+        request->lidar_beg_time = lidar_beg_time;
+        request->has_prior = prior != nullptr;
+        if (prior)
+            request->prior = *prior;
+        request->callback = std::move(callback);
+        auto future = request->promise.get_future();
+
+        bool exited = false;
+        {
+            std::lock_guard<std::mutex> lock(relocalization_mtx);
+            exited = relocalization_thread_exit;
+            if (!exited)
+            {
+                if (!relocalization_thread.joinable())
+                    relocalization_thread = std::thread(&Backend::relocalizationThread, this);
+                // 被替换的请求交给重定位线程取消，保证回调总在重定位线程中调用
+                if (pending_relocalization)
+                    cancelled_relocalization.emplace_back(std::move(pending_relocalization));
+                pending_relocalization = request;
+                relocalization_cancel = true; // 正在运行的请求已经过时
+            }
+        }
+        if (exited)
+            cancel_relocalization_request(*request);
+        else
+            relocalization_cv.notify_one();
+        return future;
     }
 
 private:
@@ -321,6 +411,99 @@ private:
         savePCDFile(keyframe_file, *cloud);
     }
 
+    using LoopRequest = std::pair<int, std::chrono::steady_clock::time_point>; // <keyframe id, enqueue time>
+
+    void push_loop_request(int keyframe_id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(loop_queue_mtx);
+            loop_queue.emplace_back(keyframe_id, std::chrono::steady_clock::now());
+        }
+        loop_queue_cv.notify_one();
+    }
+
+    /**
+     * 积压过多时(如高速行驶或闭环线程被长时间占用)，均匀抽取不超过loop_closure_max_backlog个关键帧，最新关键帧总是保留
+     */
+    void coalesce_loop_requests(std::vector<LoopRequest> &requests)
+    {
+        if (loop_closure_max_backlog <= 0 || requests.size() <= loop_closure_max_backlog)
+            return;
+
+        int stride = (requests.size() + loop_closure_max_backlog - 1) / loop_closure_max_backlog;
+        std::vector<LoopRequest> coalesced;
+        for (int i = requests.size() - 1; i >= 0; i -= stride)
+            coalesced.emplace_back(requests[i]);
+        std::reverse(coalesced.begin(), coalesced.end());
+
+        loop_queue_metrics.coalesced_num += requests.size() - coalesced.size();
+        requests.swap(coalesced);
+    }
+
+    struct RelocalizationRequest
+    {
+        PointCloudType::Ptr scan;
+        double lidar_beg_time = 0;
+        bool has_prior = false;
+        Pose prior;
+        RelocalizationCallback callback;
+        std::promise<RelocalizationResult> promise;
+    };
+
+    static void finish_relocalization_request(RelocalizationRequest &request, const RelocalizationResult &result)
+    {
+        if (request.callback)
+            request.callback(result);
+        request.promise.set_value(result);
+    }
+
+    static void cancel_relocalization_request(RelocalizationRequest &request)
+    {
+        RelocalizationResult result;
+        result.cancelled = true;
+        result.lidar_beg_time = request.lidar_beg_time;
+        finish_relocalization_request(request, result);
+    }
+
+    void relocalizationThread()
+    {
+        while (true)
+        {
+            std::shared_ptr<RelocalizationRequest> request;
+            std::vector<std::shared_ptr<RelocalizationRequest>> cancelled;
+            bool exit = false;
+            {
+                std::unique_lock<std::mutex> lock(relocalization_mtx);
+                relocalization_cv.wait(lock, [this]
+                                       { return relocalization_thread_exit || pending_relocalization || !cancelled_relocalization.empty(); });
+                cancelled.swap(cancelled_relocalization);
+                exit = relocalization_thread_exit;
+                if (exit && pending_relocalization)
+                    cancelled.emplace_back(std::move(pending_relocalization));
+                else
+                    request.swap(pending_relocalization);
+                relocalization_cancel = exit;
+            }
+            for (auto &cancelled_request : cancelled)
+                cancel_relocalization_request(*cancelled_request);
+            if (exit)
+                break;
+            if (!request)
+                continue;
+
+            RelocalizationResult result;
+            result.lidar_beg_time = request->lidar_beg_time;
+            if (request->has_prior)
+                relocalization->set_init_pose(request->prior);
+            result.success = relocalization->run(request->scan, result.imu_pose, request->lidar_beg_time, &relocalization_cancel);
+            result.report = relocalization->report;
+            // 只有被取消截断了某个阶段才算取消，预算超时或结束之后才到的新请求不影响本次结果
+            result.cancelled = result.report.cancelled;
+            last_relocalization_success = result.success;
+            finish_relocalization_request(*request, result);
+        }
+    }
+
     void loopClosureThread()
     {
         if (loop_closure_enable_flag == false)
@@ -329,15 +512,56 @@ private:
         LOG_WARN("loop closure enabled!");
         while (test_mode == false)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(loop_closure_interval));
+            std::vector<LoopRequest> requests;
+            {
+                std::unique_lock<std::mutex> lock(loop_queue_mtx);
+                loop_queue_cv.wait(lock, [this] { return loop_thread_exit || !loop_queue.empty(); });
+                if (loop_thread_exit)
+                    break;
+                requests.assign(loop_queue.begin(), loop_queue.end());
+                loop_queue.clear();
+                coalesce_loop_requests(requests);
+            }
+
             backend->get_keyframe_pose6d(loopClosure->copy_keyframe_pose6d);
-            loopClosure->run(*keyframe_scan);
+            for (auto i = 0; i < requests.size(); ++i)
+            {
+                const auto &request = requests[i];
+                double lag = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - request.second).count();
+
+                // deadline-aware: 排队超时的旧关键帧直接丢弃，最新关键帧总是检测
+                bool expired = loop_closure_deadline > 0 && lag > loop_closure_deadline && i + 1 < requests.size();
+                LoopQueueMetrics metrics;
+                {
+                    std::lock_guard<std::mutex> lock(loop_queue_mtx);
+                    loop_queue_metrics.last_lag = lag;
+                    loop_queue_metrics.max_lag = std::max(loop_queue_metrics.max_lag, lag);
+                    loop_queue_metrics.pending_num = loop_queue.size();
+                    if (expired)
+                        ++loop_queue_metrics.expired_num;
+                    else
+                        ++loop_queue_metrics.processed_num;
+                    metrics = loop_queue_metrics;
+                }
+                if ((metrics.processed_num + metrics.expired_num) % 100 == 0)
+                {
+                    LOG_INFO("loop queue: lag (last, max) = (%.1f, %.1f) ms, pending = %d, processed = %d, dropped by (coalescing, deadline) = (%d, %d).",
+                             metrics.last_lag, metrics.max_lag, metrics.pending_num, metrics.processed_num, metrics.coalesced_num, metrics.expired_num);
+                }
+                if (expired)
+                {
+                    LOG_DEBUG("loop request of keyframe %d expired, lag = %.1f ms.", request.first, lag);
+                    continue;
+                }
+
+                loopClosure->run(*keyframe_scan, request.first);
+            }
         }
     }
 
 public:
     bool loop_closure_enable_flag = false;
-    bool run_relocalization_thread = false;
+    std::atomic<bool> last_relocalization_success{false};
     std::thread relocalization_thread;
 
     /*** sensor data processor ***/
@@ -348,7 +572,8 @@ public:
     shared_ptr<LoopClosure> loopClosure;
     shared_ptr<Relocalization> relocalization;
 
-    int loop_closure_interval = 300;
+    int loop_closure_max_backlog = 10; // max keyframes checked per wakeup
+    double loop_closure_deadline = 3000; // ms, queued keyframes older than it are dropped
     std::thread loopthread;
     LoopConstraint loop_constraint;
     bool test_mode = false;
@@ -369,4 +594,20 @@ public:
     string trajectory_path = PCD_FILE_DIR("trajectory.pcd");
     string keyframe_path = PCD_FILE_DIR("keyframe/");
     string scd_path = PCD_FILE_DIR("scancontext/");
+
+private:
+    /*** loop closure scheduling ***/
+    std::deque<LoopRequest> loop_queue;
+    std::mutex loop_queue_mtx;
+    std::condition_variable loop_queue_cv;
+    bool loop_thread_exit = false;
+    LoopQueueMetrics loop_queue_metrics;
+
+    /*** relocalization service ***/
+    std::shared_ptr<RelocalizationRequest> pending_relocalization; // 只保留最新的请求
+    std::vector<std::shared_ptr<RelocalizationRequest>> cancelled_relocalization; // 被新请求替换，等待重定位线程取消
+    std::mutex relocalization_mtx;
+    std::condition_variable relocalization_cv;
+    std::atomic<bool> relocalization_cancel{false};
+    bool relocalization_thread_exit = false;
 };
@@ -1,11 +1,32 @@
 #pragma once
+#include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 #include <pcl/search/kdtree.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/registration/gicp.h>
 #include "../Header.h"
 #include "../global_localization/scancontext/Scancontext.h"
 
+struct LoopPrecheckStats
+{
+    int candidate_num = 0;
+    int sc_rejected_num = 0;
+    int height_rejected_num = 0;
+    int overlap_rejected_num = 0;
+    int registration_num = 0; // candidates passed to gicp
+    int pair_skipped_num = 0; // skipped by failed keyframe pair cache
+    int cell_skipped_num = 0; // skipped by failed spatial cell cache
+};
+
+struct LoopFailureRecord
+{
+    int fail_num = 0;
+    double retry_time = 0;               // keyframe timestamp after which the pair may be retried
+    Eigen::Vector3f relative_translation; // ref -> cur in pose graph, when failed (pair records only)
+    float relative_yaw = 0;
+};
+
 class LoopClosure
 {
 public:
@@ -46,9 +67,317 @@ public:
         octreeDownsampling(near_keyframes, near_keyframes, icp_downsamp_size);
     }
 
-    void perform_loop_closure(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur, int loop_key_ref,
+    /**
+     * 由粗到精的多分辨率GICP配准
+     * 1.依次在coarse_resolutions(从粗到细)上配准，第一级使用大的搜索半径，之后每级搜索半径为上一级分辨率的2倍
+     * 2.任意一级不收敛或fitness超过阈值则提前放弃，只有通过所有粗配准的候选才进行icp_downsamp_size上的精配准
+     */
+    bool coarse_to_fine_registration(const PointCloudType::Ptr &source, const PointCloudType::Ptr &target, const Eigen::Matrix4f &init_guess,
+                                     Eigen::Matrix4f &final_transform, float &fitness_score, const std::string &type) const
+    {
+        Timer timer;
+        std::stringstream stage_cost;
+        final_transform = init_guess;
+        float max_correspondence_distance = loop_closure_search_radius * 2;
+
+        pcl::GeneralizedIterativeClosestPoint<PointType, PointType> gicp;
+        gicp.setTransformationEpsilon(1e-6);
+        gicp.setEuclideanFitnessEpsilon(1e-6);
+        gicp.setRANSACIterations(0);
+        PointCloudType::Ptr unused_result(new PointCloudType());
+
+        for (auto stage = 0; stage < coarse_resolutions.size(); ++stage)
+        {
+            const double &resolution = coarse_resolutions[stage];
+            PointCloudType::Ptr source_ds(new PointCloudType());
+            PointCloudType::Ptr target_ds(new PointCloudType());
+            octreeDownsampling(source, source_ds, resolution);
+            octreeDownsampling(target, target_ds, resolution);
+            // gicp需要足够的点估计协方差，点太少时跳过这一级
+            if (source_ds->size() < 50 || target_ds->size() < 50)
+                continue;
+
+            gicp.setMaxCorrespondenceDistance(max_correspondence_distance);
+            gicp.setMaximumIterations(coarse_iterations);
+            gicp.setInputSource(source_ds);
+            gicp.setInputTarget(target_ds);
+            gicp.align(*unused_result, final_transform);
+            stage_cost << resolution << "m: " << timer.elapsedLast() << "ms, ";
+
+            if (gicp.hasConverged() == false || gicp.getFitnessScore() > coarse_fitness_score_thld)
+            {
+                LOG_WARN("dartion_time = %.2f.loop closure failed by %s at coarse stage %d (resolution = %.2f)! %d, %.3f, %.3f, cost: [%s]",
+                         dartion_time, type.c_str(), stage, resolution, gicp.hasConverged(), gicp.getFitnessScore(),
+                         coarse_fitness_score_thld, stage_cost.str().c_str());
+                return false;
+            }
+            final_transform = gicp.getFinalTransformation();
+            max_correspondence_distance = resolution * 2;
+        }
+
+        gicp.setMaxCorrespondenceDistance(max_correspondence_distance);
+        gicp.setMaximumIterations(100);
+        gicp.setInputSource(source);
+        gicp.setInputTarget(target);
+        gicp.align(*unused_result, final_transform);
+        stage_cost << icp_downsamp_size << "m: " << timer.elapsedLast() << "ms";
+
+        if (gicp.hasConverged() == false || gicp.getFitnessScore() > loop_closure_fitness_score_thld)
+        {
+            LOG_WARN("dartion_time = %.2f.loop closure failed by %s at fine stage! %d, %.3f, %.3f, cost: [%s]",
+                     dartion_time, type.c_str(), gicp.hasConverged(), gicp.getFitnessScore(), loop_closure_fitness_score_thld, stage_cost.str().c_str());
+            return false;
+        }
+
+        final_transform = gicp.getFinalTransformation();
+        fitness_score = gicp.getFitnessScore();
+        LOG_INFO("dartion_time = %.2f.loop registration by %s cost: [%s]", dartion_time, type.c_str(), stage_cost.str().c_str());
+        return true;
+    }
+
+    /**
+     * 局部坐标系下关键帧的高度直方图，归一化
+     * 高度相对地面(z + LIDAR_HEIGHT)，不同安装高度下范围不用改
+     */
+    std::vector<float> height_histogram(const PointCloudType::Ptr &keyframe) const
+    {
+        const float bin_size = std::max(precheck_height_hist_bin_size, 0.01f);
+        const float min_z = precheck_height_hist_min_z, max_z = std::max(precheck_height_hist_max_z, min_z + bin_size);
+        const float lidar_height = sc_manager->LIDAR_HEIGHT;
+        std::vector<float> hist(std::ceil((max_z - min_z) / bin_size), 0);
+        int num = 0;
+        for (const auto &point : keyframe->points)
+        {
+            const float z = point.z + lidar_height;
+            if (z < min_z || z >= max_z)
+                continue;
+            ++hist[std::min(int((z - min_z) / bin_size), int(hist.size()) - 1)];
+            ++num;
+        }
+        for (auto &bin : hist)
+            bin /= std::max(num, 1);
+        return hist;
+    }
+
+    /**
+     * 当前帧(初值变换后)落在参考子图体素中的比例
+     */
+    float voxel_overlap_ratio(const PointCloudType::Ptr &cur_cloud, const PointCloudType::Ptr &ref_cloud, const Eigen::Matrix4f &init_guess) const
+    {
+        auto voxel_key = [this](const Eigen::Vector3f &p) -> int64_t
+        {
+            int64_t x = std::floor(p.x() / precheck_overlap_resolution);
+            int64_t y = std::floor(p.y() / precheck_overlap_resolution);
+            int64_t z = std::floor(p.z() / precheck_overlap_resolution);
+            return ((x & 0x1FFFFF) << 42) | ((y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
+        };
+
+        std::unordered_set<int64_t> ref_voxels;
+        ref_voxels.reserve(ref_cloud->size());
+        for (const auto &point : ref_cloud->points)
+            ref_voxels.insert(voxel_key(point.getVector3fMap()));
+
+        int overlap_num = 0;
+        for (const auto &point : cur_cloud->points)
+        {
+            Eigen::Vector3f p = init_guess.topLeftCorner<3, 3>() * point.getVector3fMap() + init_guess.topRightCorner<3, 1>();
+            if (ref_voxels.count(voxel_key(p)))
+                ++overlap_num;
+        }
+        return (float)overlap_num / std::max<int>(cur_cloud->size(), 1);
+    }
+
+    /**
+     * 配准前的廉价预检：scan context距离 -> 高度直方图 -> 体素重叠率，任一不满足则不做gicp
+     * 体素重叠率在init_guess下计算，初值只来自位姿图(odom半径搜索)时漂移越大越容易被误拒，而这正是需要闭合的闭环，
+     * 所以只对check_overlap的候选(有独立初值的scan context候选)检查
+     */
+    bool loop_precheck(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur, int loop_key_ref,
+                       const PointCloudType::Ptr &cur_cloud, const PointCloudType::Ptr &ref_cloud, const Eigen::Matrix4f &init_guess, const std::string &type,
+                       bool check_overlap)
+    {
+        ++precheck_stats.candidate_num;
+        if (precheck_stats.candidate_num % 100 == 0)
+        {
+            LOG_INFO("loop precheck: candidates = %d, rejected by (sc, height, overlap) = (%d, %d, %d), gicp = %d, failure cache skipped (pair, cell) = (%d, %d).",
+                     precheck_stats.candidate_num, precheck_stats.sc_rejected_num, precheck_stats.height_rejected_num,
+                     precheck_stats.overlap_rejected_num, precheck_stats.registration_num,
+                     precheck_stats.pair_skipped_num, precheck_stats.cell_skipped_num);
+        }
+
+        if (!precheck_enable)
+        {
+            ++precheck_stats.registration_num;
+            return true;
+        }
+
+        // 1.scan context distance
+        if (precheck_sc_dist_thld > 0 && std::max(loop_key_cur, loop_key_ref) < sc_manager->polarcontexts_.size())
+        {
+            auto sc_dist = sc_manager->distanceBtnKeyframes(loop_key_cur, loop_key_ref).first;
+            if (sc_dist > precheck_sc_dist_thld)
+            {
+                ++precheck_stats.sc_rejected_num;
+                LOG_DEBUG("loop precheck failed by %s! sc_dist = %.3f, %d -> %d", type.c_str(), sc_dist, loop_key_cur, loop_key_ref);
+                return false;
+            }
+        }
+
+        // 2.height histogram intersection
+        if (precheck_height_hist_thld > 0)
+        {
+            const auto &hist_cur = height_histogram(keyframe_scan[loop_key_cur]);
+            const auto &hist_ref = height_histogram(keyframe_scan[loop_key_ref]);
+            float similarity = 0;
+            for (auto i = 0; i < hist_cur.size(); ++i)
+                similarity += std::min(hist_cur[i], hist_ref[i]);
+            if (similarity < precheck_height_hist_thld)
+            {
+                ++precheck_stats.height_rejected_num;
+                LOG_DEBUG("loop precheck failed by %s! height_hist = %.3f, %d -> %d", type.c_str(), similarity, loop_key_cur, loop_key_ref);
+                return false;
+            }
+        }
+
+        // 3.voxel occupancy overlap
+        if (check_overlap && precheck_overlap_thld > 0)
+        {
+            float overlap = voxel_overlap_ratio(cur_cloud, ref_cloud, init_guess);
+            if (overlap < precheck_overlap_thld)
+            {
+                ++precheck_stats.overlap_rejected_num;
+                LOG_DEBUG("loop precheck failed by %s! overlap = %.3f, %d -> %d", type.c_str(), overlap, loop_key_cur, loop_key_ref);
+                return false;
+            }
+        }
+
+        ++precheck_stats.registration_num;
+        return true;
+    }
+
+    void relative_pose_in_graph(int loop_key_cur, int loop_key_ref, Eigen::Vector3f &translation, float &yaw) const
+    {
+        const auto &pose_cur = copy_keyframe_pose6d->points[loop_key_cur];
+        const auto &pose_ref = copy_keyframe_pose6d->points[loop_key_ref];
+        translation = pose_cur.getVector3fMap() - pose_ref.getVector3fMap();
+        yaw = std::atan2(std::sin(pose_cur.yaw - pose_ref.yaw), std::cos(pose_cur.yaw - pose_ref.yaw));
+    }
+
+    int64_t failure_cell_key(int loop_key_cur, int loop_key_ref) const
+    {
+        const auto &pose_cur = copy_keyframe_pose6d->points[loop_key_cur];
+        const auto &pose_ref = copy_keyframe_pose6d->points[loop_key_ref];
+        int64_t cell[4] = {(int64_t)std::floor(pose_cur.x / negative_cache_cell_size), (int64_t)std::floor(pose_cur.y / negative_cache_cell_size),
+                           (int64_t)std::floor(pose_ref.x / negative_cache_cell_size), (int64_t)std::floor(pose_ref.y / negative_cache_cell_size)};
+        return ((cell[0] & 0xFFFF) << 48) | ((cell[1] & 0xFFFF) << 32) | ((cell[2] & 0xFFFF) << 16) | (cell[3] & 0xFFFF);
+    }
+
+    /**
+     * 判断位姿图中两帧的相对位姿相对失败记录是否明显变化(如其他闭环/gps优化之后)
+     * 只对闭环对记录有意义，网格记录保存的是网格内另一对帧的相对位姿
+     */
+    bool graph_changed_since_failure(const LoopFailureRecord &record, int loop_key_cur, int loop_key_ref) const
+    {
+        Eigen::Vector3f translation;
+        float yaw;
+        relative_pose_in_graph(loop_key_cur, loop_key_ref, translation, yaw);
+        float yaw_diff = std::atan2(std::sin(yaw - record.relative_yaw), std::cos(yaw - record.relative_yaw));
+        return (translation - record.relative_translation).norm() > negative_cache_graph_change_dist ||
+               std::abs(yaw_diff) > negative_cache_graph_change_yaw;
+    }
+
+    /**
+     * 判断之前失败过的闭环对是否需要跳过
+     * 1.该闭环对在位姿图中的相对位姿相对其自身失败时明显变化，允许重试(同时绕过网格记录)
+     * 2.否则在闭环对或所在网格的退避时间内跳过，退避时间随失败次数指数增长
+     */
+    bool is_known_failed_loop(int loop_key_cur, int loop_key_ref)
+    {
+        if (!negative_cache_enable)
+            return false;
+
+        const double cur_time = copy_keyframe_pose6d->back().time;
+        auto pair_it = failed_loop_pairs.find(((int64_t)loop_key_cur << 32) | loop_key_ref);
+        if (pair_it != failed_loop_pairs.end())
+        {
+            if (graph_changed_since_failure(pair_it->second, loop_key_cur, loop_key_ref))
+                return false;
+            if (cur_time < pair_it->second.retry_time)
+            {
+                ++precheck_stats.pair_skipped_num;
+                return true;
+            }
+        }
+
+        auto cell_it = failed_loop_cells.find(failure_cell_key(loop_key_cur, loop_key_ref));
+        if (cell_it != failed_loop_cells.end() && cur_time < cell_it->second.retry_time)
+        {
+            ++precheck_stats.cell_skipped_num;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * 记录闭环结果
+     * 预检(sc距离/高度直方图/重叠率)的结果对固定的一对帧是确定的，只记到闭环对，不影响同一网格内的其他帧对；
+     * 配准失败(update_cell)时所在网格也退避
+     */
+    void record_loop_result(int loop_key_cur, int loop_key_ref, bool success, bool update_cell = true)
+    {
+        if (!negative_cache_enable)
+            return;
+
+        int64_t pair_key = ((int64_t)loop_key_cur << 32) | loop_key_ref;
+        int64_t cell_key = failure_cell_key(loop_key_cur, loop_key_ref);
+        evict_stale_failure_records(failed_loop_pairs);
+        evict_stale_failure_records(failed_loop_cells);
+        if (success)
+        {
+            failed_loop_pairs.erase(pair_key);
+            failed_loop_cells.erase(cell_key);
+            return;
+        }
+
+        auto &pair_record = failed_loop_pairs[pair_key];
+        update_failure_record(pair_record);
+        relative_pose_in_graph(loop_key_cur, loop_key_ref, pair_record.relative_translation, pair_record.relative_yaw);
+        if (update_cell)
+            update_failure_record(failed_loop_cells[cell_key]);
+    }
+
+    /**
+     * 退避结束后又过了negative_cache_max_backoff仍没有再失败的记录删除，避免长时间运行时记录一直增长；
+     * 刚结束退避的记录保留，重试再失败时退避时间继续翻倍
+     */
+    void evict_stale_failure_records(std::unordered_map<int64_t, LoopFailureRecord> &records) const
+    {
+        const double stale_time = copy_keyframe_pose6d->back().time - negative_cache_max_backoff;
+        for (auto it = records.begin(); it != records.end();)
+        {
+            if (it->second.retry_time < stale_time)
+                it = records.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void update_failure_record(LoopFailureRecord &record) const
+    {
+        record.fail_num = std::min(record.fail_num + 1, 16);
+        double backoff = std::min(negative_cache_backoff * (1 << (record.fail_num - 1)), negative_cache_max_backoff);
+        record.retry_time = copy_keyframe_pose6d->back().time + backoff;
+    }
+
+    bool perform_loop_closure(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur, int loop_key_ref,
                               const std::string &type, bool use_guess = false, const Eigen::Matrix4f &init_guess = Eigen::Matrix4f::Identity())
     {
+        if (is_known_failed_loop(loop_key_cur, loop_key_ref))
+        {
+            LOG_DEBUG("loop %d -> %d by %s skipped by failure cache.", loop_key_cur, loop_key_ref, type.c_str());
+            return false;
+        }
+
         // extract cloud
         PointCloudType::Ptr cur_keyframe_cloud(new PointCloudType());
         PointCloudType::Ptr ref_near_keyframe_cloud(new PointCloudType());
@@ -57,46 +386,40 @@ public:
             loop_find_near_keyframes(ref_near_keyframe_cloud, loop_key_ref, keyframe_search_num, keyframe_scan);
             if (cur_keyframe_cloud->size() < 300 || ref_near_keyframe_cloud->size() < 1000)
             {
-                return;
+                return false;
             }
 
             // publish loop submap
             *prevKeyframeCloud = *ref_near_keyframe_cloud;
         }
 
-        // GICP match
-        pcl::GeneralizedIterativeClosestPoint<PointType, PointType> gicp;
-        gicp.setMaxCorrespondenceDistance(loop_closure_search_radius * 2);
-        gicp.setMaximumIterations(100);
-        gicp.setTransformationEpsilon(1e-6);
-        gicp.setEuclideanFitnessEpsilon(1e-6);
-        gicp.setRANSACIterations(0);
-
-        gicp.setInputSource(cur_keyframe_cloud);
-        gicp.setInputTarget(ref_near_keyframe_cloud);
-        PointCloudType::Ptr unused_result(new PointCloudType());
-        if (use_guess)
-            gicp.align(*unused_result, init_guess);
-        else
-            gicp.align(*unused_result);
+        const Eigen::Matrix4f &guess = use_guess ? init_guess : Eigen::Matrix4f(Eigen::Matrix4f::Identity());
+        if (!loop_precheck(keyframe_scan, loop_key_cur, loop_key_ref, cur_keyframe_cloud, ref_near_keyframe_cloud, guess, type, use_guess))
+        {
+            record_loop_result(loop_key_cur, loop_key_ref, false, false);
+            return false;
+        }
 
-        if (gicp.hasConverged() == false || gicp.getFitnessScore() > loop_closure_fitness_score_thld)
+        Eigen::Matrix4f final_transform;
+        float fitness_score;
+        if (!coarse_to_fine_registration(cur_keyframe_cloud, ref_near_keyframe_cloud, guess, final_transform, fitness_score, type))
         {
-            LOG_WARN("dartion_time = %.2f.loop closure failed by %s! %d, %.3f, %.3f", dartion_time, type.c_str(), gicp.hasConverged(), gicp.getFitnessScore(), loop_closure_fitness_score_thld);
-            return;
+            record_loop_result(loop_key_cur, loop_key_ref, false);
+            return false;
         }
+        record_loop_result(loop_key_cur, loop_key_ref, true);
 
         // publish corrected cloud
         {
             PointCloudType::Ptr corrected_cloud(new PointCloudType());
-            pcl::transformPointCloud(*cur_keyframe_cloud, *corrected_cloud, gicp.getFinalTransformation());
+            pcl::transformPointCloud(*cur_keyframe_cloud, *corrected_cloud, final_transform);
             *curKeyframeCloud = *corrected_cloud;
         }
 
         float x, y, z, roll, pitch, yaw;
         Eigen::Affine3f correctionLidarFrame;
-        correctionLidarFrame = gicp.getFinalTransformation();
-        float noiseScore = gicp.getFitnessScore();
+        correctionLidarFrame = final_transform;
+        float noiseScore = fitness_score;
 
 #if 0
         if (is_vaild_loop_time_period(dartion_time, loop_vaild_period["manually"]))
@@ -126,15 +449,15 @@ public:
 
         LOG_INFO("dartion_time = %.2f.Loop Factor Added by %s! keyframe id = %d, noise = %.3f.", dartion_time, type.c_str(), loop_key_ref, noiseScore);
         loop_constraint_records[loop_key_cur] = loop_key_ref;
+        return true;
     }
 
-    void detect_loop_by_distance(const deque<PointCloudType::Ptr> &keyframe_scan)
+    void detect_loop_by_distance(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur)
     {
-        int latest_id = copy_keyframe_pose6d->size() - 1; // 当前关键帧索引
-        int closest_id = -1;                              // 最近关键帧索引
+        int closest_id = -1; // 最近关键帧索引
 
         // 当前帧已经添加过闭环对应关系，不再继续添加
-        auto it = loop_constraint_records.find(latest_id);
+        auto it = loop_constraint_records.find(loop_key_cur);
         if (it != loop_constraint_records.end())
             return;
 
@@ -142,60 +465,74 @@ public:
         std::vector<int> indices;
         std::vector<float> distances;
         kdtree_history_keyframe_pose->setInputCloud(copy_keyframe_pose6d);
-        kdtree_history_keyframe_pose->radiusSearch(copy_keyframe_pose6d->back(), loop_closure_search_radius, indices, distances, 0);
+        kdtree_history_keyframe_pose->radiusSearch(copy_keyframe_pose6d->points[loop_key_cur], loop_closure_search_radius, indices, distances, 0);
         for (int i = 0; i < (int)indices.size(); ++i)
         {
             int id = indices[i];
-            if (abs(id - latest_id) > loop_closure_keyframe_interval)
+            // 只和更早的关键帧构成闭环
+            if (loop_key_cur - id > loop_closure_keyframe_interval)
             {
                 closest_id = id;
                 break;
             }
         }
-        if (closest_id == -1 || latest_id == closest_id)
+        if (closest_id == -1 || loop_key_cur == closest_id)
             return;
 
-        perform_loop_closure(keyframe_scan, latest_id, closest_id, "odom");
+        perform_loop_closure(keyframe_scan, loop_key_cur, closest_id, "odom");
     }
 
-    void detect_loop_by_scancontext(const deque<PointCloudType::Ptr> &keyframe_scan)
+    /**
+     * 按scan context距离从小到大依次尝试前sc_top_k个候选，第一个配准成功的作为闭环
+     */
+    void detect_loop_by_scancontext(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur)
     {
-        int loop_key_cur = copy_keyframe_pose6d->size() - 1;
-
-        auto detectResult = sc_manager->detectLoopClosureID(50); // first: nn index, second: yaw diff
-        int loop_key_ref = detectResult.first;
-        float sc_yaw_rad = detectResult.second; // sc2右移 <=> lidar左转 <=> 左+sc_yaw_rad
+        auto candidates = sc_manager->detectLoopClosureCandidates(50, loop_key_cur, sc_top_k);
+        for (const auto &candidate : candidates)
+        {
+            int loop_key_ref = candidate.index;
+            float sc_yaw_rad = candidate.yaw_rad; // sc2右移 <=> lidar左转 <=> 左+sc_yaw_rad
 
-        if (loop_key_ref == -1)
-            return;
+            if (loop_key_cur - loop_key_ref <= loop_closure_keyframe_interval)
+                continue;
 
-        const auto &pose_ref = copy_keyframe_pose6d->points[loop_key_ref];
-        Eigen::Matrix4f pose_ref_mat = EigenMath::CreateAffineMatrix(V3D(pose_ref.x, pose_ref.y, pose_ref.z), V3D(pose_ref.roll, pose_ref.pitch, pose_ref.yaw + sc_yaw_rad)).cast<float>();
-        const auto &pose_cur = copy_keyframe_pose6d->back();
-        Eigen::Matrix4f pose_cur_mat = EigenMath::CreateAffineMatrix(V3D(pose_cur.x, pose_cur.y, pose_cur.z), V3D(pose_cur.roll, pose_cur.pitch, pose_cur.yaw)).cast<float>();
+            const auto &pose_ref = copy_keyframe_pose6d->points[loop_key_ref];
+            Eigen::Matrix4f pose_ref_mat = EigenMath::CreateAffineMatrix(V3D(pose_ref.x, pose_ref.y, pose_ref.z), V3D(pose_ref.roll, pose_ref.pitch, pose_ref.yaw + sc_yaw_rad)).cast<float>();
+            const auto &pose_cur = copy_keyframe_pose6d->points[loop_key_cur];
+            Eigen::Matrix4f pose_cur_mat = EigenMath::CreateAffineMatrix(V3D(pose_cur.x, pose_cur.y, pose_cur.z), V3D(pose_cur.roll, pose_cur.pitch, pose_cur.yaw)).cast<float>();
 
-        perform_loop_closure(keyframe_scan, loop_key_cur, loop_key_ref, "scancontext", true, pose_cur_mat.inverse() * pose_ref_mat);
+            if (perform_loop_closure(keyframe_scan, loop_key_cur, loop_key_ref, "scancontext", true, pose_cur_mat.inverse() * pose_ref_mat))
+                return;
+        }
     }
 
-    void run(const deque<PointCloudType::Ptr> &keyframe_scan)
+    /**
+     * 为loop_key_cur关键帧检测闭环，loop_key_cur < 0 时使用最新关键帧
+     */
+    void run(const deque<PointCloudType::Ptr> &keyframe_scan, int loop_key_cur = -1)
     {
         if (copy_keyframe_pose6d->points.size() < loop_keyframe_num_thld)
         {
             return;
         }
 
-        dartion_time = copy_keyframe_pose6d->back().time - copy_keyframe_pose6d->front().time;
+        if (loop_key_cur < 0)
+            loop_key_cur = copy_keyframe_pose6d->size() - 1;
+        if (loop_key_cur >= copy_keyframe_pose6d->size() || loop_key_cur >= keyframe_scan.size())
+            return;
+
+        dartion_time = copy_keyframe_pose6d->points[loop_key_cur].time - copy_keyframe_pose6d->front().time;
 
         // 1.在历史关键帧中查找与当前关键帧距离最近的关键帧
         if (is_vaild_loop_time_period(dartion_time, loop_vaild_period["odom"]))
         {
-            detect_loop_by_distance(keyframe_scan);
+            detect_loop_by_distance(keyframe_scan, loop_key_cur);
         }
 
         // 2.scan context
         if (is_vaild_loop_time_period(dartion_time, loop_vaild_period["scancontext"]))
         {
-            detect_loop_by_scancontext(keyframe_scan);
+            detect_loop_by_scancontext(keyframe_scan, loop_key_cur);
         }
     }
 
@@ -238,8 +575,33 @@ public:
     float loop_closure_search_radius = 10;
     int loop_closure_keyframe_interval = 30;
     int keyframe_search_num = 20;
+    int sc_top_k = 3; // scan context candidates tried per keyframe, best first
     float loop_closure_fitness_score_thld = 0.05;
     float icp_downsamp_size = 0.1;
+    std::vector<double> coarse_resolutions = {1.0, 0.5}; // meter, from coarse to fine
+    int coarse_iterations = 20;
+    float coarse_fitness_score_thld = 1.0;
+
+    // cheap rejectors before gicp, threshold <= 0 disables the stage
+    bool precheck_enable = true;
+    float precheck_sc_dist_thld = 0.6;
+    float precheck_height_hist_thld = 0.5;
+    float precheck_height_hist_min_z = -1.0;    // meter above ground, scan_context/lidar_height
+    float precheck_height_hist_max_z = 9.0;     // meter above ground
+    float precheck_height_hist_bin_size = 0.5;  // meter
+    float precheck_overlap_resolution = 2.0;
+    float precheck_overlap_thld = 0; // 召回率在真实数据上验证之前默认关闭
+    LoopPrecheckStats precheck_stats;
+
+    // negative-result cache of failed loop pairs
+    bool negative_cache_enable = true;
+    float negative_cache_cell_size = 2.0;          // meter
+    double negative_cache_backoff = 5.0;           // second, doubled after each failure
+    double negative_cache_max_backoff = 120.0;     // second
+    float negative_cache_graph_change_dist = 0.5;  // meter, retry when relative pose in graph changed more than it
+    float negative_cache_graph_change_yaw = 0.05;  // radian
+    std::unordered_map<int64_t, LoopFailureRecord> failed_loop_pairs; // key: <cur, ref>
+    std::unordered_map<int64_t, LoopFailureRecord> failed_loop_cells; // key: <cur cell, ref cell>
 
     pcl::PointCloud<PointXYZIRPYT>::Ptr copy_keyframe_pose6d;
     pcl::KdTreeFLANN<PointXYZIRPYT>::Ptr kdtree_history_keyframe_pose;